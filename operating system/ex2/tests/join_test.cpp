@@ -0,0 +1,82 @@
+#include "uthreads_extensions.h"
+#include <cstdio>
+
+
+/*
+ * Regression test for uthread_join called by the main thread: the main thread can't be blocked, so while it waits the
+ * joined thread may block or sleep itself and leave nothing else to run.
+ */
+
+
+#define QUANTUM_USECS 1000
+#define BLOCKER_EXIT_VAL 42
+#define SLEEPER_EXIT_VAL 7
+#define SLEEP_QUANTUMS 5
+
+
+int fails = 0;
+int blocker_tid = -1;
+
+
+#define CHECK(condition) do { if (!(condition)) { printf("check failed (line %d): %s\n", __LINE__, #condition); \
+    fails++; } } while (0)
+
+
+/**
+ * Blocks itself, and exits once it is resumed.
+ */
+void blocker(){
+    CHECK(uthread_block(uthread_get_tid()) == 0);
+    uthread_exit(BLOCKER_EXIT_VAL);
+}
+
+
+/**
+ * Resumes the blocker after a few quantums.
+ */
+void resumer(){
+    for (int i = 0; i < 3; ++i) {
+        uthread_yield();
+    }
+    CHECK(uthread_resume(blocker_tid) == 0);
+    uthread_exit(0);
+}
+
+
+/**
+ * Sleeps, and exits once it wakes up.
+ */
+void sleeper(){
+    CHECK(uthread_sleep(SLEEP_QUANTUMS) == 0);
+    uthread_exit(SLEEPER_EXIT_VAL);
+}
+
+
+int main(){
+    uthread_init(QUANTUM_USECS);
+    int exit_value = -1;
+
+    // The joined thread blocks itself, while the main thread is the only other runnable thread.
+    blocker_tid = uthread_spawn(blocker);
+    uthread_yield();
+    CHECK(uthread_spawn(resumer) != -1);
+    CHECK(uthread_join(blocker_tid, &exit_value) == 0);
+    CHECK(exit_value == BLOCKER_EXIT_VAL);
+
+    // The joined thread blocks itself with nothing else to run until the main thread resumes it.
+    blocker_tid = uthread_spawn_joinable(blocker);
+    uthread_yield();
+    CHECK(uthread_resume(blocker_tid) == 0);
+    CHECK(uthread_join(blocker_tid, &exit_value) == 0);
+    CHECK(exit_value == BLOCKER_EXIT_VAL);
+
+    // The joined thread sleeps: the quantums it waits for keep starting while the main thread waits.
+    int sleeper_tid = uthread_spawn(sleeper);
+    int start = uthread_get_total_quantums();
+    CHECK(uthread_join(sleeper_tid, &exit_value) == 0);
+    CHECK(exit_value == SLEEPER_EXIT_VAL);
+    CHECK(uthread_get_total_quantums() - start > SLEEP_QUANTUMS);
+
+    printf("%s\n", fails ? "FAIL" : "PASS");
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,156 @@
+#include "uthreads_extensions.h"
+#include "uthread_task.h"
+#include <cstdio>
+#include <string>
+#include <signal.h>
+#include <unistd.h>
+
+
+/*
+ * Tests the coroutine tasks: nested tasks, a channel fed by a stackful thread, sleeping tasks next to a stackful thread,
+ * and the first uthread::spawn of the process made at a quantum boundary.
+ */
+
+
+#define QUANTUM_USECS 1000
+#define TIMEOUT_SECONDS 20 // A hang fails the test with SIGALRM.
+#define NUM_OF_MESSAGES 50
+#define END_OF_MESSAGES 0
+#define NUM_OF_ROUNDS 4
+
+
+int fails = 0;
+bool first_task_done = false;
+int nested_result = 0;
+long received_sum = 0;
+bool consumer_done = false;
+std::string events; // 'T' for every round of the sleeping task, 'S' for every quantum of the stackful thread.
+bool sleeper_done = false;
+bool stackful_done = false;
+uthread::channel<int> messages;
+
+
+#define CHECK(condition) do { if (!(condition)) { printf("check failed (line %d): %s\n", __LINE__, #condition); \
+    fails++; } } while (0)
+
+
+uthread::task<void> first_task(){
+    first_task_done = true;
+    co_return;
+}
+
+
+uthread::task<int> square_later(int value){
+    co_await uthread::sleep(1);
+    co_return value * value;
+}
+
+
+uthread::task<void> nested_task(){
+    int square = co_await square_later(7);
+    nested_result = square + co_await square_later(2);
+}
+
+
+uthread::task<void> consumer(){
+    while (true) {
+        int message = co_await messages.recv();
+        if (message == END_OF_MESSAGES) {
+            break;
+        }
+        received_sum += message;
+    }
+    consumer_done = true;
+}
+
+
+/**
+ * Sends the messages from a stackful thread, yielding between them.
+ */
+void producer(){
+    for (int i = 1; i <= NUM_OF_MESSAGES; ++i) {
+        messages.send(i);
+        uthread_yield();
+    }
+    messages.send(END_OF_MESSAGES);
+    uthread_exit(0);
+}
+
+
+uthread::task<void> sleeper(){
+    for (int i = 0; i < NUM_OF_ROUNDS; ++i) {
+        events += 'T';
+        co_await uthread::sleep(2);
+    }
+    sleeper_done = true;
+}
+
+
+/**
+ * Runs a quantum at a time next to the sleeping task.
+ */
+void stackful(){
+    while (!sleeper_done) {
+        events += 'S';
+        uthread_yield();
+    }
+    stackful_done = true;
+    uthread_exit(0);
+}
+
+
+/**
+ * Yields the main thread until done is set.
+ */
+void wait_for(const bool &done){
+    while (!done) {
+        uthread_yield();
+    }
+}
+
+
+/**
+ * Makes the first uthread::spawn of the process while a SIGVTALRM is pending, so a new quantum starts as soon as the
+ * signal is unblocked, with the task host that was just spawned at the front of the READY queue.
+ */
+void spawn_first_task_at_quantum_boundary(){
+    sigset_t timer_signal;
+    sigset_t pending;
+    sigemptyset(&timer_signal);
+    sigaddset(&timer_signal, SIGVTALRM);
+    sigprocmask(SIG_BLOCK, &timer_signal, nullptr);
+    do {
+        sigpending(&pending);
+    } while (!sigismember(&pending, SIGVTALRM));
+    CHECK(uthread::spawn(first_task()) == 0);
+    sigprocmask(SIG_UNBLOCK, &timer_signal, nullptr);
+    wait_for(first_task_done);
+}
+
+
+int main(){
+    alarm(TIMEOUT_SECONDS);
+    uthread_init(QUANTUM_USECS);
+    spawn_first_task_at_quantum_boundary();
+
+    CHECK(uthread::spawn(nested_task()) == 0);
+    while (nested_result == 0) {
+        uthread_yield();
+    }
+    CHECK(nested_result == 49 + 4);
+
+    CHECK(uthread::spawn(consumer()) == 0);
+    CHECK(uthread_spawn(producer) != -1);
+    wait_for(consumer_done);
+    CHECK(received_sum == NUM_OF_MESSAGES * (NUM_OF_MESSAGES + 1) / 2);
+
+    CHECK(uthread::spawn(sleeper()) == 0);
+    CHECK(uthread_spawn(stackful) != -1);
+    wait_for(stackful_done);
+    // Every round of the sleeping task is followed by quantums of the stackful thread before the next one.
+    CHECK(events.size() > NUM_OF_ROUNDS && events[0] == 'T');
+    CHECK(events.find("TT") == std::string::npos);
+
+    printf("%s\n", fails ? "FAIL" : "PASS");
+    return fails ? 1 : 0;
+}
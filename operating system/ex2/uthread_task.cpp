@@ -0,0 +1,170 @@
+#include "uthreads.h"
+#include "uthread_task.h"
+#include <vector>
+#include <deque>
+#include "iostream"
+#include "signal.h"
+
+
+#define SYSTEM_ERROR "System error: "
+#define SIGNALS_BLOCK_ERROR "unable to block / unblock signals."
+#define FAILURE -1
+#define SUCCESS 0
+#define NO_THREAD -1
+#define SPAWNING_HOST -2 // task_host_tid while the first call to spawn_detached is spawning the host.
+
+
+using namespace std;
+
+
+/**
+ * A task waiting for a number of quantums to pass.
+ */
+struct TaskTimer {
+    int quantums_left;
+    coroutine_handle<> handle;
+};
+
+
+/**
+ * A task waiting for a file descriptor to become ready.
+ */
+struct TaskFdWait {
+    int fd;
+    short events;
+    coroutine_handle<> handle;
+};
+
+
+deque<coroutine_handle<>> ready_tasks;
+vector<TaskTimer> task_timers;
+vector<TaskFdWait> task_fd_waits;
+vector<pollfd> poll_items;
+int task_host_tid = NO_THREAD;
+bool task_host_idle = false;
+
+
+uthread::detail::critical_section::critical_section(){
+    sigset_t scheduler_signals;
+    if (sigemptyset(&scheduler_signals) == FAILURE || sigaddset(&scheduler_signals, SIGVTALRM) == FAILURE ||
+        sigprocmask(SIG_BLOCK, &scheduler_signals, &old_mask_) == FAILURE){
+        cerr << SYSTEM_ERROR << SIGNALS_BLOCK_ERROR << endl;
+        exit(1);
+    }
+}
+
+
+uthread::detail::critical_section::~critical_section(){
+    if (sigprocmask(SIG_SETMASK, &old_mask_, nullptr) == FAILURE){
+        cerr << SYSTEM_ERROR << SIGNALS_BLOCK_ERROR << endl;
+        exit(1);
+    }
+}
+
+
+/**
+ * Wakes the task host if it is parked. Must be called with the scheduler signals blocked.
+ */
+void wake_task_host(){
+    if (task_host_idle && !ready_tasks.empty()){
+        task_host_idle = false;
+        uthread::detail::wake_thread(task_host_tid);
+    }
+}
+
+
+/**
+ * Entry point of the task host thread: resumes ready tasks one after the other, and blocks itself while there is
+ * nothing to run. The host is preempted like any other thread, in the middle of a task if needed.
+ */
+void task_host_main(){
+    {
+        // The host may run before uthread_spawn returned to spawn_detached, which assigns its ID too.
+        uthread::detail::critical_section section;
+        task_host_tid = uthread_get_tid();
+    }
+    while (true){
+        coroutine_handle<> next;
+        {
+            uthread::detail::critical_section section;
+            while (ready_tasks.empty()){
+                task_host_idle = true;
+                uthread_block(uthread_get_tid());
+            }
+            next = ready_tasks.front();
+            ready_tasks.pop_front();
+        }
+        next.resume();
+    }
+}
+
+
+void uthread::detail::schedule(coroutine_handle<> handle){
+    critical_section section;
+    ready_tasks.push_back(handle);
+    wake_task_host();
+}
+
+
+void uthread::detail::add_timer(coroutine_handle<> handle, int num_quantums){
+    critical_section section;
+    task_timers.push_back({num_quantums, handle});
+}
+
+
+void uthread::detail::add_fd_wait(coroutine_handle<> handle, int fd, short events){
+    critical_section section;
+    task_fd_waits.push_back({fd, events, handle});
+}
+
+
+int uthread::detail::spawn_detached(coroutine_handle<> handle){
+    {
+        critical_section section;
+        if (task_host_tid == NO_THREAD){
+            // If the scheduler runs other threads inside uthread_spawn, the host may start before it returns, and
+            // another caller may get here: it sees SPAWNING_HOST and only schedules its task, for the host to run.
+            task_host_tid = SPAWNING_HOST;
+            int tid = uthread_spawn(task_host_main);
+            if (tid == FAILURE){
+                task_host_tid = NO_THREAD;
+                handle.destroy();
+                return FAILURE;
+            }
+            task_host_tid = tid;
+        }
+    }
+    schedule(handle);
+    return SUCCESS;
+}
+
+
+void uthread::detail::on_quantum(){
+    auto timer = task_timers.begin();
+    while (timer != task_timers.end()){
+        if (--timer->quantums_left <= 0){
+            ready_tasks.push_back(timer->handle);
+            timer = task_timers.erase(timer);
+            continue;
+        }
+        timer++;
+    }
+    if (!task_fd_waits.empty()){
+        poll_items.clear();
+        for (const auto &wait : task_fd_waits){
+            poll_items.push_back({wait.fd, wait.events, 0});
+        }
+        if (poll(poll_items.data(), poll_items.size(), 0) > 0){
+            size_t kept = 0;
+            for (size_t i = 0; i < task_fd_waits.size(); ++i){
+                if (poll_items[i].revents != 0){
+                    ready_tasks.push_back(task_fd_waits[i].handle);
+                } else {
+                    task_fd_waits[kept++] = task_fd_waits[i];
+                }
+            }
+            task_fd_waits.resize(kept);
+        }
+    }
+    wake_task_host();
+}
@@ -0,0 +1,343 @@
+#ifndef _UTHREAD_TASK_H
+#define _UTHREAD_TASK_H
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <utility>
+#include <poll.h>
+#include <signal.h>
+
+
+/*
+ * Stackless tasks on top of the uthreads library.
+ *
+ * A task is a C++20 coroutine that runs on a single "task host" uthread. The host is an ordinary uthread: it sits in
+ * the scheduler's READY queue while there are runnable tasks and gets preempted by SIGVTALRM like everyone else, so
+ * tasks and stackful uthreads share the CPU through the same run queue. A suspended task costs its coroutine frame and
+ * a queue entry, instead of a STACK_SIZE stack and a sigjmp_buf.
+ *
+ * Example:
+ *     uthread::task<void> handler(uthread::channel<int> &requests){
+ *         while (true) {
+ *             int request = co_await requests.recv();
+ *             co_await uthread::sleep(2);
+ *             ...
+ *         }
+ *     }
+ *     uthread::spawn(handler(requests));
+ */
+namespace uthread {
+
+
+namespace detail {
+    /**
+     * Blocks the scheduler signals for the lifetime of the object (restoring the previous mask on destruction), so the
+     * task queues can't be modified by the scheduler while we are working on them.
+     */
+    class critical_section {
+        sigset_t old_mask_{};
+    public:
+        critical_section();
+        ~critical_section();
+        critical_section(const critical_section&) = delete;
+        critical_section& operator=(const critical_section&) = delete;
+    };
+
+    /**
+     * Adds a suspended coroutine to the end of the task READY queue and wakes the task host if needed.
+     */
+    void schedule(std::coroutine_handle<> handle);
+
+    /**
+     * Parks a suspended coroutine for num_quantums quantums.
+     */
+    void add_timer(std::coroutine_handle<> handle, int num_quantums);
+
+    /**
+     * Parks a suspended coroutine until fd reports one of the poll() events in 'events'.
+     */
+    void add_fd_wait(std::coroutine_handle<> handle, int fd, short events);
+
+    /**
+     * Takes ownership of a top-level task frame and schedules it.
+     * @return On success, return 0. On failure, return -1.
+     */
+    int spawn_detached(std::coroutine_handle<> handle);
+
+    /**
+     * Called by the scheduler once per quantum (signals are blocked): wakes expired timers and ready file descriptors.
+     */
+    void on_quantum();
+
+    /**
+     * Moves the thread with ID tid from BLOCKED to READY. Must be called with the scheduler signals blocked, it is
+     * implemented in uthreads.cpp.
+     */
+    void wake_thread(int tid);
+
+
+    /**
+     * The part of the promise that doesn't depend on the result type.
+     */
+    struct promise_base {
+        std::coroutine_handle<> continuation_ = nullptr;
+        bool detached_ = false;
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        /**
+         * On completion transfers control straight to the awaiting task (or destroys a detached frame).
+         */
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+
+            template<typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                promise_base &promise = handle.promise();
+                if (promise.detached_) {
+                    handle.destroy();
+                    return std::noop_coroutine();
+                }
+                if (promise.continuation_) {
+                    return promise.continuation_;
+                }
+                return std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        final_awaiter final_suspend() noexcept { return {}; }
+
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+}
+
+
+/**
+ * A lazily started coroutine producing a value of type T. A task starts running when it is awaited (or spawned) and
+ * its frame is freed together with the task object.
+ */
+template<typename T>
+class task {
+public:
+    struct promise_type : detail::promise_base {
+        T value_{};
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+        void return_value(T value) { value_ = std::move(value); }
+    };
+
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task(){
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation_ = awaiting;
+        return handle_;
+    }
+
+    T await_resume() { return std::move(handle_.promise().value_); }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+
+    friend int spawn(task<void> &&new_task);
+};
+
+
+/**
+ * A task that produces no value.
+ */
+template<>
+class task<void> {
+public:
+    struct promise_type : detail::promise_base {
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+        void return_void() {}
+    };
+
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task(){
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation_ = awaiting;
+        return handle_;
+    }
+
+    void await_resume() {}
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+
+    friend int spawn(task<void> &&new_task);
+};
+
+
+/**
+ * @brief Starts a top-level task on the task host.
+ *
+ * The task host uthread is spawned on the first call, so this function counts against MAX_THREAD_NUM once. The task
+ * frame is released when the task finishes.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+inline int spawn(task<void> &&new_task){
+    std::coroutine_handle<task<void>::promise_type> handle = std::exchange(new_task.handle_, nullptr);
+    handle.promise().detached_ = true;
+    return detail::spawn_detached(handle);
+}
+
+
+/**
+ * Awaitable returned by uthread::sleep.
+ */
+class sleep_awaiter {
+    int num_quantums_;
+public:
+    explicit sleep_awaiter(int num_quantums) : num_quantums_(num_quantums) {}
+    bool await_ready() const noexcept { return num_quantums_ <= 0; }
+    void await_suspend(std::coroutine_handle<> handle) { detail::add_timer(handle, num_quantums_); }
+    void await_resume() noexcept {}
+};
+
+
+/**
+ * @brief Suspends the calling task for num_quantums quantums (same counting as uthread_sleep).
+ */
+inline sleep_awaiter sleep(int num_quantums){
+    return sleep_awaiter(num_quantums);
+}
+
+
+/**
+ * Awaitable returned by uthread::readable / uthread::writable.
+ */
+class fd_awaiter {
+    int fd_;
+    short events_;
+public:
+    fd_awaiter(int fd, short events) : fd_(fd), events_(events) {}
+    bool await_ready() const noexcept {
+        struct pollfd item = {fd_, events_, 0};
+        return poll(&item, 1, 0) > 0;
+    }
+    void await_suspend(std::coroutine_handle<> handle) { detail::add_fd_wait(handle, fd_, events_); }
+    void await_resume() noexcept {}
+};
+
+
+/**
+ * @brief Suspends the calling task until fd has data to read (or was closed / errored).
+ */
+inline fd_awaiter readable(int fd){
+    return fd_awaiter(fd, POLLIN);
+}
+
+
+/**
+ * @brief Suspends the calling task until fd can be written to without blocking.
+ */
+inline fd_awaiter writable(int fd){
+    return fd_awaiter(fd, POLLOUT);
+}
+
+
+/**
+ * An unbounded multi-producer multi-consumer channel. send can be called from tasks and from regular uthreads,
+ * recv must be awaited from a task. Receivers are served in FIFO order.
+ */
+template<typename T>
+class channel {
+    struct receiver {
+        std::coroutine_handle<> handle;
+        T *slot;
+    };
+
+    std::deque<T> buffer_;
+    std::deque<receiver> receivers_;
+
+public:
+    /**
+     * Awaitable returned by channel::recv.
+     */
+    class recv_awaiter {
+        channel &channel_;
+        T value_{};
+    public:
+        explicit recv_awaiter(channel &owner) : channel_(owner) {}
+
+        bool await_ready() {
+            detail::critical_section section;
+            if (channel_.buffer_.empty()) {
+                return false;
+            }
+            value_ = std::move(channel_.buffer_.front());
+            channel_.buffer_.pop_front();
+            return true;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            detail::critical_section section;
+            // A sender may have run between await_ready and now.
+            if (!channel_.buffer_.empty()) {
+                value_ = std::move(channel_.buffer_.front());
+                channel_.buffer_.pop_front();
+                return false;
+            }
+            channel_.receivers_.push_back({handle, &value_});
+            return true;
+        }
+
+        T await_resume() { return std::move(value_); }
+    };
+
+    /**
+     * Hands value to the oldest waiting receiver, or buffers it if nobody is waiting. Never blocks.
+     */
+    void send(T value){
+        detail::critical_section section;
+        if (receivers_.empty()) {
+            buffer_.push_back(std::move(value));
+            return;
+        }
+        receiver waiting = receivers_.front();
+        receivers_.pop_front();
+        *waiting.slot = std::move(value);
+        detail::schedule(waiting.handle);
+    }
+
+    /**
+     * @return an awaitable that yields the next value sent on the channel.
+     */
+    recv_awaiter recv(){
+        return recv_awaiter(*this);
+    }
+};
+
+
+}
+
+#endif
@@ -1,4 +1,6 @@
 #include "uthreads.h"
+#include "uthreads_extensions.h"
+#include "uthread_task.h"
 #include <string>
 #include <set>
 #include <vector>
@@ -25,15 +27,22 @@
 #define ENVIRONMENT_SETUP_ERROR "could not setup thread environment."
 #define ENVIRONMENT_SAVING_ERROR "could not save running thread environment."
 #define ENTRY_POINT_ERROR "entry point can't be null."
+#define JOIN_SELF_ERROR "a thread can't join itself."
+#define JOIN_MAIN_ERROR "the main thread can't be joined."
+#define JOIN_TWICE_ERROR "the thread is already being joined by another thread."
+#define JOIN_DEADLOCK_ERROR "joining the thread would cause a deadlock."
+#define DETACH_MAIN_ERROR "the main thread can't be detached."
 #define READY_STATE "READY"
 #define BLOCKED_STATE "BLOCKED"
 #define RUNNING_STATE "RUNNING"
+#define TERMINATED_STATE "TERMINATED"
 #define FAILURE -1
 #define NO_THREAD -1
 #define SUCCESS 0
 #define MAIN_THREAD_ID 0
 #define RETURN_VAL 1
 #define SYS_ERROR_EXIT_VAL 1
+#define TERMINATED_EXIT_VAL 0
 
 
 using namespace std;
@@ -98,15 +107,21 @@ class Thread{
     address_t sp{}, pc{};
     timeval sleep{};
     int times_used_in_quantums = 0;
+    bool joinable_ = false;
+    int joiner_ = NO_THREAD;
+    int waiting_for_ = NO_THREAD;
+    int exit_value_ = 0;
 public:
     /**
      * Thread object constructor, initializes thread environment and variables.
      * @param id - the thread id.
      * @param entry_point - entry point of thread (function).
+     * @param joinable - true if the thread should be kept after it terminates until it is joined.
      */
-    Thread(int id, thread_entry_point entry_point){
+    Thread(int id, thread_entry_point entry_point, bool joinable){
         times_used_in_quantums = 0;
         id_ = id;
+        joinable_ = joinable;
         entry_point_ = entry_point;
         stack_pointer = new (nothrow) char [STACK_SIZE];
         if (!stack_pointer) {
@@ -238,13 +253,98 @@ public:
     }
 
 
+    /**
+     * Changes thread state to terminated (a joinable thread that wasn't joined yet).
+     */
+    void change_state_to_terminated(){
+        state_ = TERMINATED_STATE;
+    }
+
+
+    /**
+     * Getter of the class Thread.
+     * @return true if the thread is kept after it terminates until it is joined.
+     */
+    bool is_joinable() const {
+        return joinable_;
+    }
+
+
+    /**
+     * Marks the thread as detached - it will be released as soon as it terminates.
+     */
+    void detach(){
+        joinable_ = false;
+    }
+
+
+    /**
+     * Getter of the class Thread.
+     * @return the id of the thread waiting in uthread_join for this thread, NO_THREAD if there is none.
+     */
+    int get_joiner() const {
+        return joiner_;
+    }
+
+
+    /**
+     * Sets the id of the thread waiting in uthread_join for this thread.
+     */
+    void set_joiner(int tid){
+        joiner_ = tid;
+    }
+
+
+    /**
+     * Getter of the class Thread.
+     * @return the id of the thread this thread is joining, NO_THREAD if it isn't joining any thread.
+     */
+    int get_waiting_for() const {
+        return waiting_for_;
+    }
+
+
+    /**
+     * Sets the id of the thread this thread is joining.
+     */
+    void set_waiting_for(int tid){
+        waiting_for_ = tid;
+    }
+
+
+    /**
+     * Getter of the class Thread.
+     * @return the exit value of the thread (for a terminated thread), or the exit value collected by uthread_join.
+     */
+    int get_exit_value() const {
+        return exit_value_;
+    }
+
+
+    /**
+     * Sets the exit value of the thread.
+     */
+    void set_exit_value(int exit_value){
+        exit_value_ = exit_value;
+    }
+
+
+    /**
+     * Hands the ownership of the thread stack to the caller.
+     * @return the thread stack (nullptr for the main thread or if it was already taken).
+     */
+    char *take_stack(){
+        char *stack = stack_pointer;
+        stack_pointer = nullptr;
+        return stack;
+    }
+
+
     /**
      * Thread class de-constructor.
      */
     ~Thread(){
-        if (id_ != 0){
-            delete stack_pointer;
-        }
+        delete[] stack_pointer;
     }
 };
 
@@ -256,6 +356,7 @@ map<int, Thread*> blocked;
 map<int, Thread*> sleeping;
 priority_queue<int, vector<int>, greater<int>> ids;
 bool set_timer = false;
+char *exited_stack = nullptr; // The stack of a thread that terminated itself, released at the next scheduling decision.
 
 
 /**
@@ -285,6 +386,8 @@ void erase_allocated_threads(){
     for (auto &it : threads){
         delete it.second;
     }
+    delete[] exited_stack;
+    exited_stack = nullptr;
 }
 
 
@@ -356,8 +459,12 @@ void run_thread(Thread *thread){
 /**
  * Keeps track of the total number of quantum that had passed, updates sleeping threads quantum (and the sleeping data
  * structure). Decides witch thread should run next and runs it.
+ * @param own_stack - the stack of the calling thread if it is terminating itself. We are still running on it, so it
+ * is released only by the next scheduling decision.
  */
-void make_scheduling_decision(){
+void make_scheduling_decision(char *own_stack = nullptr){
+    delete[] exited_stack;
+    exited_stack = own_stack;
     count_total_quantums++;
     if (!sleeping.empty()){
         auto  it = sleeping.begin();
@@ -373,6 +480,7 @@ void make_scheduling_decision(){
             it++;
         }
     }
+    uthread::detail::on_quantum();
     int next_thread_to_run_id = MAIN_THREAD_ID;
     if (!ready_queue.empty()) {
         next_thread_to_run_id = ready_queue.front();
@@ -401,6 +509,28 @@ void scheduler(int b){
 }
 
 
+/**
+ * Moves a blocked thread to the READY state (and to the end of the READY queue unless it is still sleeping). Threads in
+ * any other state are left untouched. Signals must be blocked by the caller.
+ * @param tid - the thread id.
+ */
+void uthread::detail::wake_thread(int tid){
+    auto thread = threads.find(tid);
+    if (thread == threads.end() || thread->second->get_state() != BLOCKED_STATE){
+        return;
+    }
+    // A thread waiting in uthread_join is woken up only by the termination of the thread it joins.
+    if (thread->second->get_waiting_for() != NO_THREAD){
+        return;
+    }
+    blocked.erase(blocked.find(tid));
+    thread->second->change_state_to_ready();
+    if (thread->second->check_sleeping()){
+        ready_queue.push_back(tid);
+    }
+}
+
+
 /**
  * @brief initializes the thread library.
  *
@@ -454,28 +584,24 @@ int uthread_init(int quantum_usecs) {
 
 
 /**
- * @brief Creates a new thread, whose entry point is the function entry_point with the signature
- * void entry_point(void).
- *
- * The thread is added to the end of the READY threads list.
- * The uthread_spawn function should fail if it would cause the number of concurrent threads to exceed the
- * limit (MAX_THREAD_NUM).
- * Each thread should be allocated with a stack of size STACK_SIZE bytes.
- * It is an error to call this function with a null entry_point.
- *
+ * Creates a new thread and adds it to the end of the READY queue.
+ * @param entry_point - entry point of thread (function).
+ * @param joinable - true if the thread should be kept after it terminates until it is joined.
  * @return On success, return the ID of the created thread. On failure, return -1.
-*/
-int uthread_spawn(thread_entry_point entry_point) {
+ */
+int spawn_thread(thread_entry_point entry_point, bool joinable){
     block_signals();
     if (ids.empty()){
+        unblock_signals();
         return error_handler(THREAD_ERROR, THREADS_LIMIT_ERROR, false);
     }
     if (!entry_point){
+        unblock_signals();
         return error_handler(THREAD_ERROR, ENTRY_POINT_ERROR, false);
     }
     int id = ids.top();
     ids.pop();
-    auto *thread = new (nothrow) Thread(id, entry_point);
+    auto *thread = new (nothrow) Thread(id, entry_point, joinable);
     if (!thread){
         return error_handler(SYSTEM_ERROR, MEMORY_ERROR, true);
     }
@@ -485,12 +611,102 @@ int uthread_spawn(thread_entry_point entry_point) {
     return id;
 }
 
+
+/**
+ * @brief Creates a new thread, whose entry point is the function entry_point with the signature
+ * void entry_point(void).
+ *
+ * The thread is added to the end of the READY threads list.
+ * The uthread_spawn function should fail if it would cause the number of concurrent threads to exceed the
+ * limit (MAX_THREAD_NUM).
+ * Each thread should be allocated with a stack of size STACK_SIZE bytes.
+ * It is an error to call this function with a null entry_point.
+ * The thread is detached: its resources (and ID) are released as soon as it terminates. It can still be joined while
+ * it is alive.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn(thread_entry_point entry_point) {
+    return spawn_thread(entry_point, false);
+}
+
+
+/**
+ * @brief Creates a new joinable thread, the same as uthread_spawn.
+ *
+ * When a joinable thread terminates before anyone joined it, its ID and exit value are kept (the thread is in the
+ * TERMINATED state and its stack is already released) until uthread_join collects them or uthread_detach is called.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_joinable(thread_entry_point entry_point) {
+    return spawn_thread(entry_point, true);
+}
+
+
+/**
+ * Removes a thread from the control structures, releases it and returns its ID to the pool.
+ * @param thread - the thread to release (not the running thread).
+ */
+void release_thread(Thread *thread){
+    threads.erase(thread->get_thread_id());
+    ids.push(thread->get_thread_id());
+    delete thread;
+}
+
+
+/**
+ * Terminates a thread: removes it from the scheduling structures, hands its exit value to the thread joining it (or
+ * keeps it for a later uthread_join if the thread is joinable) and releases its resources. Signals must be blocked.
+ * NOTE: if the thread is the running thread, the function will not return.
+ * @param thread - the thread to terminate.
+ * @param exit_value - the exit value of the thread.
+ */
+void finish_thread(Thread *thread, int exit_value){
+    int tid = thread->get_thread_id();
+    bool running = thread->get_state() == RUNNING_STATE;
+    auto queued = find(ready_queue.begin(), ready_queue.end(), tid);
+    if (queued != ready_queue.end()){
+        ready_queue.erase(queued);
+    }
+    blocked.erase(tid);
+    sleeping.erase(tid);
+    if (thread->get_waiting_for() != NO_THREAD){
+        threads.at(thread->get_waiting_for())->set_joiner(NO_THREAD);
+    }
+    bool joined = thread->get_joiner() != NO_THREAD;
+    if (joined){
+        Thread *joiner = threads.at(thread->get_joiner());
+        joiner->set_exit_value(exit_value);
+        joiner->set_waiting_for(NO_THREAD);
+        uthread::detail::wake_thread(joiner->get_thread_id());
+    }
+    char *stack = thread->take_stack();
+    if (thread->is_joinable() && !joined){
+        thread->change_state_to_terminated();
+        thread->set_exit_value(exit_value);
+    } else {
+        release_thread(thread);
+    }
+    if (!running){
+        delete[] stack;
+        return;
+    }
+    set_timer_threads(cancel_timer);
+    set_timer = true;
+    running_thread = NO_THREAD;
+    make_scheduling_decision(stack);
+}
+
+
 /**
  * @brief Terminates the thread with ID tid and deletes it from all relevant control structures.
  *
  * All the resources allocated by the library for this thread should be released. If no thread with ID tid exists it
  * is considered an error. Terminating the main thread (tid == 0) will result in the termination of the entire
  * process using exit(0) (after releasing the assigned library memory).
+ * A thread waiting in uthread_join for tid gets the exit value 0. Terminating a joinable thread that already
+ * terminated releases it.
  *
  * @return The function returns 0 if the thread was successfully terminated and -1 otherwise. If a thread terminates
  * itself or the main thread is terminated, the function does not return.
@@ -503,34 +719,34 @@ int uthread_terminate(int tid) {
     }
     auto thread = threads.find(tid);
     if (thread == threads.end()){
+        unblock_signals();
         return error_handler(THREAD_ERROR, NO_THREAD_ID_ERROR, false);
     }
-    else if (thread->second->get_state() == READY_STATE){
-        ready_queue.erase(find(ready_queue.begin(), ready_queue.end(), tid));
-        if (!thread->second->check_sleeping()){
-            sleeping.erase(sleeping.find(tid));
-        }
+    if (thread->second->get_state() == TERMINATED_STATE){
+        release_thread(thread->second);
+    } else {
+        finish_thread(thread->second, TERMINATED_EXIT_VAL);
     }
-    else if (thread->second->get_state() == RUNNING_STATE){
-        set_timer_threads(cancel_timer);
-        set_timer = true;
-        running_thread = NO_THREAD;
-        threads.erase(thread);
-        ids.push(tid);
-        delete thread->second;
-        make_scheduling_decision();
-    }
-    else if (thread->second->get_state() == BLOCKED_STATE){
-        blocked.erase(blocked.find(tid));
-        if (!thread->second->check_sleeping()){
-            sleeping.erase(sleeping.find(tid));
-        }
-    }
-    threads.erase(thread);
-    ids.push(tid);
-    delete thread->second;
     unblock_signals();
-    return 0;
+    return SUCCESS;
+}
+
+
+/**
+ * @brief Terminates the calling thread with the given exit value, which is passed to the thread joining it.
+ *
+ * If the main thread calls this function the entire process is terminated using exit(0) (after releasing the
+ * assigned library memory).
+ *
+ * The function does not return.
+*/
+void uthread_exit(int exit_value) {
+    block_signals();
+    if (running_thread == MAIN_THREAD_ID){
+        erase_allocated_threads();
+        exit(0);
+    }
+    finish_thread(threads.at(running_thread), exit_value);
 }
 
 
@@ -596,14 +812,7 @@ int uthread_resume(int tid) {
         unblock_signals();
         return error_handler(THREAD_ERROR, NO_THREAD_ID_ERROR, false);
     }
-    Thread *thread = threads.at(tid);
-    if(thread->get_state() == BLOCKED_STATE){
-        blocked.erase(blocked.find(tid));
-        thread->change_state_to_ready();
-        if (thread->check_sleeping()){
-            ready_queue.push_back(thread->get_thread_id());
-        }
-    }
+    uthread::detail::wake_thread(tid);
     unblock_signals();
     return SUCCESS;
 }
@@ -645,6 +854,140 @@ int uthread_sleep(int num_quantums) {
 }
 
 
+/**
+ * @brief Moves the RUNNING thread to the end of the READY queue and makes a scheduling decision immediately.
+ *
+ * If there are no other READY threads the calling thread keeps running, in a new quantum.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_yield() {
+    int ret_val = sigsetjmp(env[running_thread], RETURN_VAL);
+    block_signals();
+    if (ret_val == FAILURE){
+        return error_handler(SYSTEM_ERROR, ENVIRONMENT_SAVING_ERROR, true);
+    } else if (ret_val == RETURN_VAL){
+        return SUCCESS;
+    }
+    ready_queue.push_back(running_thread);
+    threads.at(running_thread)->change_state_to_ready();
+    running_thread = NO_THREAD;
+    set_timer_threads(cancel_timer);
+    set_timer = true;
+    make_scheduling_decision();
+    return SUCCESS;
+}
+
+
+/**
+ * @brief Blocks the RUNNING thread until the thread with ID tid terminates, and collects its exit value.
+ *
+ * If tid already terminated (a joinable thread that wasn't joined yet) the function returns immediately and the thread
+ * is released. Only one thread can join a given thread. It is an error to join the calling thread, the main thread,
+ * a thread that doesn't exist, or a thread that is (directly or indirectly) joining the calling thread.
+ * A thread waiting in uthread_join isn't woken up by uthread_resume.
+ * The scheduler relies on the main thread always being runnable, so the main thread isn't blocked: it yields until tid
+ * terminates.
+ *
+ * @param exit_value - if not null, receives the exit value passed to uthread_exit (0 if the thread was terminated
+ * using uthread_terminate).
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_join(int tid, int *exit_value) {
+    block_signals();
+    if (tid == running_thread){
+        unblock_signals();
+        return error_handler(THREAD_ERROR, JOIN_SELF_ERROR, false);
+    }
+    if (tid == MAIN_THREAD_ID){
+        unblock_signals();
+        return error_handler(THREAD_ERROR, JOIN_MAIN_ERROR, false);
+    }
+    auto target = threads.find(tid);
+    if (target == threads.end()){
+        unblock_signals();
+        return error_handler(THREAD_ERROR, NO_THREAD_ID_ERROR, false);
+    }
+    Thread *self = threads.at(running_thread);
+    if (target->second->get_state() == TERMINATED_STATE){
+        if (exit_value){
+            *exit_value = target->second->get_exit_value();
+        }
+        release_thread(target->second);
+        unblock_signals();
+        return SUCCESS;
+    }
+    if (target->second->get_joiner() != NO_THREAD){
+        unblock_signals();
+        return error_handler(THREAD_ERROR, JOIN_TWICE_ERROR, false);
+    }
+    for (int waiting = target->second->get_waiting_for(); waiting != NO_THREAD;
+         waiting = threads.at(waiting)->get_waiting_for()){
+        if (waiting == running_thread){
+            unblock_signals();
+            return error_handler(THREAD_ERROR, JOIN_DEADLOCK_ERROR, false);
+        }
+    }
+    target->second->set_joiner(running_thread);
+    self->set_waiting_for(tid);
+    if (running_thread == MAIN_THREAD_ID){
+        // finish_thread resets waiting_for when tid terminates.
+        unblock_signals();
+        while (self->get_waiting_for() == tid){
+            uthread_yield();
+        }
+        block_signals();
+    } else {
+        int ret_val = sigsetjmp(env[running_thread], RETURN_VAL);
+        if (ret_val == FAILURE){
+            return error_handler(SYSTEM_ERROR, ENVIRONMENT_SAVING_ERROR, true);
+        } else if (ret_val != RETURN_VAL){
+            self->change_state_to_blocked();
+            blocked.insert({running_thread, self});
+            running_thread = NO_THREAD;
+            set_timer_threads(cancel_timer);
+            set_timer = true;
+            make_scheduling_decision();
+        }
+    }
+    // We get here after the joined thread terminated and handed us its exit value.
+    if (exit_value){
+        *exit_value = self->get_exit_value();
+    }
+    unblock_signals();
+    return SUCCESS;
+}
+
+
+/**
+ * @brief Detaches the thread with ID tid: its resources will be released as soon as it terminates.
+ *
+ * Detaching a joinable thread that already terminated releases it immediately. Detaching a detached thread has no
+ * effect. It is an error to detach the main thread or a thread that doesn't exist.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_detach(int tid) {
+    block_signals();
+    if (tid == MAIN_THREAD_ID){
+        unblock_signals();
+        return error_handler(THREAD_ERROR, DETACH_MAIN_ERROR, false);
+    }
+    auto thread = threads.find(tid);
+    if (thread == threads.end()){
+        unblock_signals();
+        return error_handler(THREAD_ERROR, NO_THREAD_ID_ERROR, false);
+    }
+    if (thread->second->get_state() == TERMINATED_STATE){
+        release_thread(thread->second);
+    } else {
+        thread->second->detach();
+    }
+    unblock_signals();
+    return SUCCESS;
+}
+
+
 /**
 * @brief Returns the thread ID of the calling thread.
 * @return The ID of the calling thread.
@@ -0,0 +1,63 @@
+#ifndef _UTHREADS_EXTENSIONS_H
+#define _UTHREADS_EXTENSIONS_H
+
+#include "uthreads.h"
+
+
+/*
+ * Library functions that are not part of uthreads.h: yielding, joinable threads and exit values.
+ */
+
+
+/**
+ * @brief Moves the RUNNING thread to the end of the READY queue and makes a scheduling decision immediately.
+ *
+ * If there are no other READY threads the calling thread keeps running, in a new quantum.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_yield();
+
+
+/**
+ * @brief Creates a new joinable thread, the same as uthread_spawn.
+ *
+ * When a joinable thread terminates before anyone joined it, its ID and exit value are kept until uthread_join
+ * collects them or uthread_detach is called.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_joinable(thread_entry_point entry_point);
+
+
+/**
+ * @brief Terminates the calling thread with the given exit value, which is passed to the thread joining it.
+ *
+ * If the main thread calls this function the entire process is terminated using exit(0). The function does not
+ * return.
+*/
+void uthread_exit(int exit_value);
+
+
+/**
+ * @brief Waits until the thread with ID tid terminates, and collects its exit value.
+ *
+ * A thread waiting in uthread_join is BLOCKED, except for the main thread, which can't be blocked: it keeps yielding
+ * until tid terminates.
+ *
+ * @param exit_value - if not null, receives the exit value passed to uthread_exit (0 if the thread was terminated
+ * using uthread_terminate).
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_join(int tid, int *exit_value);
+
+
+/**
+ * @brief Detaches the thread with ID tid: its resources will be released as soon as it terminates.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_detach(int tid);
+
+
+#endif //_UTHREADS_EXTENSIONS_H
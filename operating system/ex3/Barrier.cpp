@@ -1,48 +1,158 @@
 #include "Barrier.h"
 #include <cstdlib>
 #include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define BARRIER_TREE_THRESHOLD 8
+#define BARRIER_FAN_IN 4
+#define BARRIER_SPIN_COUNT 200
+#define BARRIER_CACHE_LINE 64
+#define BARRIER_NO_PARENT -1
+
+static_assert(sizeof(std::atomic<unsigned>) == sizeof(unsigned), "the generation is used as a futex word");
+
+
+struct Barrier::Node {
+	std::atomic<int> count;            // arrivals in the current generation
+	int expected;                      // arrivals that complete the node
+	int parent;                        // the index of the parent node, or BARRIER_NO_PARENT for the root
+	char padding[BARRIER_CACHE_LINE - sizeof(std::atomic<int>) - 2 * sizeof(int)];
+};
+
+
+/**
+ * Tells the CPU we are spinning.
+ */
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+
+/**
+ * A small per thread number, used for spreading the threads over the leaves of the tree.
+ */
+static unsigned thread_index()
+{
+	static std::atomic<unsigned> next_index(0);
+	static thread_local unsigned index = next_index.fetch_add(1);
+	return index;
+}
+
 
 Barrier::Barrier(int numThreads)
-		: mutex(PTHREAD_MUTEX_INITIALIZER)
-		, cv(PTHREAD_COND_INITIALIZER)
-		, count(0)
+		: nodes(nullptr)
+		, numLeaves(1)
+		, numNodes(0)
+		, generation(0)
+		, sleepers(0)
 		, numThreads(numThreads)
-{ }
+{
+	if (numThreads > BARRIER_TREE_THRESHOLD) {
+		numLeaves = (numThreads + BARRIER_FAN_IN - 1) / BARRIER_FAN_IN;
+	}
+	// Count the nodes of all the levels: every level has ceil(previous / BARRIER_FAN_IN) nodes, up to a single root.
+	int level = numLeaves;
+	numNodes = level;
+	while (level > 1) {
+		level = (level + BARRIER_FAN_IN - 1) / BARRIER_FAN_IN;
+		numNodes += level;
+	}
+	nodes = new Node[numNodes];
+	// The leaves share the threads, the other nodes wait for their children.
+	for (int i = 0; i < numLeaves; ++i) {
+		nodes[i].expected = numThreads / numLeaves + (i < numThreads % numLeaves ? 1 : 0);
+	}
+	int levelBegin = 0;
+	level = numLeaves;
+	while (level > 1) {
+		int parents = (level + BARRIER_FAN_IN - 1) / BARRIER_FAN_IN;
+		for (int i = 0; i < parents; ++i) {
+			nodes[levelBegin + level + i].expected = 0;
+		}
+		for (int i = 0; i < level; ++i) {
+			nodes[levelBegin + i].parent = levelBegin + level + i / BARRIER_FAN_IN;
+			nodes[levelBegin + level + i / BARRIER_FAN_IN].expected++;
+		}
+		levelBegin += level;
+		level = parents;
+	}
+	nodes[numNodes - 1].parent = BARRIER_NO_PARENT;
+	for (int i = 0; i < numNodes; ++i) {
+		nodes[i].count.store(0, std::memory_order_relaxed);
+	}
+}
 
 
 Barrier::~Barrier()
 {
-	if (pthread_mutex_destroy(&mutex) != 0) {
-		fprintf(stderr, "[[Barrier]] error on pthread_mutex_destroy");
-		exit(1);
-	}
-	if (pthread_cond_destroy(&cv) != 0){
-		fprintf(stderr, "[[Barrier]] error on pthread_cond_destroy");
-		exit(1);
-	}
+	delete[] nodes;
 }
 
 
-void Barrier::barrier()
+void Barrier::wait(unsigned current)
 {
-	if (pthread_mutex_lock(&mutex) != 0){
-		fprintf(stderr, "[[Barrier]] error on pthread_mutex_lock");
-		exit(1);
+	for (int i = 0; i < BARRIER_SPIN_COUNT; ++i) {
+		if (generation.load(std::memory_order_acquire) != current) {
+			return;
+		}
+		cpu_relax();
 	}
-	if (++count < numThreads) {
-		if (pthread_cond_wait(&cv, &mutex) != 0){
-			fprintf(stderr, "[[Barrier]] error on pthread_cond_wait");
+	// release() reads sleepers after changing the generation, and the kernel checks the generation before sleeping,
+	// so the wake up can't be missed.
+	sleepers.fetch_add(1);
+	while (generation.load() == current) {
+		if (syscall(SYS_futex, reinterpret_cast<unsigned *>(&generation), FUTEX_WAIT_PRIVATE, current,
+		            nullptr, nullptr, 0) != 0 && errno != EAGAIN && errno != EINTR) {
+			fprintf(stderr, "[[Barrier]] error on futex wait");
 			exit(1);
 		}
-	} else {
-		count = 0;
-		if (pthread_cond_broadcast(&cv) != 0) {
-			fprintf(stderr, "[[Barrier]] error on pthread_cond_broadcast");
+	}
+	sleepers.fetch_sub(1);
+}
+
+
+void Barrier::release(unsigned current)
+{
+	// Everybody arrived, so nobody touches the counters until the generation changes.
+	for (int i = 0; i < numNodes; ++i) {
+		nodes[i].count.store(0, std::memory_order_relaxed);
+	}
+	generation.store(current + 1);
+	if (sleepers.load() > 0) {
+		if (syscall(SYS_futex, reinterpret_cast<unsigned *>(&generation), FUTEX_WAKE_PRIVATE, INT_MAX,
+		            nullptr, nullptr, 0) == -1) {
+			fprintf(stderr, "[[Barrier]] error on futex wake");
 			exit(1);
 		}
 	}
-	if (pthread_mutex_unlock(&mutex) != 0) {
-		fprintf(stderr, "[[Barrier]] error on pthread_mutex_unlock");
-		exit(1);
+}
+
+
+void Barrier::barrier()
+{
+	unsigned current = generation.load(std::memory_order_acquire);
+	// Take a place in a leaf, starting from the leaf of the thread and moving on if it is full. The leaves have
+	// exactly numThreads places, so everybody finds one.
+	int node = (int) (thread_index() % numLeaves);
+	int ticket;
+	while ((ticket = nodes[node].count.fetch_add(1)) >= nodes[node].expected) {
+		node = (node + 1) % numLeaves;
+	}
+	// The last thread to arrive at a node goes on to its parent, and the last one at the root releases everybody.
+	while (ticket == nodes[node].expected - 1) {
+		if (nodes[node].parent == BARRIER_NO_PARENT) {
+			release(current);
+			return;
+		}
+		node = nodes[node].parent;
+		ticket = nodes[node].count.fetch_add(1);
 	}
+	wait(current);
 }
@@ -1,8 +1,13 @@
 #ifndef BARRIER_H
 #define BARRIER_H
-#include <pthread.h>
+#include <atomic>
 
 // a multiple use barrier
+//
+// Sense reversing: the last thread to arrive flips the generation, and everybody else waits for it to change -
+// spinning for a short while, and then sleeping on a futex. Up to BARRIER_TREE_THRESHOLD threads arrive on a single
+// counter; above that the arrivals are spread over a combining tree of counters, so they don't all contend on one
+// cache line.
 
 class Barrier {
 public:
@@ -11,9 +16,16 @@ public:
 	void barrier();
 
 private:
-	pthread_mutex_t mutex;
-	pthread_cond_t cv;
-	int count;
+	struct Node;
+
+	void wait(unsigned generation);
+	void release(unsigned generation);
+
+	Node *nodes;                       // the counters of the tree, the leaves first and the root last
+	int numLeaves;
+	int numNodes;
+	std::atomic<unsigned> generation;  // changes every time all the threads arrive
+	std::atomic<int> sleepers;         // threads that are sleeping (or about to sleep) on the generation futex
 	int numThreads;
 };
 
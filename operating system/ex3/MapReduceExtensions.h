@@ -0,0 +1,346 @@
+#ifndef MAPREDUCEEXTENSIONS_H
+#define MAPREDUCEEXTENSIONS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "MapReduceFramework.h"
+
+
+/**
+ * A MapReduceClient with a map-side combiner.
+ *
+ * After a thread finished the map stage and sorted its output, the framework calls combine (on that thread) with every
+ * run of two or more pairs with equal keys, before the shuffle. combine emits, using emit2, the pairs that replace the
+ * run - usually a single pair, e.g. (word, sum of counts). All the emitted keys must be equal to the key of the run.
+ * Like in reduce, the client owns the pairs of the run, and should delete the ones it doesn't emit again.
+ */
+class CombinerClient : public virtual MapReduceClient {
+public:
+    virtual void combine(const IntermediateVec* pairs, void* context) const = 0;
+};
+
+
+/**
+ * A MapReduceClient that can run after another job in a chain (see startMapReduceChain), mapping the output pairs of
+ * that job directly. (MapReduceClient is a virtual base, so a client can also be a CombinerClient.)
+ */
+class ChainableMapReduceClient : public virtual MapReduceClient {
+public:
+    /**
+     * Maps an output pair of the previous job of the chain. The client owns the pair, and should delete the objects it
+     * doesn't emit again.
+     */
+    virtual void mapChained(const K3* key, const V3* value, void* context) const = 0;
+};
+
+
+/**
+ * Serializes intermediate pairs, so the framework can move them out of memory and back.
+ *
+ * decode creates new objects, which are handed to reduce like any other pair (so the client deletes them as usual).
+ * The objects of a pair that was encoded are released with dispose when the framework doesn't need them any more.
+ */
+class KeyValueCodec {
+public:
+    virtual ~KeyValueCodec() {}
+
+    /**
+     * Appends the serialized form of pair to out.
+     */
+    virtual void encode(const IntermediatePair& pair, std::string& out) const = 0;
+
+    /**
+     * Creates a pair from size bytes written by encode.
+     */
+    virtual IntermediatePair decode(const char* data, size_t size) const = 0;
+
+    /**
+     * The number of bytes of memory the key and the value of pair take.
+     */
+    virtual size_t footprint(const IntermediatePair& pair) const = 0;
+
+    /**
+     * Deletes the key and the value of pair.
+     */
+    virtual void dispose(const IntermediatePair& pair) const = 0;
+};
+
+
+/**
+ * Serializes output pairs, so the worker processes of a distributed job can send their output back. decode creates new
+ * objects, which the client owns like any other output pair.
+ */
+class OutputCodec {
+public:
+    virtual ~OutputCodec() {}
+
+    /**
+     * Appends the serialized form of pair to out.
+     */
+    virtual void encode(const OutputPair& pair, std::string& out) const = 0;
+
+    /**
+     * Creates a pair from size bytes written by encode.
+     */
+    virtual OutputPair decode(const char* data, size_t size) const = 0;
+};
+
+
+/**
+ * Hashing and equality of intermediate keys, for grouping the pairs without sorting them.
+ * Equal keys must have equal hashes.
+ */
+class KeyHasher {
+public:
+    virtual ~KeyHasher() {}
+
+    virtual size_t hash(const K2* key) const = 0;
+
+    virtual bool equal(const K2* first, const K2* second) const = 0;
+};
+
+
+/**
+ * A fixed width encoding of intermediate keys, for sorting them as integers. The encoding must keep the order of the
+ * keys: encode(a) < encode(b) exactly when *a < *b (so equal keys have equal codes). The keys are sorted and merged with
+ * vector instructions when every code and the index of its pair fit in 63 bits together, e.g. 32 bit codes.
+ */
+class KeyEncoder {
+public:
+    virtual ~KeyEncoder() {}
+
+    virtual uint64_t encode(const K2* key) const = 0;
+};
+
+
+/**
+ * Where the threads of a job run. The threads of a pinned job allocate their intermediate pairs themselves, so with the
+ * first-touch policy of Linux the pairs of every thread are on the NUMA node of its core.
+ */
+enum ThreadPlacement {
+    PLACEMENT_NONE = 0, // The threads aren't pinned, and migrate between the cores freely.
+    PLACEMENT_COMPACT = 1, // Thread i is pinned to the i-th allowed core, filling the NUMA nodes one after the other.
+    PLACEMENT_SPREAD = 2 // The threads are pinned round robin across the NUMA nodes, to use the memory bandwidth of all.
+};
+
+
+/**
+ * Optional settings of a job.
+ */
+struct JobOptions {
+    // The number of bytes the intermediate pairs of the job may take in memory, 0 for no limit. Every thread gets an
+    // equal share; when the pairs a thread emitted pass its share, they are sorted (and combined) and written to a
+    // temporary file through the codec, and the shuffle merges the files with the pairs left in memory.
+    size_t memory_budget = 0;
+    const KeyValueCodec* codec = nullptr; // Required for memory_budget and worker_processes, ignored without it.
+    // Groups the pairs by hash instead of sorting them: every map thread partitions its pairs by hash(key) among the
+    // reducing threads, and every reducing thread groups its part with a hash table. operator< of K2 is never called,
+    // and the output isn't sorted by key. The job doesn't spill in this mode (memory_budget is ignored).
+    const KeyHasher* hasher = nullptr;
+    // Gives every reducing thread a contiguous range of groups with roughly the same number of pairs, instead of
+    // letting the threads take the groups one at a time. (A job that spilled is always reduced by key ranges.)
+    bool balanced_reduce = false;
+    // The client declares that its reduce can be applied in parts: a group with more pairs then the share of a thread
+    // is split between the reducing threads of the ranges it overlaps, every part is combined (with combine), and the
+    // combined pairs of all the parts are passed to one reduce call. Implies balanced_reduce, and requires a
+    // CombinerClient (ignored otherwise).
+    bool split_hot_keys = false;
+    // Reduces the groups while the shuffle is still merging them: every complete group goes through a bounded queue to
+    // the reducing threads, and a thread that finds the queue full reduces groups itself before merging on. Ignored if
+    // the job groups by hash or is balanced (and a job that spilled is already merged while it is reduced).
+    bool pipeline_reduce = false;
+    // Runs the job in this many worker processes instead of threads. The workers are forked from the process, so they
+    // see the client and the input as they are. Every worker maps a slice of the input, the workers exchange their
+    // pairs over unix sockets (through the codec) so that every worker gets one key range, and every worker reduces
+    // its range and sends the output back (through output_codec). The output is the same as the output of the job in
+    // threads. Requires both codecs and an input vector, and can't be chained; the other options, except stats_path,
+    // are ignored. The client runs in processes forked from a multithreaded one, so it shouldn't use locks that other
+    // threads may hold.
+    int worker_processes = 0;
+    const OutputCodec* output_codec = nullptr; // Required for worker_processes.
+    // Pins the threads of the job to cores (see ThreadPlacement). The reducing threads take the groups merged on their
+    // own NUMA node before the others, so most of the reads of the reduce stage are local.
+    ThreadPlacement placement = PLACEMENT_NONE;
+    // Sorts the map output of every thread and merges the key ranges by the codes of the keys (see KeyEncoder), instead
+    // of comparing the keys with operator<. The merge of a pipelined job still compares the keys, so it can hand every
+    // group to the reducing threads as soon as it is complete.
+    const KeyEncoder* key_encoder = nullptr;
+    // If set, closeJobHandle writes the statistics of the job (see getJobStats) to this file, as JSON.
+    const char* stats_path = nullptr;
+};
+
+
+/**
+ * The phases of a job, as the framework runs them. The sort phase is the sort and combine of every thread's map output
+ * (or the partition by hash). When a job spilled or is pipelined, the merge runs in the reduce phase.
+ */
+enum JobPhase {MAP_PHASE = 0, SORT_PHASE = 1, SHUFFLE_PHASE = 2, REDUCE_PHASE = 3, NUM_OF_PHASES = 4};
+
+
+/**
+ * What one thread did in one phase.
+ */
+struct PhaseStats {
+    double seconds = 0; // The wall time of the phase, without the wait on the barrier that ends it.
+    unsigned long items = 0; // Input elements in the map phase, intermediate pairs in the other phases.
+    unsigned long bytes = 0; // Bytes of intermediate pairs the phase produced (sizeof(IntermediatePair) per pair),
+    // plus the bytes it wrote to or read from the spill files.
+    double barrier_wait = 0; // Seconds blocked on the barrier at the end of the phase.
+    double lock_wait = 0; // Seconds blocked on the mutexes of the job.
+};
+
+
+/**
+ * The statistics of one thread of a job.
+ */
+struct ThreadStats {
+    PhaseStats phases[NUM_OF_PHASES];
+    unsigned long largest_group = 0; // The number of pairs in the largest group this thread reduced.
+};
+
+
+/**
+ * The statistics of a job.
+ */
+struct JobStats {
+    double seconds = 0; // From startMapReduceJob until the last thread finished (including waiting for workers).
+    std::vector<ThreadStats> threads;
+    unsigned long largest_group = 0; // The number of pairs in the largest group of the job.
+};
+
+
+/**
+ * A record of the input of a job that reads an InputSource: a view of the bytes of the record, without the delimiter.
+ * The framework passes it to map as the value (the key is nullptr). The bytes are valid only during the map call, so
+ * map should copy what it wants to keep.
+ */
+class InputRecord : public V1 {
+public:
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+
+/**
+ * A part of the input that a map thread took from an InputSource. Every thread reuses its own split.
+ */
+struct InputSplit {
+    std::vector<InputRecord> records; // The records of the split.
+    std::string buffer; // Holds the bytes of the records, for sources that copy them.
+    unsigned long long weight = 0; // The amount of input the split covers, in the units of InputSource::total.
+};
+
+
+// The total of an InputSource that doesn't know the size of its input in advance.
+const unsigned long long UNKNOWN_INPUT_SIZE = ~0ULL;
+
+
+/**
+ * Feeds the map threads of a job, instead of an InputVec, so the input doesn't have to be turned into K1 / V1 objects
+ * before the job starts.
+ */
+class InputSource {
+public:
+    virtual ~InputSource() {}
+
+    /**
+     * Takes the next split of the input. Called concurrently by the map threads, every thread with its own split.
+     * @return false if the input is over.
+     */
+    virtual bool next_split(InputSplit& split) = 0;
+
+    /**
+     * The amount of input (in the units of the weights of the splits), or UNKNOWN_INPUT_SIZE.
+     */
+    virtual unsigned long long total() const = 0;
+};
+
+
+/**
+ * The records of a file, separated by a delimiter. The file is mapped to memory, the threads claim ranges of its bytes
+ * with an atomic counter, and every thread maps the records that begin in its range - the records are views of the
+ * mapping, nothing is copied.
+ */
+class MappedFileSource : public InputSource {
+public:
+    explicit MappedFileSource(const char* path, char delimiter = '\n');
+    ~MappedFileSource() override;
+    MappedFileSource(const MappedFileSource&) = delete;
+    MappedFileSource& operator=(const MappedFileSource&) = delete;
+
+    bool next_split(InputSplit& split) override;
+    unsigned long long total() const override;
+
+private:
+    const char* data; // The mapped file.
+    size_t size; // The size of the file.
+    size_t split_size; // The number of bytes a thread claims at once.
+    char delimiter;
+    std::atomic<size_t> next_offset; // The first byte no thread claimed yet.
+};
+
+
+/**
+ * The records of a stream, separated by a delimiter, for input whose size isn't known in advance (a pipe, a socket).
+ * The threads take turns reading blocks of the stream, and every block ends at the end of a record.
+ */
+class StreamSource : public InputSource {
+public:
+    explicit StreamSource(FILE* file, char delimiter = '\n');
+    ~StreamSource() override;
+    StreamSource(const StreamSource&) = delete;
+    StreamSource& operator=(const StreamSource&) = delete;
+
+    bool next_split(InputSplit& split) override;
+    unsigned long long total() const override;
+
+private:
+    FILE* file; // The stream, which the source doesn't close.
+    char delimiter;
+    std::string carry; // The beginning of a record that was read with the previous block.
+    bool finished; // True once the stream ended.
+    pthread_mutex_t mutex; // Protects the stream, carry and finished.
+};
+
+
+/**
+ * Starts a job with the given options, see startMapReduceJob in MapReduceFramework.h.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            const InputVec& inputVec, OutputVec& outputVec,
+                            int multiThreadLevel, const JobOptions& options);
+
+
+/**
+ * Runs a chain of jobs on the same threads: the pairs emitted by the reduce of every job are mapped (with mapChained)
+ * by the next job, without being collected into an output vector in between, and every thread starts mapping the pairs
+ * it emitted as soon as it finished reducing. The output of the last job is written to outputVec. getJobState reports
+ * the stages of the jobs one after the other, and the options apply to all of them.
+ */
+JobHandle startMapReduceChain(const MapReduceClient& client,
+                              const std::vector<const ChainableMapReduceClient*>& chained,
+                              const InputVec& inputVec, OutputVec& outputVec,
+                              int multiThreadLevel, const JobOptions& options = JobOptions());
+
+
+/**
+ * Starts a job that reads its input from a source, which must stay alive until the job is closed. Every record is
+ * mapped with a nullptr key and an InputRecord value.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            InputSource& input, OutputVec& outputVec,
+                            int multiThreadLevel, const JobOptions& options = JobOptions());
+
+
+/**
+ * Waits until the job finished, and fills stats with its statistics.
+ */
+void getJobStats(JobHandle job, JobStats* stats);
+
+
+#endif //MAPREDUCEEXTENSIONS_H
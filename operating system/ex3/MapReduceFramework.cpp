@@ -1,14 +1,31 @@
 #include <atomic>
+#include <chrono>
 #include <iostream>
 #include <cmath>
 #include <deque>
 #include <queue>
 #include <algorithm>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include "MapReduceFramework.h"
+#include "MapReduceExtensions.h"
 #include "pthread.h"
-#include <semaphore.h>
 #include "Barrier.h"
 #include "Barrier.cpp"
+#include "SimdSort.h"
 using std::string;
 using std::cerr;
 using std::endl;
@@ -18,33 +35,56 @@ using std::atomic;
 using std::vector;
 using std::min;
 using std::priority_queue;
+using std::max;
 
 
 
 #define SYSTEM_ERROR "System error: "
 #define INIT_MUTEX_ERROR "failed to initialize the mutex."
-#define INIT_SEMAPHORE_ERROR "failed to initialize the semaphore."
 #define UNLOCK_MUTEX_ERROR "failed to unlock the mutex."
 #define LOCK_MUTEX_ERROR "failed to lock the mutex."
 #define DESTROY_MUTEX_ERROR "failed to destroy the mutex."
 #define INIT_THREAD_ERROR "failed to initialize a thread."
-#define JOIN_THREAD_ERROR "failed to join between threads."
-#define SEMAPHORE_UP_ERROR "couldn't successfully add to semaphore."
-#define SEMAPHORE_DOWN_ERROR "couldn't successfully decrease from semaphore."
-#define SEMAPHORE_DESTROY_ERROR "couldn't successfully destroy the semaphore."
+#define DETACH_THREAD_ERROR "failed to detach a thread."
+#define INIT_COND_ERROR "failed to initialize the condition variable."
+#define WAIT_COND_ERROR "failed to wait on the condition variable."
+#define BROADCAST_COND_ERROR "failed to broadcast the condition variable."
+#define DESTROY_COND_ERROR "failed to destroy the condition variable."
+#define SPILL_FILE_ERROR "failed to create a spill file."
+#define SPILL_WRITE_ERROR "failed to write to a spill file."
+#define SPILL_READ_ERROR "failed to read from a spill file."
+#define STATS_FILE_ERROR "failed to write the job statistics."
+#define INPUT_FILE_ERROR "failed to map the input file."
+#define INPUT_STREAM_ERROR "failed to read the input stream."
+#define AFFINITY_ERROR "failed to read the CPU affinity of the process."
+#define SOCKET_ERROR "failed to create a socket."
+#define FORK_ERROR "failed to create a worker process."
+#define WORKER_PROCESS_ERROR "a worker process failed."
 #define INITIALIZE 1
 #define LOCK 2
-#define INCREASE 2
 #define UNLOCK 3
-#define DECREASE 3
 #define DESTROY 4
-#define MAIN_T_ID 0
-#define BITS_TODO_DONE 31
-#define BITS_TODO_AND_DONE 62
+#define WAIT 5
+#define BROADCAST 6
 #define HANDLE_PERCENTAGES 100
-#define MASK_STAGE 0xC000000000000000
-#define MASK_JOB_TO_D0 0x3FFFFFFF80000000
-#define MASK_JOB_DONE 0x7FFFFFFF
+#define CACHE_LINE_SIZE 64
+#define MAP_CHUNKS_PER_THREAD 4
+#define MAX_MAP_CHUNK 1024
+#define MAP_BATCH 16
+#define MAP_RANGE_BITS 32
+#define SAMPLES_PER_THREAD 64
+#define SPILL_FENCE_INTERVAL 256
+#define SPILL_READ_BUFFER 65536
+#define FIBONACCI_HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+#define PIPELINE_QUEUE_SIZE 1024
+#define MIN_FILE_SPLIT 4096
+#define MAX_FILE_SPLIT 1048576
+#define FILE_SPLITS_PER_THREAD 16
+#define STREAM_BLOCK_SIZE 65536
+#define NUMA_NODES_PATH "/sys/devices/system/node"
+#define WIRE_HEADER_SIZE 9
+#define PROGRESS_REPORT_INTERVAL 1024
+#define SOCKET_BUFFER_SIZE 65536
 
 
 /**
@@ -57,6 +97,16 @@ void error_handler(const string& error){
 }
 
 
+/**
+ * The time that passed since a given time point.
+ * @param start - the time point.
+ * @return the time in seconds.
+ */
+double seconds_since(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
 /**
  * A function that deals with all the scenarios regarding handling the mutex.
  * @param mutex - the mutex to operate on.
@@ -91,37 +141,42 @@ void handling_mutex(pthread_mutex_t &mutex, int operation){
     }
 }
 
+
 /**
- * A function that deals with all the scenarios regarding handling the semaphore.
- * @param semaphore - the semaphore to operate on.
+ * A function that deals with all the scenarios regarding handling a condition variable.
+ * @param cond - the condition variable to operate on.
  * @param operation - a number that indicates what operation the handler should preform.
+ * @param mutex - the mutex to release while waiting (used only by WAIT).
  */
-void handling_semaphore(sem_t &semaphore, int operation){
+void handling_cond(pthread_cond_t &cond, int operation, pthread_mutex_t *mutex = nullptr){
     switch (operation) {
         case INITIALIZE:
-            if (sem_init(&semaphore, 0, 0)) {
-                error_handler(INIT_SEMAPHORE_ERROR);
+            if (pthread_cond_init(&cond, nullptr) != 0)
+            {
+                error_handler(INIT_COND_ERROR);
             }
             break;
-        case INCREASE:
-            if (sem_post(&semaphore)) {
-                error_handler(SEMAPHORE_UP_ERROR);
+        case WAIT:
+            if (pthread_cond_wait(&cond, mutex) != 0)
+            {
+                error_handler(WAIT_COND_ERROR);
             }
             break;
-        case DECREASE:
-            if (sem_wait(&semaphore)) {
-                error_handler(SEMAPHORE_DOWN_ERROR);
+        case BROADCAST:
+            if (pthread_cond_broadcast(&cond) != 0)
+            {
+                error_handler(BROADCAST_COND_ERROR);
             }
             break;
         case DESTROY:
-            if(sem_destroy(&semaphore)){
-                error_handler(SEMAPHORE_DESTROY_ERROR);
+            if (pthread_cond_destroy(&cond) != 0)
+            {
+                error_handler(DESTROY_COND_ERROR);
             }
             break;
     }
 }
 
-
 /**
  * A comparator between two pairs.
  * @param temp1 - the first pair of type pair<K2 *, V2 *> in the comparison.
@@ -134,13 +189,261 @@ bool compare_by_first_element(pair<K2 *, V2 *> temp1, pair<K2 *, V2 *> temp2){
 }
 
 
-struct pairs_k2_grater {
-    bool operator()(pair<K2 *, V2 *> const a, pair<K2 *, V2 *> const b) const {
-        return compare_by_first_element(b, a);
+/**
+ * A comparator between a pair and a key, for searching sorted intermediate vectors.
+ * @param temp - the pair of type pair<K2 *, V2 *> in the comparison.
+ * @param key - the key in the comparison.
+ * @return - true if the key of the pair is smaller then the key and false otherwise.
+ */
+bool compare_pair_to_key(const IntermediatePair &temp, const K2 *key){
+    return (*temp.first < *key);
+}
+
+
+/**
+ * The position of the next pair to merge in one of the sorted intermediate vectors.
+ */
+struct MergeCursor {
+    IntermediateVec::const_iterator current;
+    IntermediateVec::const_iterator end;
+};
+
+
+/**
+ * A group of pairs with the same key - a slice of the shuffled pairs of the thread that merged it.
+ */
+struct GroupSlice {
+    unsigned long begin; // The index of the first pair of the group.
+    unsigned long size; // The number of pairs in the group.
+};
+
+
+/**
+ * A group that is reduced in parts, by all the reducing threads whose ranges it overlaps.
+ */
+struct HotGroup {
+    unsigned long group; // The index of the group in the groups of the thread that merged it.
+    vector<IntermediateVec> combined; // The pairs combined from the part of every reducing thread.
+    std::atomic<unsigned long> pairs_left; // The number of pairs in the parts that weren't combined yet.
+
+    HotGroup(unsigned long group, unsigned long size, int num_of_threads)
+            : group(group), combined(num_of_threads), pairs_left(size) {}
+};
+
+
+/**
+ * A group that was merged and waits in the pipeline for a reducing thread.
+ */
+struct PipelineGroup {
+    int owner; // The id of the thread that merged the group.
+    unsigned long index; // The index of the group in the groups of the owner.
+    GroupSlice slice; // The pairs of the group in the shuffled pairs of the owner.
+};
+
+
+/**
+ * A bounded multi-producer multi-consumer queue of groups (Dmitry Vyukov's array queue). Every cell has a sequence
+ * number that tells whose turn it is to use the cell - the producer of round r waits for r * size + index and the
+ * consumer for one more then that - so a push or a pop is a single CAS on the shared position, and never blocks.
+ */
+class GroupQueue{
+public:
+    /**
+     * A constructor for the GroupQueue class.
+     * @param size - the capacity of the queue, a power of 2.
+     */
+    explicit GroupQueue(unsigned long size) : cells(new Cell[size]), mask(size - 1){
+        for (unsigned long i = 0; i < size; ++i){
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        push_position.store(0, std::memory_order_relaxed);
+        pop_position.store(0, std::memory_order_relaxed);
+    }
+
+    ~GroupQueue(){
+        delete[] cells;
+    }
+
+    /**
+     * Adds a group to the queue.
+     * @param group - the group.
+     * @return true on success, false if the queue is full.
+     */
+    bool push(const PipelineGroup &group){
+        unsigned long position = push_position.load(std::memory_order_relaxed);
+        while (true){
+            Cell &cell = cells[position & mask];
+            unsigned long sequence = cell.sequence.load(std::memory_order_acquire);
+            long difference = (long) sequence - (long) position;
+            if (difference == 0){
+                if (push_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)){
+                    cell.group = group;
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0){
+                return false;
+            } else {
+                position = push_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Takes the oldest group out of the queue.
+     * @param group - will store the group.
+     * @return true on success, false if the queue is empty.
+     */
+    bool pop(PipelineGroup &group){
+        unsigned long position = pop_position.load(std::memory_order_relaxed);
+        while (true){
+            Cell &cell = cells[position & mask];
+            unsigned long sequence = cell.sequence.load(std::memory_order_acquire);
+            long difference = (long) sequence - (long) (position + 1);
+            if (difference == 0){
+                if (pop_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)){
+                    group = cell.group;
+                    cell.sequence.store(position + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0){
+                return false;
+            } else {
+                position = pop_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<unsigned long> sequence; // The round and the role (producer / consumer) the cell waits for.
+        PipelineGroup group;
+    };
+
+    Cell *cells;
+    unsigned long mask; // The capacity - 1.
+    char padding_before[CACHE_LINE_SIZE];
+    std::atomic<unsigned long> push_position; // The producers and the consumers don't share a cache line.
+    char padding_between[CACHE_LINE_SIZE];
+    std::atomic<unsigned long> pop_position;
+    char padding_after[CACHE_LINE_SIZE];
+};
+
+
+struct cursors_k2_grater {
+    bool operator()(const MergeCursor &a, const MergeCursor &b) const {
+        return (*b.current->first < *a.current->first);
+    }
+};
+
+
+/**
+ * A pair of a spilled run that stays in memory, for finding positions in the file without reading it.
+ */
+struct SpillFence {
+    IntermediatePair pair; // The pair itself (disposed when the job ends).
+    unsigned long index; // The index of the pair in the run.
+    unsigned long offset; // The offset of the record of the pair in the spill file.
+};
+
+
+/**
+ * A sorted run of intermediate pairs that was written to the spill file of a thread. Every record in the file is the
+ * length of the encoded pair (uint32_t) followed by the encoded pair.
+ */
+struct SpillRun {
+    FILE *file; // The spill file of the thread that wrote the run.
+    unsigned long size; // The number of pairs in the run.
+    vector<SpillFence> fences; // Every SPILL_FENCE_INTERVAL'th pair of the run, starting with the first one.
+};
+
+
+/**
+ * Reads the pairs of a spilled run one at a time. Every reader has its own buffer and file offset (and reads with
+ * pread), so several threads can read the same file.
+ */
+struct SpillReader {
+    const SpillRun *run; // The run that is read.
+    unsigned long offset; // The offset in the file of the byte after the end of the buffer.
+    unsigned long remaining; // The number of pairs of the run that weren't decoded yet.
+    vector<char> buffer; // The bytes read from the file.
+    unsigned long begin; // The index of the first byte in the buffer that wasn't decoded yet.
+    unsigned long end; // The number of bytes in the buffer.
+    unsigned long bytes_read; // The number of bytes read from the file since the statistics were last updated.
+};
+
+
+/**
+ * The position of the next pair to merge in a run that may be in memory or on disk.
+ */
+struct StreamCursor {
+    IntermediatePair head; // The next pair of the run.
+    MergeCursor memory; // The rest of the run, if it is in memory.
+    SpillReader *reader; // The reader of the run if it was spilled, nullptr otherwise.
+};
+
+
+struct stream_cursors_k2_grater {
+    bool operator()(const StreamCursor &a, const StreamCursor &b) const {
+        return (*b.head.first < *a.head.first);
     }
 };
 
 
+/**
+ * The progress of one thread in the current stage, alone in its cache line, so the threads never write to the same
+ * line and a monitoring thread that reads the counters doesn't slow them down.
+ */
+struct ProgressCounter {
+    std::atomic<unsigned long long> done; // Written only by its own thread, never goes down.
+    std::atomic<unsigned long long> base; // The value of done when the current stage began (under the sequence lock).
+    char padding[CACHE_LINE_SIZE - 2 * sizeof(std::atomic<unsigned long long>)];
+};
+
+
+/**
+ * The index of the next group to reduce among the groups merged by one thread, on its own cache line.
+ */
+struct GroupCursor {
+    std::atomic<unsigned long> next;
+    char padding[CACHE_LINE_SIZE - sizeof(std::atomic<unsigned long>)];
+};
+
+
+/**
+ * The input indices that one thread still has to map, [begin, end), packed into one word (begin in the high half) so
+ * the thread and the threads that steal from it claim indices with a single CAS, on its own cache line.
+ */
+struct MapRange {
+    std::atomic<uint64_t> range;
+    char padding[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+};
+
+
+/**
+ * Packs a range of input indices into the word of a MapRange.
+ */
+uint64_t pack_map_range(uint64_t begin, uint64_t end){
+    return (begin << MAP_RANGE_BITS) | end;
+}
+
+
+/**
+ * The first index of a packed range.
+ */
+uint64_t map_range_begin(uint64_t range){
+    return range >> MAP_RANGE_BITS;
+}
+
+
+/**
+ * The index after the last index of a packed range.
+ */
+uint64_t map_range_end(uint64_t range){
+    return range & ((1ULL << MAP_RANGE_BITS) - 1);
+}
+
+
 /**
  * JobContext class declaration.
  */
@@ -154,7 +457,43 @@ class ThreadContext{
 public:
     int id; // The thread's id number.
     JobContext *job; // Keeps all the details about the job.
-    vector<IntermediateVec *> intermediate_pair_vec; // The vector that keeps the output of the map stage.
+    int chain_stage = 0; // The index of the job this thread runs, in a chain of jobs.
+    const MapReduceClient *client = nullptr; // The client of that job.
+    const CombinerClient *combiner = nullptr; // The client of that job if it has a combiner, nullptr otherwise.
+    IntermediateVec intermediate_vec; // The vector that keeps the output of the map stage.
+    IntermediateVec samples; // Evenly spaced pairs of the sorted intermediate_vec, used for choosing the splitters.
+    double sample_weight = 0; // The number of pairs that every sample represents.
+    vector<size_t> hashes; // The hashes of the keys in intermediate_vec, if the job groups by hash.
+    vector<unsigned long> buckets; // If the job groups by hash, the pairs of intermediate_vec that go to reducing
+    // thread r are in [buckets[r], buckets[r + 1]).
+    IntermediateVec shuffled; // All the pairs this thread merged in the shuffle stage, allocated once (the exact size
+    // of the thread's key range) and sorted by key.
+    vector<GroupSlice> groups; // The groups of equal keys in 'shuffled'.
+    vector<MergeCursor> range_cursors; // The key range of this thread in every sorted intermediate vector, between
+    // choosing the range and merging it.
+    deque<HotGroup> hot_groups; // The groups in 'groups' that are split between reducing threads, by group index.
+    vector<size_t> shuffled_hashes; // The hashes of the keys in 'shuffled', while grouping by hash.
+    IntermediateVec group_buffer; // Reused for passing a group to the client's reduce.
+    OutputVec output; // The pairs this thread emitted in the reduce stage.
+    vector<pair<unsigned long, unsigned long>> reduced_groups; // (group index, number of output pairs) of every group
+    // this thread reduced, in the order of output.
+    vector<int> reduced_owners; // The thread that merged every group in reduced_groups, if the job is pipelined (and
+    // the group index is in the groups of that thread).
+    unsigned long intermediate_bytes = 0; // The footprint of intermediate_vec, if the job has a memory budget.
+    FILE *spill_file = nullptr; // A temporary file with the runs this thread spilled, deleted when it is closed.
+    unsigned long spill_file_size = 0; // The number of bytes written to the spill file.
+    vector<SpillRun> spilled_runs; // The runs this thread wrote to the spill file in the map stage.
+    vector<SpillReader> readers; // This thread's readers of all the spilled runs, if the job spilled.
+    vector<StreamCursor> merge_cursors; // The runs in the key range of this thread, if the job spilled.
+    IntermediatePair range_begin; // A copy of the splitter at the beginning of this thread's key range, if the job
+    // spilled (the client may delete the original in reduce before the other threads are done with it).
+    IntermediatePair range_end; // A copy of the splitter at the end of this thread's key range, if the job spilled.
+    ThreadStats stats; // The statistics of this thread, written only by the thread itself.
+    InputSplit input_split; // The split this thread maps, if the job reads an input source.
+    int cpu = -1; // The core this thread is pinned to, -1 if the job isn't pinned.
+    int node = 0; // The NUMA node of that core.
+    vector<int> reduce_order; // The threads whose groups this thread reduces, in order: itself, the other threads on
+    // its node, and then the rest.
 
 
     /**
@@ -170,37 +509,67 @@ public:
 };
 
 
+/**
+ * Pins the threads of a job to cores according to the placement, and decides the order in which every thread takes the
+ * groups of the others in the reduce stage.
+ * @param job_context - the job context.
+ * @param placement - the placement of the threads.
+ */
+void place_threads(JobContext &job_context, ThreadPlacement placement);
+
+
 /**
  * The class JobContest that stores all the details needed in order to run the algorithm using multiple threads.
  */
 class JobContext{
 public:
-    const MapReduceClient * client; // The job client.
-    const InputVec * inputVec; // The input vector of the algorithm.
+    vector<const MapReduceClient *> clients; // The job client, followed by the clients of the jobs chained to it.
+    vector<const CombinerClient *> combiners; // The clients that have a combiner, nullptr for the others.
+    std::atomic<int> chain_stage; // The index in the chain of the job whose map stage started last.
+    std::atomic<unsigned long long> chained_pairs; // The number of pairs the threads emitted for the next job.
+    std::atomic<unsigned long long> early_chained_progress; // The pairs of the next job that threads mapped before its
+    // map stage started, and that weren't added to the progress yet.
+    const KeyHasher * hasher; // Hashes the keys if the job groups by hash instead of sorting, nullptr otherwise.
+    const KeyValueCodec * codec; // Serializes the spilled pairs, nullptr if the job has no memory budget.
+    unsigned long thread_budget; // The number of bytes of intermediate pairs every thread may keep in memory.
+    std::atomic<bool> spilled; // True if any of the threads spilled a run to disk.
+    const InputVec * inputVec; // The input vector of the algorithm, nullptr if the job reads an input source.
+    InputSource * input_source; // The source of the input, nullptr if the job reads an input vector.
+    const KeyEncoder * key_encoder; // Encodes the intermediate keys for sorting them as integers, nullptr for none.
+    int worker_processes; // The number of worker processes that run the job, 0 if the job runs in threads.
+    const KeyValueCodec * exchange_codec; // Serializes the pairs the worker processes exchange.
+    const OutputCodec * output_codec; // Serializes the output of the worker processes.
     OutputVec * outputVec; // The output vector where we'll keep the results.
     int num_of_threads; // The number of threads we have for this job.
-    unsigned long num_of_pairs; //The number of pairs in stage 2 and 3.
     JobState job_state{}; // An object that represents the job (_state and percentages).
-    deque<pthread_t> threads; // All the treads that will preform the job.
     deque<ThreadContext> thread_context; // A deque that keeps the ThreadContext of each thread.
-    std::atomic_uint64_t * progress; // An atomic counter for keeping track of the task progress for etch stage.
+    ProgressCounter * progress; // The progress of every thread in the current stage, summed by getJobState.
+    std::atomic<int> stage; // The current stage.
+    std::atomic<unsigned long long> stage_total; // The amount of work (input elements / pairs) in the current stage.
+    std::atomic<unsigned> progress_version; // A sequence lock over stage, stage_total and resetting the counters - odd
+    // while the stage is changing.
+    std::atomic<unsigned long long> next_input; // The index of the first input element that wasn't claimed (map), if
+    // the input is too large for map_ranges.
+    MapRange * map_ranges; // The input indices every thread still has to map, nullptr if the job doesn't map an input
+    // vector or it has more then 2^32 - 1 elements.
     Barrier *barrier; // The barrier used to ensure all threads had finished the mapping and sort stage.
-    Barrier *barrier_reduce; // The barrier used to ensure the main thread had finished the shuffle stage.
-    sem_t sem{}; // A semaphore for the 'shuffle' and 'reduce' stages.
-    vector<IntermediateVec> vector_of_vectors; // Keeps all the vectors (results / inputs) of all the threads for each
-    // stage.
-    pthread_mutex_t Mutex_get_progress{}; // The mutex used for blocking other threads when running critical sections.
+    Barrier *barrier_reduce; // The barrier used to ensure all threads had finished the shuffle stage.
+    GroupCursor * group_cursors; // The next group to reduce of every thread, over the groups that thread merged.
+    bool balanced_reduce; // True if every reducing thread gets a contiguous range of groups.
+    bool split_hot_keys; // True if the groups larger then the share of a reducing thread are reduced in parts.
+    std::atomic<int> finished_reducers; // The number of threads that finished the reduce stage.
+    bool pipeline; // True if the groups are reduced while the threads are still merging.
+    GroupQueue * group_queue; // The merged groups that wait for a reducing thread, if the job is pipelined.
+    std::atomic<int> merging_threads; // The number of threads that didn't finish merging, if the job is pipelined.
     pthread_mutex_t Mutex_set_atomic{}; // The mutex used for blocking other threads when running critical sections.
-    pthread_mutex_t Mutex_map{}; // The mutex used for blocking other threads when running critical sections.
-    pthread_mutex_t Mutex_sort{}; // The mutex used for blocking other threads when running critical sections.
-    pthread_mutex_t Mutex_reduce{}; // The mutex used for blocking other threads when running critical sections.
-    bool wait_for_job_bool; // Represents the state of the job (all the stages) - true if the job is finished and false
-    // otherwise.
-    bool finished_shuffle_stage; // Represents the state of the 'shuffle' stage - true if the shuffle stage is finished
-    // and false otherwise.
+    int finished_threads; // The number of threads that finished their part of the job.
+    std::chrono::steady_clock::time_point start_time; // When the job was started.
+    double seconds; // The wall time of the job, set by the last thread that finished.
+    const char * stats_path; // The file closeJobHandle writes the statistics to, nullptr for none.
+    pthread_mutex_t Mutex_finished{}; // Protects finished_threads.
+    pthread_cond_t job_finished{}; // Signaled when all the threads finished their part of the job.
     bool stage_job_to_do_set_map; // keeps track if atomic counter was initialized for the 'map' stage - true if was
     // initialized and false otherwise.
-    bool done_map; // Represents the state of the map stage - true if the 'map' stage is finished and false otherwise.
     bool stage_job_to_do_set_shuffle; // keeps track if atomic counter was initialized for the 'shuffle' stage - true if
     // was initialized and false otherwise.
     bool stage_job_to_do_set_reduce; // keeps track if atomic counter was initialized for the 'reduce' stage - true if
@@ -209,80 +578,285 @@ public:
 
     /**
      * A constructor for the JobContext.
-     * @param client - the job client.
-     * @param inputVec - the input vector of the algorithm.
+     * @param clients - the job client, followed by the clients of the jobs chained to it.
+     * @param inputVec - the input vector of the algorithm, nullptr if the job reads an input source.
+     * @param input_source - the source of the input, nullptr if the job reads an input vector.
      * @param outputVec - the output vector where we'll keep the results.
      * @param multiThreadLevel - the number of threads that will preform this job.
+     * @param options - the options of the job.
      */
-    JobContext(const MapReduceClient* client,
-               const InputVec& inputVec, OutputVec& outputVec,
-               int multiThreadLevel){
-        this->client= client;
-        this->inputVec = &inputVec;
+    JobContext(const vector<const MapReduceClient *>& clients,
+               const InputVec* inputVec, InputSource* input_source, OutputVec& outputVec,
+               int multiThreadLevel, const JobOptions& options){
+        this->clients = clients;
+        bool all_combine = true;
+        for (const MapReduceClient *client : clients){
+            this->combiners.push_back(dynamic_cast<const CombinerClient *>(client));
+            all_combine = all_combine && this->combiners.back();
+        }
+        this->chain_stage = 0;
+        this->chained_pairs = 0;
+        this->early_chained_progress = 0;
+        this->inputVec = inputVec;
+        this->input_source = input_source;
         this->outputVec = &outputVec;
-        this->num_of_threads = min(multiThreadLevel, (int) inputVec.size());
+        this->worker_processes = (options.worker_processes > 0 && options.codec && options.output_codec && inputVec &&
+                                  clients.size() == 1) ? min(options.worker_processes, (int) inputVec->size()) : 0;
+        this->exchange_codec = options.codec;
+        this->output_codec = options.output_codec;
+        // The size of a source isn't known in advance, so it gets all the threads. A distributed job has one thread,
+        // which coordinates the worker processes.
+        if (this->worker_processes){
+            this->num_of_threads = 1;
+        } else {
+            this->num_of_threads = inputVec ? min(multiThreadLevel, (int) inputVec->size()) : max(multiThreadLevel, 0);
+        }
+        this->hasher = this->worker_processes ? nullptr : options.hasher;
+        this->key_encoder = options.key_encoder;
+        this->codec = (options.memory_budget && !this->hasher && !this->worker_processes) ? options.codec : nullptr;
+        this->thread_budget = (this->codec && this->num_of_threads) ? options.memory_budget / this->num_of_threads : 0;
+        this->spilled = false;
         this->job_state.stage = UNDEFINED_STAGE;
         this->job_state.percentage = 0;
-        this->num_of_pairs = 0;
+        this->split_hot_keys = options.split_hot_keys && all_combine;
+        this->balanced_reduce = options.balanced_reduce || this->split_hot_keys;
+        this->finished_reducers = 0;
+        this->pipeline = options.pipeline_reduce && !this->hasher && !this->balanced_reduce;
+        this->group_queue = this->pipeline ? new GroupQueue(PIPELINE_QUEUE_SIZE) : nullptr;
+        this->merging_threads = this->num_of_threads;
         this->barrier = new Barrier(this->num_of_threads);
         this->barrier_reduce = new Barrier(this->num_of_threads);
         for (int i = 0; i < num_of_threads; ++i) {
             thread_context.emplace_back(i,this);
-            threads.emplace_back();
         }
-        this->progress = new std::atomic_uint64_t(0);
-        handling_mutex(this->Mutex_get_progress, INITIALIZE);
+        this->progress = new ProgressCounter[max(num_of_threads, 1)]();
+        this->group_cursors = new GroupCursor[max(num_of_threads, 1)]();
+        this->map_ranges = nullptr;
+        if (inputVec && inputVec->size() < (1ULL << MAP_RANGE_BITS)){
+            // Every thread starts with a contiguous slice of the input.
+            this->map_ranges = new MapRange[max(num_of_threads, 1)]();
+            uint64_t input_size = inputVec->size();
+            for (int i = 0; i < num_of_threads; ++i){
+                this->map_ranges[i].range = pack_map_range(input_size * i / num_of_threads,
+                                                       input_size * (i + 1) / num_of_threads);
+            }
+        }
+        place_threads(*this, options.placement);
+        this->stage = UNDEFINED_STAGE;
+        this->stage_total = 0;
+        this->progress_version = 0;
+        this->next_input = 0;
         handling_mutex(this->Mutex_set_atomic, INITIALIZE);
-        handling_mutex(this->Mutex_map, INITIALIZE);
-        handling_mutex(this->Mutex_sort, INITIALIZE);
-        handling_mutex(this->Mutex_reduce, INITIALIZE);
-        this->wait_for_job_bool = false;
-        this->finished_shuffle_stage = false;
+        this->finished_threads = 0;
+        this->start_time = std::chrono::steady_clock::now();
+        this->seconds = 0;
+        this->stats_path = options.stats_path;
+        handling_mutex(this->Mutex_finished, INITIALIZE);
+        handling_cond(this->job_finished, INITIALIZE);
         this->stage_job_to_do_set_map = false;
         this->stage_job_to_do_set_shuffle = false;
         this->stage_job_to_do_set_reduce = false;
-        this->done_map = false;
-        handling_semaphore(this->sem, INITIALIZE);
     }
 };
 
 
+/**
+ * The cores the process may run on, grouped by NUMA node.
+ */
+struct CpuTopology {
+    vector<vector<int>> nodes; // The cores of every node that has any, in increasing order.
+    int num_of_cpus = 0; // The number of cores in all the nodes.
+};
+
+
+/**
+ * Parses a list of cores in the format of the kernel, e.g. "0-3,8,10-11".
+ * @param list - the list.
+ * @return the cores in the list.
+ */
+vector<int> parse_cpu_list(const char *list){
+    vector<int> cpus;
+    while (true){
+        char *end;
+        long first = strtol(list, &end, 10);
+        if (end == list){
+            break;
+        }
+        long last = first;
+        if (*end == '-'){
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+        for (long cpu = first; cpu <= last; ++cpu){
+            cpus.push_back((int) cpu);
+        }
+        if (*end != ','){
+            break;
+        }
+        list = end + 1;
+    }
+    return cpus;
+}
+
+
+/**
+ * Reads the NUMA nodes of the machine from sysfs, keeping only the cores in the affinity mask of the running thread.
+ * The cores that no node lists (all of them, on a machine without NUMA information) are put in a node of their own.
+ * @return the topology.
+ */
+CpuTopology read_cpu_topology(){
+    CpuTopology topology;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)){
+        error_handler(AFFINITY_ERROR);
+    }
+    vector<int> node_ids;
+    DIR *directory = opendir(NUMA_NODES_PATH);
+    if (directory != nullptr){
+        struct dirent *entry;
+        while ((entry = readdir(directory)) != nullptr){
+            int id;
+            char rest;
+            if (sscanf(entry->d_name, "node%d%c", &id, &rest) == 1){
+                node_ids.push_back(id);
+            }
+        }
+        closedir(directory);
+    }
+    std::sort(node_ids.begin(), node_ids.end());
+    vector<bool> placed(CPU_SETSIZE, false);
+    for (int id : node_ids){
+        string path = string(NUMA_NODES_PATH) + "/node" + std::to_string(id) + "/cpulist";
+        FILE *file = fopen(path.c_str(), "r");
+        if (file == nullptr){
+            continue;
+        }
+        char list[4096];
+        vector<int> cpus;
+        if (fgets(list, sizeof(list), file) != nullptr){
+            for (int cpu : parse_cpu_list(list)){
+                if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed) && !placed[cpu]){
+                    cpus.push_back(cpu);
+                    placed[cpu] = true;
+                }
+            }
+        }
+        fclose(file);
+        if (!cpus.empty()){
+            topology.nodes.push_back(cpus);
+        }
+    }
+    vector<int> rest;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu){
+        if (CPU_ISSET(cpu, &allowed) && !placed[cpu]){
+            rest.push_back(cpu);
+        }
+    }
+    if (!rest.empty()){
+        topology.nodes.push_back(rest);
+    }
+    for (const auto &cpus : topology.nodes){
+        topology.num_of_cpus += (int) cpus.size();
+    }
+    return topology;
+}
+
+
+/**
+ * The topology of the machine, read once, when the first job is started.
+ * @return the topology.
+ */
+const CpuTopology &cpu_topology(){
+    static const CpuTopology topology = read_cpu_topology();
+    return topology;
+}
+
+
+void place_threads(JobContext &job_context, ThreadPlacement placement){
+    const CpuTopology &topology = cpu_topology();
+    int num_of_nodes = (int) topology.nodes.size();
+    for (auto &tc : job_context.thread_context){
+        if (placement == PLACEMENT_COMPACT){
+            int position = tc.id % topology.num_of_cpus;
+            tc.node = 0;
+            while (position >= (int) topology.nodes[tc.node].size()){
+                position -= (int) topology.nodes[tc.node].size();
+                tc.node++;
+            }
+            tc.cpu = topology.nodes[tc.node][position];
+        } else if (placement == PLACEMENT_SPREAD){
+            tc.node = tc.id % num_of_nodes;
+            const vector<int> &cpus = topology.nodes[tc.node];
+            tc.cpu = cpus[(tc.id / num_of_nodes) % cpus.size()];
+        }
+    }
+    int num_of_threads = job_context.num_of_threads;
+    for (auto &tc : job_context.thread_context){
+        tc.reduce_order.clear();
+        for (int i = 0; i < num_of_threads; ++i){
+            int other = (tc.id + i) % num_of_threads;
+            if (job_context.thread_context[other].node == tc.node){
+                tc.reduce_order.push_back(other);
+            }
+        }
+        for (int i = 0; i < num_of_threads; ++i){
+            int other = (tc.id + i) % num_of_threads;
+            if (job_context.thread_context[other].node != tc.node){
+                tc.reduce_order.push_back(other);
+            }
+        }
+    }
+}
+
+
 /**
  * Initialize atomic counter for a given stage.
  * @param stage - the stage that sets the atomic counter.
- * @param context - job context / thread context.
+ * @param tc - the context of the running thread.
  * @param value - value to set as the amount of job to be done (number of pairs to processes).
  */
-void set_atomic(stage_t stage, void * context, unsigned long long value){
-    JobContext * job_context;
+void set_atomic(stage_t stage, ThreadContext *tc, unsigned long long value){
+    JobContext * job_context = tc->job;
+    std::chrono::steady_clock::time_point lock_start = std::chrono::steady_clock::now();
+    handling_mutex(job_context->Mutex_set_atomic, LOCK);
     bool did_set;
     switch (stage) {
         case MAP_STAGE:
-            job_context = ((ThreadContext *) context)->job;
-            handling_mutex(job_context->Mutex_set_atomic, LOCK);
+            tc->stats.phases[MAP_PHASE].lock_wait += seconds_since(lock_start);
             did_set = job_context->stage_job_to_do_set_map;
             break;
         case REDUCE_STAGE:
-            job_context = ((JobContext *) context);
-            handling_mutex(job_context->Mutex_set_atomic, LOCK);
+            tc->stats.phases[REDUCE_PHASE].lock_wait += seconds_since(lock_start);
             did_set = job_context->stage_job_to_do_set_reduce;
             break;
         case SHUFFLE_STAGE:
-            job_context = ((JobContext *) context);
-            handling_mutex(job_context->Mutex_set_atomic, LOCK);
+            tc->stats.phases[SHUFFLE_PHASE].lock_wait += seconds_since(lock_start);
             did_set = job_context->stage_job_to_do_set_shuffle;
             break;
     }
     if (!did_set){
-        unsigned long long temp = (((unsigned long long) stage) << BITS_TODO_AND_DONE) & MASK_STAGE;
-        temp |= ((value << BITS_TODO_DONE) & MASK_JOB_TO_D0);
-        (job_context->progress)->store(temp);
+        // The counters aren't reset, since a thread of a chained job may still be adding progress to its counter: the
+        // progress of the stage is counted from their values now.
+        unsigned version = job_context->progress_version.load(std::memory_order_relaxed);
+        job_context->progress_version.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        job_context->stage.store(stage, std::memory_order_relaxed);
+        job_context->stage_total.store(value, std::memory_order_relaxed);
+        for (int i = 0; i < job_context->num_of_threads; ++i){
+            job_context->progress[i].base.store(job_context->progress[i].done.load(std::memory_order_relaxed),
+                                                std::memory_order_relaxed);
+        }
+        job_context->progress_version.store(version + 2, std::memory_order_release);
         switch (stage) {
             case MAP_STAGE:
                 job_context->stage_job_to_do_set_map = true;
                 break;
             case REDUCE_STAGE:
                 job_context->stage_job_to_do_set_reduce = true;
+                // All the threads chose their reduce path by now, and none of them maps the next stage of a chained
+                // job (which may spill again) before getting here.
+                job_context->spilled = false;
                 break;
             case SHUFFLE_STAGE:
                 job_context->stage_job_to_do_set_shuffle = true;
@@ -294,224 +868,2580 @@ void set_atomic(stage_t stage, void * context, unsigned long long value){
 
 
 /**
- * Runs the map phase.
- * @param thread_context - the ThreadContext object representing the context of the running thread.
+ * Adds to the progress of the thread in the current stage. Only the thread itself writes to its counter, so there is no
+ * need for an atomic read-modify-write.
+ * @param tc - the context of the running thread.
+ * @param amount - the amount of work the thread finished.
  */
-void running_map_phase(void *thread_context){
-    auto *tc = (ThreadContext *) thread_context;
-    set_atomic(MAP_STAGE, tc, tc->job->inputVec->size());
-    tc->intermediate_pair_vec.clear();
-    // Using atomic counter in order not to have deadlock.
-    while (!tc->job->done_map){
-        // Mapping each pair in the input_vector:
-        auto *temp_vec = new IntermediateVec;
-        handling_mutex(tc->job->Mutex_map, LOCK);
-        if (((*(tc->job->progress)) & MASK_JOB_DONE) + 1 > tc->job->inputVec->size()){
-            tc->job->done_map = true;
-            handling_mutex(tc->job->Mutex_map, UNLOCK);
-            break;
-        }
-        unsigned long long index = (*(tc->job->progress))++ & MASK_JOB_DONE;
-        handling_mutex(tc->job->Mutex_map, UNLOCK);
-        tc->job->client->map(tc->job->inputVec->at(index).first, tc->job->inputVec->at(index).second, temp_vec);
-        tc->intermediate_pair_vec.push_back(temp_vec);
-    }
+void add_progress(ThreadContext *tc, unsigned long long amount){
+    std::atomic<unsigned long long> &done = tc->job->progress[tc->id].done;
+    done.store(done.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
 }
 
 
 /**
- * The sort phase.
- * @param thread_context - the ThreadContext object representing the context of the running thread.
+ * Decides how many input elements a thread claims at once in the map phase. Large chunks at the beginning keep the
+ * claim traffic on the input counter low, and the chunks shrink towards the end so all the threads finish together.
+ * @param remaining - the number of input elements that weren't claimed yet.
+ * @param num_of_threads - the number of threads running the map phase.
+ * @return the number of input elements to claim.
  */
-void sort_phase(void *thread_context){
-    auto* tc = (ThreadContext*) thread_context;
-    // Sorting all the elements we got from the map phase:
-    for (auto it: tc->intermediate_pair_vec){
-        // Adding all the vectors into the vector of vector:
-        handling_mutex(tc->job->Mutex_sort, LOCK);
-        tc->job->vector_of_vectors.push_back(*it);
-        handling_mutex(tc->job->Mutex_sort, UNLOCK);
-        delete it;
-    }
+unsigned long long map_chunk_size(unsigned long long remaining, int num_of_threads){
+    unsigned long long chunk = remaining / (MAP_CHUNKS_PER_THREAD * (unsigned long long) num_of_threads);
+    return std::max(1ULL, min(chunk, (unsigned long long) MAX_MAP_CHUNK));
 }
 
 
 /**
- * Saves all the pairs with the same key to vector OF VECTORS.
- * @param this_pair - the current pair that is in the top of the min heap of pairs.
- * @param last_pair - the current pair that represents the pair with the smallest key seen this far.
- * @param saving_all_pairs - - a vector with all pairs with the same key.
- * @param job_context - the job context.
+ * Sorts the intermediate vector of the thread by key: by the codes of the keys if the job has a key encoder, and with
+ * std::sort otherwise.
+ * @param tc - the context of the running thread.
  */
-void update_saving_all_pairs(pair<K2 *, V2 *> * this_pair, pair<K2 *, V2 *> * last_pair,
-                             IntermediateVec * saving_all_pairs, JobContext * job_context){
-    *last_pair = *this_pair;
-    job_context->vector_of_vectors.push_back(*saving_all_pairs);
-    saving_all_pairs->clear();
-    handling_semaphore(job_context->sem, INCREASE);
+void sort_intermediate(ThreadContext *tc){
+    IntermediateVec &pairs = tc->intermediate_vec;
+    const KeyEncoder *encoder = tc->job->key_encoder;
+    if (encoder == nullptr){
+        std::sort(pairs.begin(), pairs.end(), compare_by_first_element);
+        return;
+    }
+    vector<uint64_t> codes(pairs.size());
+    vector<uint64_t> order(pairs.size());
+    for (unsigned long i = 0; i < pairs.size(); ++i){
+        codes[i] = encoder->encode(pairs[i].first);
+        order[i] = i;
+    }
+    sort_keys(codes, order);
+    IntermediateVec sorted(pairs.size());
+    for (unsigned long i = 0; i < pairs.size(); ++i){
+        sorted[i] = pairs[order[i]];
+    }
+    pairs.swap(sorted);
 }
 
 
 /**
- * The shuffle phase.
- * @param job_context - A jobContext object representing the job context.
+ * Runs the client's combiner on every run of pairs with equal keys in the sorted intermediate vector of the thread.
+ * The combined vector stays sorted, since the combiner keeps the key of the run.
+ * @param tc - the context of the running thread.
  */
-void shuffle_phase(JobContext *job_context){
-    vector<IntermediateVec> new_sequences;
-    priority_queue<pair<K2 *, V2 *>, vector<pair<K2 *, V2 *>>, pairs_k2_grater> all_pairs;
-    for (const auto &it: job_context->vector_of_vectors){
-        if (it.empty()){
-            continue;
-        }
-        job_context->num_of_pairs += it.size();
-        for (auto pair : it){
-            all_pairs.push(pair);
-        }
-    }
-    set_atomic(SHUFFLE_STAGE, job_context, job_context->num_of_pairs);
-    auto temp = job_context->vector_of_vectors;
-    job_context->vector_of_vectors.clear();
-    pair<K2 *, V2 *> last_pair = all_pairs.top();
-    IntermediateVec saving_all_pairs;
-    while (!all_pairs.empty()) {
-        pair<K2 *, V2 *> this_pair = all_pairs.top();
-        if (!compare_by_first_element(last_pair, this_pair) && !compare_by_first_element(this_pair, last_pair)){
-            saving_all_pairs.push_back(this_pair);
-            all_pairs.pop();
-            (*(job_context->progress))++;
-            if (all_pairs.empty()) {
-                update_saving_all_pairs(&this_pair, &last_pair, &saving_all_pairs, job_context);
-            }
+void combine_phase(ThreadContext *tc){
+    IntermediateVec &sorted = tc->intermediate_vec;
+    IntermediateVec combined;
+    combined.reserve(sorted.size());
+    IntermediateVec run;
+    auto begin = sorted.begin();
+    while (begin != sorted.end()){
+        auto end = begin + 1;
+        while (end != sorted.end() && !(*begin->first < *end->first)){
+            ++end;
         }
-        else {
-            update_saving_all_pairs(&this_pair, &last_pair, &saving_all_pairs, job_context);
+        if (end - begin == 1){
+            combined.push_back(*begin);
+        } else {
+            run.assign(begin, end);
+            tc->combiner->combine(&run, &combined);
         }
+        begin = end;
     }
-    job_context->finished_shuffle_stage = true;
+    sorted.swap(combined);
 }
 
 
 /**
- * The reduce phase.
- * @param job_context - A jobContext object representing the job context.
+ * Returns a new copy of a pair, made by the codec.
+ * @param codec - the codec of the job.
+ * @param original - the pair to copy.
+ * @return the copy.
  */
-void reduce_phase(JobContext *job_context){
-    if (job_context->finished_shuffle_stage) {
-        set_atomic(REDUCE_STAGE, job_context, job_context->num_of_pairs);
-        while (!job_context->vector_of_vectors.empty()) {
-            handling_semaphore(job_context->sem, DECREASE);
-            if (job_context->vector_of_vectors.empty()){
-                break;
-            }
-            handling_mutex(job_context->Mutex_reduce, LOCK);
-            const IntermediateVec element_reduce = job_context->vector_of_vectors.front();
-            job_context->vector_of_vectors.erase(job_context->vector_of_vectors.begin());
-            job_context->client->reduce(&element_reduce, job_context);
-            (*(job_context->progress))+= element_reduce.size();
-            handling_mutex(job_context->Mutex_reduce, UNLOCK);
+IntermediatePair copy_pair(const KeyValueCodec *codec, const IntermediatePair &original){
+    string encoded;
+    codec->encode(original, encoded);
+    return codec->decode(encoded.data(), encoded.size());
+}
+
+
+/**
+ * Appends the intermediate vector of the thread (sorted, and combined if the client has a combiner) to the spill file
+ * of the thread, and disposes the pairs, except the fences.
+ * @param tc - the context of the running thread.
+ */
+void spill_run(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    sort_intermediate(tc);
+    if (tc->combiner){
+        combine_phase(tc);
+    }
+    if (tc->spill_file == nullptr){
+        tc->spill_file = tmpfile();
+        if (tc->spill_file == nullptr){
+            error_handler(SPILL_FILE_ERROR);
+        }
+    }
+    FILE *file = tc->spill_file;
+    tc->spilled_runs.push_back({file, 0, vector<SpillFence>()});
+    SpillRun &run = tc->spilled_runs.back();
+    string record;
+    unsigned long &offset = tc->spill_file_size;
+    unsigned long run_offset = offset;
+    for (const auto &it : tc->intermediate_vec){
+        record.clear();
+        job_context->codec->encode(it, record);
+        uint32_t length = record.size();
+        if (fwrite(&length, sizeof(length), 1, file) != 1 ||
+            fwrite(record.data(), 1, record.size(), file) != record.size()){
+            error_handler(SPILL_WRITE_ERROR);
         }
-        handling_semaphore(job_context->sem, INCREASE);
+        if (run.size % SPILL_FENCE_INTERVAL == 0){
+            run.fences.push_back({it, run.size, offset});
+        } else {
+            job_context->codec->dispose(it);
+        }
+        offset += sizeof(length) + record.size();
+        run.size++;
+    }
+    if (fflush(file) != 0){
+        error_handler(SPILL_WRITE_ERROR);
     }
+    tc->stats.phases[MAP_PHASE].bytes += offset - run_offset;
+    tc->intermediate_vec.clear();
+    tc->intermediate_bytes = 0;
+    job_context->spilled = true;
 }
 
 
 /**
- * The function (entry point) that all the threads running the job execute.
- * @param thread_context - the ThreadContext object representing the context of the running thread.
+ * Adds the footprint of the pairs the thread emitted since first_new to the footprint of its intermediate vector, and
+ * spills the vector when it passes the share of the thread in the memory budget.
+ * @param tc - the context of the running thread.
+ * @param first_new - the index of the first new pair in the intermediate vector.
  */
-void *main_map_reduce_framework(void *thread_context){
-    auto* tc = (ThreadContext*) thread_context;
-    running_map_phase(tc);
-    sort_phase(tc);
-    tc->job->barrier->barrier();
-    if (tc->id == MAIN_T_ID){
-        shuffle_phase(tc->job);
+void track_memory(ThreadContext *tc, unsigned long first_new){
+    for (unsigned long i = first_new; i < tc->intermediate_vec.size(); ++i){
+        tc->intermediate_bytes += sizeof(IntermediatePair) + tc->job->codec->footprint(tc->intermediate_vec[i]);
+    }
+    if (tc->intermediate_bytes > tc->job->thread_budget){
+        spill_run(tc);
     }
-    tc->job->barrier_reduce->barrier();
-    reduce_phase(tc->job);
-    return nullptr;
 }
 
 
 /**
- * Produces Intermediate pair (K2*, V2*).
- * @param key It's type K2.
- * @param value It's type V2.
- * @param context the tread context.
+ * Accounts for the pairs a map call emitted, and spills if the thread passed its memory budget.
+ * @param tc - the context of the running thread.
+ * @param first_new - the index of the first pair the map call emitted in the intermediate vector.
  */
-void emit2(K2 *key, V2 *value, void *context){
-    IntermediatePair temp = IntermediatePair(key, value);
-    auto *tc = (IntermediateVec *) context;
-    tc->push_back(temp);
+void count_emitted(ThreadContext *tc, unsigned long first_new){
+    tc->stats.phases[MAP_PHASE].bytes += (tc->intermediate_vec.size() - first_new) * sizeof(IntermediatePair);
+    if (tc->job->codec){
+        track_memory(tc, first_new);
+    }
 }
 
+
 /**
- * Produces Intermediate pair (K3*, V3*).
- * @param key It's type K3.
- * @param value It's type V3.
- * @param context the tread context.
+ * Passes one input element to the client's map.
+ * @param tc - the context of the running thread.
+ * @param key - the key of the element.
+ * @param value - the value of the element.
  */
-void emit3(K3 *key, V3 *value, void *context)
-{
-    auto *job = (JobContext *) context;
-    OutputPair temp = OutputPair(key, value);
-    job->outputVec->push_back(temp);
+void map_element(ThreadContext *tc, const K1 *key, const V1 *value){
+    unsigned long first_new = tc->intermediate_vec.size();
+    tc->client->map(key, value, &tc->intermediate_vec);
+    count_emitted(tc, first_new);
 }
 
 
 /**
- *In this function we start the MapReduce algorithm.
- * @param client - the job client.
- * @param inputVec - the input vector of the algorithm.
- * @param outputVec - the output vector where we'll keep the results.
- * @param multiThreadLevel - the number of threads that will preform this job.
- * @return - a JobHandle object representing the job to preform.
+ * The map phase of a job that is chained to a previous one - every thread maps the pairs it emitted in the reduce
+ * stage of the previous job, as soon as it finished reducing (the other threads may still be reducing).
+ * @param tc - the context of the running thread.
  */
-JobHandle startMapReduceJob(const MapReduceClient& client,
-                            const InputVec& inputVec, OutputVec& outputVec,
-                            int multiThreadLevel){
-    auto *job = new JobContext(&client, inputVec, outputVec, multiThreadLevel);
-    for (int i = 0; i < job->num_of_threads; ++i) {
-        if (pthread_create(&job->threads.at(i), nullptr, main_map_reduce_framework, &job->thread_context[i])) {
-            error_handler(INIT_THREAD_ERROR);
+void map_chained_output(ThreadContext *tc){
+    auto *client = dynamic_cast<const ChainableMapReduceClient *>(tc->client);
+    OutputVec input;
+    input.swap(tc->output);
+    unsigned long long pending = 0;
+    for (unsigned long i = 0; i < input.size(); ++i){
+        unsigned long first_new = tc->intermediate_vec.size();
+        client->mapChained(input[i].first, input[i].second, &tc->intermediate_vec);
+        count_emitted(tc, first_new);
+        // The map stage starts when the last thread finished reducing the previous job; until then the progress is
+        // kept by the thread.
+        if (++pending == MAX_MAP_CHUNK && tc->job->chain_stage.load(std::memory_order_acquire) == tc->chain_stage){
+            add_progress(tc, pending);
+            pending = 0;
         }
     }
-    return job;
+    if (pending){
+        if (tc->job->chain_stage.load(std::memory_order_acquire) == tc->chain_stage){
+            add_progress(tc, pending);
+        } else {
+            // The thread finished mapping before the map stage started: finish_reduce reports the pairs when it
+            // starts the stage, unless the stage started in the meantime.
+            tc->job->early_chained_progress.fetch_add(pending);
+            if (tc->job->chain_stage.load() == tc->chain_stage){
+                add_progress(tc, tc->job->early_chained_progress.exchange(0));
+            }
+        }
+    }
+    tc->stats.phases[MAP_PHASE].items += input.size();
 }
 
 
 /**
- * Ensures the if a thread had finished it's job it will wait for all the other threads to finish as well.
- * @param job - the JobHandle object representing the job that the algorithm is preforming.
+ * The map phase of a job that reads an input source - every thread takes splits from the source until it is over.
+ * @param tc - the context of the running thread.
  */
-void waitForJob(JobHandle job){
-    auto *new_job = (JobContext *) job;
-    if (!new_job->wait_for_job_bool) {
-        for (int i = 0; i < new_job->num_of_threads; ++i) {
-            if (pthread_join(new_job->threads.at(i), nullptr)) {
-                error_handler(JOIN_THREAD_ERROR);
-            }
+void map_input_source(ThreadContext *tc){
+    InputSplit &split = tc->input_split;
+    while (tc->job->input_source->next_split(split)){
+        for (const auto &record : split.records){
+            map_element(tc, nullptr, &record);
         }
+        add_progress(tc, split.weight);
+        tc->stats.phases[MAP_PHASE].items += split.records.size();
     }
-    new_job->wait_for_job_bool = true;
+    vector<InputRecord>().swap(split.records);
+    string().swap(split.buffer);
 }
 
 
 /**
- * Sets the jobState object.
- * @param job - the JobHandle object representing the job that the algorithm is preforming.
- * @param state - the state to load into the stage and percentage.
+ * Maps input elements, and counts them in the progress and the statistics of the thread.
+ * @param tc - the context of the running thread.
+ * @param begin - the index of the first element.
+ * @param end - the index after the last element.
  */
-void getJobState(JobHandle job, JobState *state){
-    auto *new_job = (JobContext *) job;
-    unsigned long long temp = (*(new_job->progress));
-    unsigned long long done = temp & MASK_JOB_DONE;
-    unsigned long long to_do = (temp & MASK_JOB_TO_D0) >> BITS_TODO_DONE;
-    handling_mutex(new_job->Mutex_get_progress, LOCK);
-    state->percentage = ((float) done / (float) to_do) * HANDLE_PERCENTAGES;
-    state->stage = stage_t((temp & MASK_STAGE) >> BITS_TODO_AND_DONE);
-    handling_mutex(new_job->Mutex_get_progress, UNLOCK);
-
+void map_input_elements(ThreadContext *tc, unsigned long long begin, unsigned long long end){
+    for (unsigned long long index = begin; index < end; ++index){
+        const InputPair &input = (*(tc->job->inputVec))[index];
+        map_element(tc, input.first, input.second);
+    }
+    add_progress(tc, end - begin);
+    tc->stats.phases[MAP_PHASE].items += end - begin;
+}
+
+
+/**
+ * Takes the upper half of the remaining input of the thread that has the most left (preferring the threads on the
+ * same NUMA node, which come first in reduce_order), and makes it the range of this thread.
+ * @param tc - the context of the running thread, whose own range is empty.
+ * @return false if no thread had input left.
+ */
+bool steal_map_range(ThreadContext *tc){
+    MapRange *ranges = tc->job->map_ranges;
+    while (true){
+        int victim = -1;
+        uint64_t victim_range = 0;
+        uint64_t most_left = 0;
+        for (int other : tc->reduce_order){
+            uint64_t range = ranges[other].range.load();
+            if (other != tc->id && map_range_end(range) - map_range_begin(range) > most_left){
+                victim = other;
+                victim_range = range;
+                most_left = map_range_end(range) - map_range_begin(range);
+            }
+        }
+        if (victim < 0){
+            return false;
+        }
+        uint64_t begin = map_range_begin(victim_range);
+        uint64_t end = map_range_end(victim_range);
+        uint64_t middle = begin + (end - begin) / 2;
+        // The victim keeps [begin, middle) - it may be claiming from the front at the same time, so the CAS fails if
+        // either of us got there first, and the victim is chosen again.
+        if (ranges[victim].range.compare_exchange_weak(victim_range, pack_map_range(begin, middle))){
+            ranges[tc->id].range.store(pack_map_range(middle, end));
+            return true;
+        }
+    }
+}
+
+
+/**
+ * Maps the input vector with work stealing: every thread maps its own slice from the front, a few elements at a time,
+ * and a thread that runs out steals half of the remaining slice of another thread. The common path touches only the
+ * thread's own range (and contiguous input), and a few expensive elements can't hold up the rest of the threads.
+ * @param tc - the context of the running thread.
+ */
+void map_input_ranges(ThreadContext *tc){
+    MapRange &own = tc->job->map_ranges[tc->id];
+    do {
+        uint64_t range = own.range.load();
+        while (map_range_begin(range) < map_range_end(range)){
+            uint64_t begin = map_range_begin(range);
+            uint64_t end = min(map_range_end(range), begin + MAP_BATCH);
+            // A thief may take the end of the range meanwhile, then the CAS reloads it.
+            if (own.range.compare_exchange_weak(range, pack_map_range(end, map_range_end(range)))){
+                map_input_elements(tc, begin, end);
+                range = own.range.load();
+            }
+        }
+    } while (steal_map_range(tc));
+}
+
+
+/**
+ * Runs the map phase. Every thread maps a slice of the input vector with work stealing (see map_input_ranges), or, if
+ * the input is too large for the packed ranges, claims chunks of input indices with a single fetch_add on the input
+ * counter. Every thread emits all of its pairs into its own intermediate vector.
+ * @param thread_context - the ThreadContext object representing the context of the running thread.
+ */
+void running_map_phase(void *thread_context){
+    auto *tc = (ThreadContext *) thread_context;
+    tc->intermediate_vec.clear();
+    if (tc->chain_stage > 0){
+        map_chained_output(tc);
+        return;
+    }
+    if (tc->job->input_source){
+        set_atomic(MAP_STAGE, tc, tc->job->input_source->total());
+        map_input_source(tc);
+        return;
+    }
+    unsigned long long input_size = tc->job->inputVec->size();
+    set_atomic(MAP_STAGE, tc, input_size);
+    if (tc->job->map_ranges){
+        map_input_ranges(tc);
+        return;
+    }
+    while (true){
+        unsigned long long claimed = tc->job->next_input.load(std::memory_order_relaxed);
+        if (claimed >= input_size){
+            break;
+        }
+        unsigned long long chunk = map_chunk_size(input_size - claimed, tc->job->num_of_threads);
+        unsigned long long begin = tc->job->next_input.fetch_add(chunk);
+        if (begin >= input_size){
+            break;
+        }
+        map_input_elements(tc, begin, min(begin + chunk, input_size));
+    }
+}
+
+
+/**
+ * The sort phase - every thread sorts its own intermediate vector, combines it if the client has a combiner, and
+ * samples it.
+ * @param thread_context - the ThreadContext object representing the context of the running thread.
+ */
+void sort_phase(void *thread_context){
+    auto* tc = (ThreadContext*) thread_context;
+    tc->stats.phases[SORT_PHASE].items += tc->intermediate_vec.size();
+    sort_intermediate(tc);
+    if (tc->combiner){
+        combine_phase(tc);
+    }
+    unsigned long size = tc->intermediate_vec.size();
+    tc->stats.phases[SORT_PHASE].bytes += size * sizeof(IntermediatePair);
+    unsigned long num_of_samples = min(size, (unsigned long) SAMPLES_PER_THREAD);
+    tc->samples.clear();
+    for (unsigned long i = 0; i < num_of_samples; ++i){
+        tc->samples.push_back(tc->intermediate_vec[(i * size) / num_of_samples]);
+    }
+    tc->sample_weight = num_of_samples ? (double) size / (double) num_of_samples : 0;
+}
+
+
+/**
+ * Reorders pairs so that the pairs with equal keys are adjacent, using an open addressing hash table (with linear
+ * probing) of the groups. The groups keep the order in which their keys first appear.
+ * @param hasher - the key hasher of the job.
+ * @param pairs - the pairs to group, reordered in place.
+ * @param hashes - the hashes of the keys of the pairs, reordered together with them.
+ * @param groups - will store the groups.
+ */
+void group_by_hash(const KeyHasher *hasher, IntermediateVec &pairs, vector<size_t> &hashes,
+                   vector<GroupSlice> &groups){
+    unsigned long size = pairs.size();
+    int bits = 1;
+    while ((1UL << bits) < 2 * size){
+        bits++;
+    }
+    unsigned long mask = (1UL << bits) - 1;
+    vector<unsigned long> table(mask + 1, 0); // The index of the group + 1, or 0 for an empty slot.
+    vector<unsigned long> first_pair; // The index of the first pair of every group, which represents its key.
+    vector<unsigned long> group_of(size);
+    groups.clear();
+    for (unsigned long i = 0; i < size; ++i){
+        // The high bits of the product, since the low bits of the hash are the same for all the pairs of a bucket.
+        unsigned long slot = (unsigned long) (((uint64_t) hashes[i] * FIBONACCI_HASH_MULTIPLIER) >> (64 - bits));
+        while (table[slot] != 0){
+            unsigned long group = table[slot] - 1;
+            unsigned long other = first_pair[group];
+            if (hashes[other] == hashes[i] && hasher->equal(pairs[other].first, pairs[i].first)){
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+        if (table[slot] == 0){
+            table[slot] = groups.size() + 1;
+            first_pair.push_back(i);
+            groups.push_back({0, 0});
+        }
+        group_of[i] = table[slot] - 1;
+        groups[group_of[i]].size++;
+    }
+    unsigned long begin = 0;
+    for (auto &group : groups){
+        group.begin = begin;
+        begin += group.size;
+    }
+    IntermediateVec grouped(size);
+    vector<size_t> grouped_hashes(size);
+    // first_pair is reused as the next free position of every group.
+    for (unsigned long group = 0; group < groups.size(); ++group){
+        first_pair[group] = groups[group].begin;
+    }
+    for (unsigned long i = 0; i < size; ++i){
+        unsigned long position = first_pair[group_of[i]]++;
+        grouped[position] = pairs[i];
+        grouped_hashes[position] = hashes[i];
+    }
+    pairs.swap(grouped);
+    hashes.swap(grouped_hashes);
+}
+
+
+/**
+ * The partition phase, instead of the sort phase when the job groups by hash - every thread combines its intermediate
+ * vector (if the client has a combiner) and reorders it by the reducing thread of every pair, hash(key) %
+ * num_of_threads, with a counting sort.
+ * @param tc - the context of the running thread.
+ */
+void partition_phase(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    const KeyHasher *hasher = job_context->hasher;
+    IntermediateVec &pairs = tc->intermediate_vec;
+    vector<size_t> &hashes = tc->hashes;
+    tc->stats.phases[SORT_PHASE].items += pairs.size();
+    hashes.resize(pairs.size());
+    for (unsigned long i = 0; i < pairs.size(); ++i){
+        hashes[i] = hasher->hash(pairs[i].first);
+    }
+    if (tc->combiner){
+        vector<GroupSlice> groups;
+        group_by_hash(hasher, pairs, hashes, groups);
+        IntermediateVec combined;
+        combined.reserve(pairs.size());
+        IntermediateVec run;
+        for (const auto &group : groups){
+            if (group.size == 1){
+                combined.push_back(pairs[group.begin]);
+            } else {
+                run.assign(pairs.begin() + group.begin, pairs.begin() + group.begin + group.size);
+                tc->combiner->combine(&run, &combined);
+            }
+        }
+        pairs.swap(combined);
+        hashes.resize(pairs.size());
+        for (unsigned long i = 0; i < pairs.size(); ++i){
+            hashes[i] = hasher->hash(pairs[i].first);
+        }
+    }
+    unsigned long num_of_buckets = job_context->num_of_threads;
+    tc->buckets.assign(num_of_buckets + 1, 0);
+    for (size_t hash : hashes){
+        tc->buckets[hash % num_of_buckets + 1]++;
+    }
+    for (unsigned long r = 1; r <= num_of_buckets; ++r){
+        tc->buckets[r] += tc->buckets[r - 1];
+    }
+    vector<unsigned long> next(tc->buckets.begin(), tc->buckets.end() - 1);
+    IntermediateVec partitioned(pairs.size());
+    vector<size_t> partitioned_hashes(pairs.size());
+    for (unsigned long i = 0; i < pairs.size(); ++i){
+        unsigned long position = next[hashes[i] % num_of_buckets]++;
+        partitioned[position] = pairs[i];
+        partitioned_hashes[position] = hashes[i];
+    }
+    pairs.swap(partitioned);
+    hashes.swap(partitioned_hashes);
+    tc->stats.phases[SORT_PHASE].bytes += pairs.size() * sizeof(IntermediatePair);
+}
+
+
+/**
+ * Chooses the keys that split weighted samples into ranges of about the same weight.
+ * @param weighted_samples - the samples, with the number of pairs every one of them represents (sorted in place).
+ * @param total_weight - the sum of the weights.
+ * @param num_of_ranges - the number of ranges.
+ * @param splitters - gets the num_of_ranges - 1 splitters (or less, if there are not enough samples).
+ */
+void choose_weighted_splitters(vector<pair<IntermediatePair, double>> &weighted_samples, double total_weight,
+                               int num_of_ranges, IntermediateVec &splitters){
+    std::sort(weighted_samples.begin(), weighted_samples.end(),
+              [](const pair<IntermediatePair, double> &a, const pair<IntermediatePair, double> &b){
+                  return *a.first.first < *b.first.first;
+              });
+    splitters.clear();
+    double accumulated = 0;
+    auto sample = weighted_samples.begin();
+    for (int i = 1; i < num_of_ranges && sample != weighted_samples.end(); ++i){
+        double target = total_weight * i / num_of_ranges;
+        while (sample != weighted_samples.end() && accumulated + sample->second < target){
+            accumulated += sample->second;
+            ++sample;
+        }
+        if (sample != weighted_samples.end()){
+            splitters.push_back(sample->first);
+        }
+    }
+}
+
+
+/**
+ * Chooses num_of_threads - 1 splitters that divide the keys of all the sorted intermediate vectors into ranges with
+ * roughly the same number of pairs. Every sample is weighted by the number of pairs it represents (the fences of the
+ * spilled runs are samples too).
+ * @param job_context - the job context.
+ * @param splitters - will store the splitters, in increasing order.
+ */
+void choose_splitters(JobContext *job_context, IntermediateVec &splitters){
+    vector<pair<IntermediatePair, double>> weighted_samples;
+    double total_weight = 0;
+    for (const auto &tc : job_context->thread_context){
+        for (const auto &sample : tc.samples){
+            weighted_samples.emplace_back(sample, tc.sample_weight);
+        }
+        total_weight += tc.sample_weight * (double) tc.samples.size();
+        for (const auto &run : tc.spilled_runs){
+            for (const auto &fence : run.fences){
+                weighted_samples.emplace_back(fence.pair, SPILL_FENCE_INTERVAL);
+            }
+            total_weight += run.size;
+        }
+    }
+    choose_weighted_splitters(weighted_samples, total_weight, job_context->num_of_threads, splitters);
+}
+
+
+/**
+ * Closes the group of pairs with the same key that ends at the end of the shuffled pairs of the thread.
+ * @param group_begin - the index of the first pair of the group in the shuffled pairs.
+ * @param tc - the context of the thread that produced the group.
+ */
+void save_group(unsigned long group_begin, ThreadContext *tc){
+    unsigned long size = tc->shuffled.size() - group_begin;
+    add_progress(tc, size);
+    tc->groups.push_back({group_begin, size});
+}
+
+
+/**
+ * The largest group that is reduced as a whole when the job splits hot keys - the share of one reducing thread.
+ * @param job_context - the job context.
+ * @param num_of_pairs - the number of pairs in the job.
+ * @return the size.
+ */
+unsigned long hot_group_threshold(JobContext *job_context, unsigned long num_of_pairs){
+    return max(num_of_pairs / job_context->num_of_threads, 1UL);
+}
+
+
+/**
+ * Finds the groups the thread merged that are larger then the share of a reducing thread, and prepares them for
+ * being reduced in parts.
+ * @param tc - the context of the running thread.
+ * @param num_of_pairs - the number of pairs in the job.
+ */
+void find_hot_groups(ThreadContext *tc, unsigned long num_of_pairs){
+    unsigned long threshold = hot_group_threshold(tc->job, num_of_pairs);
+    tc->hot_groups.clear();
+    for (unsigned long i = 0; i < tc->groups.size(); ++i){
+        if (tc->groups[i].size > threshold){
+            tc->hot_groups.emplace_back(i, tc->groups[i].size, tc->job->num_of_threads);
+        }
+    }
+}
+
+
+/**
+ * Chooses the key range of the thread and places a cursor at its beginning in every sorted intermediate vector, and
+ * prepares the shuffled pairs of the thread for exactly the pairs of the range.
+ * @param tc - the context of the running thread.
+ */
+void find_range(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    IntermediateVec splitters;
+    choose_splitters(job_context, splitters);
+    // This thread merges the keys in [splitters[id - 1], splitters[id]).
+    tc->range_cursors.clear();
+    unsigned long range_size = 0;
+    for (const auto &it : job_context->thread_context){
+        const IntermediateVec &sorted = it.intermediate_vec;
+        MergeCursor cursor = {sorted.begin(), sorted.end()};
+        if (tc->id > 0 && tc->id - 1 < (int) splitters.size()){
+            cursor.current = std::lower_bound(sorted.begin(), sorted.end(), splitters[tc->id - 1].first,
+                                              compare_pair_to_key);
+        } else if (tc->id > 0){
+            cursor.current = sorted.end();
+        }
+        if (tc->id < (int) splitters.size()){
+            cursor.end = std::lower_bound(cursor.current, sorted.end(), splitters[tc->id].first,
+                                          compare_pair_to_key);
+        }
+        if (cursor.current != cursor.end){
+            range_size += cursor.end - cursor.current;
+            tc->range_cursors.push_back(cursor);
+        }
+    }
+    // The pairs are never moved after this, so other threads can read the groups while the merge goes on.
+    tc->shuffled.clear();
+    tc->shuffled.reserve(range_size);
+    tc->groups.clear();
+}
+
+
+/**
+ * Merges the key range of the thread with a k-way merge over the cursors, comparing the keys.
+ * @param tc - the context of the running thread.
+ * @param close_group - called with the index of the first pair of every group, when the group is at the end of the
+ * shuffled pairs.
+ */
+void merge_heap_range(ThreadContext *tc, void (*close_group)(unsigned long, ThreadContext *)){
+    priority_queue<MergeCursor, vector<MergeCursor>, cursors_k2_grater> cursors(cursors_k2_grater(),
+                                                                                 std::move(tc->range_cursors));
+    unsigned long group_begin = 0;
+    while (!cursors.empty()){
+        MergeCursor cursor = cursors.top();
+        cursors.pop();
+        // The pairs come out in increasing order, so a key that isn't larger then the last one is equal to it.
+        if (tc->shuffled.size() > group_begin && *tc->shuffled.back().first < *cursor.current->first){
+            close_group(group_begin, tc);
+            group_begin = tc->shuffled.size();
+        }
+        tc->shuffled.push_back(*cursor.current);
+        if (++cursor.current != cursor.end){
+            cursors.push(cursor);
+        }
+    }
+    if (tc->shuffled.size() > group_begin){
+        close_group(group_begin, tc);
+    }
+}
+
+
+/**
+ * Merges the key range of the thread by the codes of the keys: encodes the keys of the range in every sorted
+ * intermediate vector, merges the sorted runs of codes, and then copies the pairs to the shuffled pairs in the merged
+ * order and closes the groups (every group is a run of equal codes).
+ * @param tc - the context of the running thread.
+ * @param close_group - called with the index of the first pair of every group, when the group is at the end of the
+ * shuffled pairs.
+ */
+void merge_encoded_range(ThreadContext *tc, void (*close_group)(unsigned long, ThreadContext *)){
+    const KeyEncoder *encoder = tc->job->key_encoder;
+    vector<uint64_t> codes;
+    vector<uint64_t> order;
+    vector<size_t> run_ends;
+    vector<const IntermediatePair *> pairs;
+    unsigned long range_size = 0;
+    for (const auto &cursor : tc->range_cursors){
+        range_size += cursor.end - cursor.current;
+    }
+    codes.reserve(range_size);
+    order.reserve(range_size);
+    pairs.reserve(range_size);
+    for (const auto &cursor : tc->range_cursors){
+        for (auto it = cursor.current; it != cursor.end; ++it){
+            codes.push_back(encoder->encode(it->first));
+            order.push_back(pairs.size());
+            pairs.push_back(&*it);
+        }
+        run_ends.push_back(codes.size());
+    }
+    merge_key_runs(codes, order, run_ends);
+    unsigned long group_begin = 0;
+    for (unsigned long i = 0; i < codes.size(); ++i){
+        if (i > 0 && codes[i] != codes[i - 1]){
+            close_group(group_begin, tc);
+            group_begin = tc->shuffled.size();
+        }
+        tc->shuffled.push_back(*pairs[order[i]]);
+    }
+    if (tc->shuffled.size() > group_begin){
+        close_group(group_begin, tc);
+    }
+}
+
+
+/**
+ * Merges the key range of the thread from all the sorted intermediate vectors, using a k-way merge (or by the codes of
+ * the keys, if the job has a key encoder and isn't pipelined), into its shuffled pairs, and closes every group of pairs
+ * with the same key as soon as it is complete.
+ * @param tc - the context of the running thread.
+ * @param close_group - called with the index of the first pair of every group, when the group is at the end of the
+ * shuffled pairs.
+ */
+void merge_range(ThreadContext *tc, void (*close_group)(unsigned long, ThreadContext *)){
+    if (tc->job->key_encoder && !tc->job->pipeline){
+        merge_encoded_range(tc, close_group);
+    } else {
+        merge_heap_range(tc, close_group);
+    }
+    tc->range_cursors.clear();
+    tc->stats.phases[SHUFFLE_PHASE].items += tc->shuffled.size();
+    tc->stats.phases[SHUFFLE_PHASE].bytes += tc->shuffled.size() * sizeof(IntermediatePair);
+}
+
+
+/**
+ * The shuffle phase - every thread merges the pairs of one key range (between two splitters) from all the sorted
+ * intermediate vectors into one contiguous vector of the exact size of the range. The groups of pairs with the same key
+ * are slices of that vector.
+ * @param tc - the context of the running thread.
+ */
+void shuffle_phase(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    unsigned long num_of_pairs = 0;
+    for (const auto &it : job_context->thread_context){
+        num_of_pairs += it.intermediate_vec.size();
+    }
+    set_atomic(SHUFFLE_STAGE, tc, num_of_pairs);
+    find_range(tc);
+    merge_range(tc, save_group);
+    if (job_context->split_hot_keys){
+        find_hot_groups(tc, num_of_pairs);
+    }
+}
+
+
+/**
+ * The shuffle phase of a job that groups by hash - every thread collects the pairs that were partitioned to it by all
+ * the threads into one contiguous vector, and groups them with a hash table.
+ * @param tc - the context of the running thread.
+ */
+void hash_shuffle_phase(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    unsigned long num_of_pairs = 0;
+    unsigned long bucket_size = 0;
+    for (const auto &it : job_context->thread_context){
+        num_of_pairs += it.intermediate_vec.size();
+        bucket_size += it.buckets[tc->id + 1] - it.buckets[tc->id];
+    }
+    set_atomic(SHUFFLE_STAGE, tc, num_of_pairs);
+    tc->shuffled.clear();
+    tc->shuffled.reserve(bucket_size);
+    tc->shuffled_hashes.clear();
+    tc->shuffled_hashes.reserve(bucket_size);
+    for (const auto &it : job_context->thread_context){
+        tc->shuffled.insert(tc->shuffled.end(), it.intermediate_vec.begin() + it.buckets[tc->id],
+                            it.intermediate_vec.begin() + it.buckets[tc->id + 1]);
+        tc->shuffled_hashes.insert(tc->shuffled_hashes.end(), it.hashes.begin() + it.buckets[tc->id],
+                                   it.hashes.begin() + it.buckets[tc->id + 1]);
+    }
+    group_by_hash(job_context->hasher, tc->shuffled, tc->shuffled_hashes, tc->groups);
+    vector<size_t>().swap(tc->shuffled_hashes);
+    if (job_context->split_hot_keys){
+        find_hot_groups(tc, num_of_pairs);
+    }
+    add_progress(tc, bucket_size);
+    tc->stats.phases[SHUFFLE_PHASE].items += bucket_size;
+    tc->stats.phases[SHUFFLE_PHASE].bytes += bucket_size * sizeof(IntermediatePair);
+}
+
+
+/**
+ * Marks that the thread finished the reduce stage. The last thread to finish a job that has another job chained to it
+ * starts the map stage of that job (the other threads may have started mapping already).
+ * @param tc - the context of the running thread.
+ * @return true if the thread is the last one to finish the last job of the chain, and should collect the output.
+ */
+bool finish_reduce(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    bool last_job = tc->chain_stage + 1 == (int) job_context->clients.size();
+    if (!last_job){
+        job_context->chained_pairs.fetch_add(tc->output.size());
+    }
+    if (job_context->finished_reducers.fetch_add(1) + 1 != job_context->num_of_threads){
+        return false;
+    }
+    if (last_job){
+        return true;
+    }
+    // Nobody uses the state of the reduce stage until the next job reaches it, which is after this thread mapped.
+    handling_mutex(job_context->Mutex_set_atomic, LOCK);
+    job_context->stage_job_to_do_set_map = false;
+    job_context->stage_job_to_do_set_shuffle = false;
+    job_context->stage_job_to_do_set_reduce = false;
+    handling_mutex(job_context->Mutex_set_atomic, UNLOCK);
+    for (int i = 0; i < job_context->num_of_threads; ++i){
+        job_context->group_cursors[i].next = 0;
+    }
+    job_context->finished_reducers = 0;
+    job_context->merging_threads = job_context->num_of_threads;
+    set_atomic(MAP_STAGE, tc, job_context->chained_pairs.exchange(0));
+    // Sequentially consistent with the check in map_chained_output, so one of them takes the early progress.
+    job_context->chain_stage.store(tc->chain_stage + 1);
+    // The progress counters count the map stage of the next job now, and the counter of tc is written only by this
+    // thread.
+    add_progress(tc, job_context->early_chained_progress.exchange(0));
+    return false;
+}
+
+
+/**
+ * Concatenates the output of all the threads into the output vector, in the order of the groups (which is the key
+ * order, unless the job groups by hash), and releases the shuffled groups. Called once, by the last thread that
+ * finished the reduce stage.
+ * @param job_context - the job context.
+ * @param num_of_groups - the total number of groups.
+ */
+void collect_output(JobContext *job_context, unsigned long num_of_groups){
+    // position[g] will be the index in the output vector of the first pair emitted while reducing group g.
+    vector<unsigned long> position(num_of_groups + 1, 0);
+    for (const auto &tc : job_context->thread_context){
+        for (const auto &group : tc.reduced_groups){
+            position[group.first + 1] = group.second;
+        }
+    }
+    position[0] = job_context->outputVec->size();
+    for (unsigned long i = 1; i <= num_of_groups; ++i){
+        position[i] += position[i - 1];
+    }
+    job_context->outputVec->resize(position[num_of_groups]);
+    for (auto &tc : job_context->thread_context){
+        auto output = tc.output.begin();
+        for (const auto &group : tc.reduced_groups){
+            std::copy(output, output + group.second, job_context->outputVec->begin() + position[group.first]);
+            output += group.second;
+        }
+        OutputVec().swap(tc.output);
+        tc.reduced_groups.clear();
+        IntermediateVec().swap(tc.group_buffer);
+        IntermediateVec().swap(tc.shuffled);
+        vector<GroupSlice>().swap(tc.groups);
+        tc.hot_groups.clear();
+    }
+}
+
+
+/**
+ * Passes a group to the client's reduce.
+ * @param tc - the context of the running thread.
+ * @param merger - the context of the thread that merged the group.
+ * @param group - the group.
+ * @param index - the index of the group over the groups of all the threads.
+ */
+void reduce_group(ThreadContext *tc, const ThreadContext &merger, const GroupSlice &group, unsigned long index){
+    // The client gets an IntermediateVec, so the slice is copied into a buffer that keeps its capacity.
+    tc->group_buffer.assign(merger.shuffled.begin() + group.begin, merger.shuffled.begin() + group.begin + group.size);
+    unsigned long output_size = tc->output.size();
+    tc->client->reduce(&tc->group_buffer, tc);
+    tc->reduced_groups.emplace_back(index, tc->output.size() - output_size);
+    add_progress(tc, group.size);
+    tc->stats.phases[REDUCE_PHASE].items += group.size;
+    tc->stats.largest_group = max(tc->stats.largest_group, group.size);
+}
+
+
+/**
+ * Combines the part of a hot group that is in the range of the thread. The thread that combines the last part passes
+ * the combined pairs of all the parts to the client's reduce.
+ * @param tc - the context of the running thread.
+ * @param merger - the context of the thread that merged the group.
+ * @param local_index - the index of the group in the groups of the merger.
+ * @param index - the index of the group over the groups of all the threads.
+ * @param begin - the index (in the shuffled pairs of the merger) of the first pair of the part.
+ * @param end - the index after the last pair of the part.
+ */
+void reduce_hot_group_part(ThreadContext *tc, ThreadContext &merger, unsigned long local_index, unsigned long index,
+                           unsigned long begin, unsigned long end){
+    auto hot = std::lower_bound(merger.hot_groups.begin(), merger.hot_groups.end(), local_index,
+                                [](const HotGroup &a, unsigned long group){ return a.group < group; });
+    tc->group_buffer.assign(merger.shuffled.begin() + begin, merger.shuffled.begin() + end);
+    tc->combiner->combine(&tc->group_buffer, &hot->combined[tc->id]);
+    add_progress(tc, end - begin);
+    tc->stats.phases[REDUCE_PHASE].items += end - begin;
+    tc->stats.largest_group = max(tc->stats.largest_group, merger.groups[local_index].size);
+    if (hot->pairs_left.fetch_sub(end - begin) != end - begin){
+        return;
+    }
+    tc->group_buffer.clear();
+    for (auto &part : hot->combined){
+        tc->group_buffer.insert(tc->group_buffer.end(), part.begin(), part.end());
+        IntermediateVec().swap(part);
+    }
+    unsigned long output_size = tc->output.size();
+    tc->client->reduce(&tc->group_buffer, tc);
+    tc->reduced_groups.emplace_back(index, tc->output.size() - output_size);
+}
+
+
+/**
+ * Reduces the groups in the range of the thread, when the job is balanced: reducing thread r gets the pairs in
+ * [r * num_of_pairs / num_of_threads, (r + 1) * num_of_pairs / num_of_threads) of the shuffled pairs of all the threads
+ * (in order). A group belongs to the range of its first pair, unless it is a hot group, which is split on the range
+ * borders.
+ * @param tc - the context of the running thread.
+ * @param first_group - the global index of the first group of every thread.
+ * @param first_pair - the global index of the first shuffled pair of every thread.
+ * @param num_of_pairs - the number of pairs in the job.
+ */
+void reduce_range(ThreadContext *tc, const vector<unsigned long> &first_group, const vector<unsigned long> &first_pair,
+                  unsigned long num_of_pairs){
+    JobContext *job_context = tc->job;
+    unsigned long range_begin = num_of_pairs * tc->id / job_context->num_of_threads;
+    unsigned long range_end = num_of_pairs * (tc->id + 1) / job_context->num_of_threads;
+    if (range_begin == range_end){
+        return;
+    }
+    unsigned long threshold = hot_group_threshold(job_context, num_of_pairs);
+    // Start from the group that contains the first pair of the range.
+    long owner = std::upper_bound(first_pair.begin(), first_pair.end(), range_begin) - first_pair.begin() - 1;
+    while (job_context->thread_context[owner].groups.empty()){
+        owner++;
+    }
+    const vector<GroupSlice> *groups = &job_context->thread_context[owner].groups;
+    unsigned long local = std::upper_bound(groups->begin(), groups->end(), range_begin - first_pair[owner],
+                                           [](unsigned long position, const GroupSlice &group){
+                                               return position < group.begin;
+                                           }) - groups->begin() - 1;
+    while (true){
+        ThreadContext &merger = job_context->thread_context[owner];
+        const GroupSlice &group = merger.groups[local];
+        unsigned long group_begin = first_pair[owner] + group.begin;
+        if (group_begin >= range_end){
+            break;
+        }
+        if (job_context->split_hot_keys && group.size > threshold){
+            unsigned long part_begin = max(group_begin, range_begin) - first_pair[owner];
+            unsigned long part_end = min(group_begin + group.size, range_end) - first_pair[owner];
+            reduce_hot_group_part(tc, merger, local, first_group[owner] + local, part_begin, part_end);
+        } else if (group_begin >= range_begin){
+            reduce_group(tc, merger, group, first_group[owner] + local);
+        }
+        // Move to the next group, which may be in the next thread that has groups.
+        if (++local == merger.groups.size()){
+            local = 0;
+            do {
+                owner++;
+            } while (owner < job_context->num_of_threads && job_context->thread_context[owner].groups.empty());
+            if (owner == job_context->num_of_threads){
+                break;
+            }
+        }
+    }
+}
+
+
+/**
+ * The reduce phase - the threads take groups one at a time with lock-free cursors over the groups of every thread,
+ * starting from their own (or reduce their own range, if the job is balanced), and emit into their own output vectors.
+ * @param tc - the context of the running thread.
+ */
+void reduce_phase(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    // Nobody reads the sorted map output after the shuffle stage.
+    IntermediateVec().swap(tc->intermediate_vec);
+    vector<size_t>().swap(tc->hashes);
+    // first_group[i] / first_pair[i] are the global indices of the first group / shuffled pair of thread i.
+    vector<unsigned long> first_group;
+    vector<unsigned long> first_pair;
+    unsigned long num_of_groups = 0;
+    unsigned long num_of_pairs = 0;
+    for (const auto &it : job_context->thread_context){
+        first_group.push_back(num_of_groups);
+        first_pair.push_back(num_of_pairs);
+        num_of_groups += it.groups.size();
+        num_of_pairs += it.shuffled.size();
+    }
+    set_atomic(REDUCE_STAGE, tc, num_of_pairs);
+    tc->output.clear();
+    tc->reduced_groups.clear();
+    tc->group_buffer.clear();
+    if (job_context->balanced_reduce){
+        reduce_range(tc, first_group, first_pair, num_of_pairs);
+    } else {
+        // The groups of the threads on the same node are read from local memory, so they are taken first.
+        for (int owner : tc->reduce_order){
+            const ThreadContext &merger = job_context->thread_context[owner];
+            while (true){
+                unsigned long local = job_context->group_cursors[owner].next.fetch_add(1);
+                if (local >= merger.groups.size()){
+                    break;
+                }
+                reduce_group(tc, merger, merger.groups[local], first_group[owner] + local);
+            }
+        }
+    }
+    if (finish_reduce(tc)){
+        collect_output(job_context, num_of_groups);
+    }
+}
+
+
+/**
+ * Passes a group from the pipeline to the client's reduce.
+ * @param tc - the context of the running thread.
+ * @param group - the group.
+ */
+void reduce_pipeline_group(ThreadContext *tc, const PipelineGroup &group){
+    // The group index is local to the owner until all the threads finished merging.
+    reduce_group(tc, tc->job->thread_context[group.owner], group.slice, group.index);
+    tc->reduced_owners.push_back(group.owner);
+}
+
+
+/**
+ * Closes a group in the merge of a pipelined job, and hands it to the reducing threads. When the queue is full the
+ * thread reduces groups itself until there is room, so the merge never runs too far ahead of the reduce.
+ * @param group_begin - the index of the first pair of the group in the shuffled pairs.
+ * @param tc - the context of the running thread.
+ */
+void publish_group(unsigned long group_begin, ThreadContext *tc){
+    GroupSlice slice = {group_begin, tc->shuffled.size() - group_begin};
+    PipelineGroup group = {tc->id, tc->groups.size(), slice};
+    tc->groups.push_back(slice);
+    PipelineGroup waiting;
+    while (!tc->job->group_queue->push(group)){
+        if (tc->job->group_queue->pop(waiting)){
+            reduce_pipeline_group(tc, waiting);
+        }
+    }
+}
+
+
+/**
+ * The shuffle phase of a pipelined job - every thread only chooses its key range like in shuffle_phase. The merge
+ * itself runs in the reduce stage.
+ * @param tc - the context of the running thread.
+ */
+void prepare_pipeline(ThreadContext *tc){
+    set_atomic(SHUFFLE_STAGE, tc, tc->job->num_of_threads);
+    find_range(tc);
+    add_progress(tc, 1);
+}
+
+
+/**
+ * The reduce phase of a pipelined job - every thread merges its key range, passing every complete group through a
+ * bounded queue to all the reducing threads, and then reduces groups from the queue until all the threads finished
+ * merging and the queue is empty. Reducing starts as soon as the first group is merged, instead of after the whole
+ * shuffle.
+ * @param tc - the context of the running thread.
+ */
+void pipeline_phase(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    unsigned long num_of_pairs = 0;
+    for (const auto &it : job_context->thread_context){
+        num_of_pairs += it.intermediate_vec.size();
+    }
+    set_atomic(REDUCE_STAGE, tc, num_of_pairs);
+    tc->output.clear();
+    tc->reduced_groups.clear();
+    tc->reduced_owners.clear();
+    tc->group_buffer.clear();
+    merge_range(tc, publish_group);
+    job_context->merging_threads.fetch_sub(1);
+    PipelineGroup group;
+    while (true){
+        if (job_context->group_queue->pop(group)){
+            reduce_pipeline_group(tc, group);
+        } else if (job_context->merging_threads.load() == 0){
+            // Every push finished before the last thread stopped merging, so an empty queue stays empty.
+            if (!job_context->group_queue->pop(group)){
+                break;
+            }
+            reduce_pipeline_group(tc, group);
+        } else {
+            sched_yield();
+        }
+    }
+    if (finish_reduce(tc)){
+        // Number the groups like reduce_phase does - by the thread that merged them, and then by their index there.
+        vector<unsigned long> first_group;
+        unsigned long num_of_groups = 0;
+        for (auto &it : job_context->thread_context){
+            first_group.push_back(num_of_groups);
+            num_of_groups += it.groups.size();
+            IntermediateVec().swap(it.intermediate_vec);
+        }
+        for (auto &it : job_context->thread_context){
+            for (unsigned long i = 0; i < it.reduced_groups.size(); ++i){
+                it.reduced_groups[i].first += first_group[it.reduced_owners[i]];
+            }
+            vector<int>().swap(it.reduced_owners);
+        }
+        collect_output(job_context, num_of_groups);
+    }
+}
+
+
+/**
+ * Makes sure that the buffer of a reader has at least 'needed' bytes that weren't decoded yet.
+ * @param reader - the reader.
+ * @param needed - the number of bytes.
+ */
+void fill_reader(SpillReader &reader, unsigned long needed){
+    if (reader.end - reader.begin >= needed){
+        return;
+    }
+    unsigned long left = reader.end - reader.begin;
+    memmove(reader.buffer.data(), reader.buffer.data() + reader.begin, left);
+    reader.begin = 0;
+    reader.end = left;
+    if (reader.buffer.size() < needed){
+        reader.buffer.resize(needed);
+    }
+    while (reader.end < needed){
+        ssize_t bytes = pread(fileno(reader.run->file), reader.buffer.data() + reader.end,
+                              reader.buffer.size() - reader.end, (off_t) reader.offset);
+        if (bytes <= 0){
+            error_handler(SPILL_READ_ERROR);
+        }
+        reader.end += bytes;
+        reader.offset += bytes;
+        reader.bytes_read += bytes;
+    }
+}
+
+
+/**
+ * Decodes the next pair of a spilled run.
+ * @param reader - the reader of the run.
+ * @param codec - the codec of the job.
+ * @param next - will store the new pair.
+ * @return true if there was a pair to decode, false if the reader is at the end of the run.
+ */
+bool read_spilled_pair(SpillReader &reader, const KeyValueCodec *codec, IntermediatePair &next){
+    if (reader.remaining == 0){
+        return false;
+    }
+    uint32_t length;
+    fill_reader(reader, sizeof(length));
+    memcpy(&length, reader.buffer.data() + reader.begin, sizeof(length));
+    reader.begin += sizeof(length);
+    fill_reader(reader, length);
+    next = codec->decode(reader.buffer.data() + reader.begin, length);
+    reader.begin += length;
+    reader.remaining--;
+    return true;
+}
+
+
+/**
+ * Moves a cursor to the next pair of its run, if it is in the key range of the thread.
+ * @param tc - the context of the running thread.
+ * @param cursor - the cursor.
+ * @return true if the cursor has a new head, false if the range of the run is over.
+ */
+bool advance_cursor(ThreadContext *tc, StreamCursor &cursor){
+    if (cursor.reader == nullptr){
+        if (cursor.memory.current == cursor.memory.end){
+            return false;
+        }
+        cursor.head = *cursor.memory.current++;
+        return true;
+    }
+    const KeyValueCodec *codec = tc->job->codec;
+    if (!read_spilled_pair(*cursor.reader, codec, cursor.head)){
+        return false;
+    }
+    if (tc->range_end.first != nullptr && !(*cursor.head.first < *tc->range_end.first)){
+        // The pair belongs to the next thread, which decodes its own copy.
+        codec->dispose(cursor.head);
+        cursor.reader->remaining = 0;
+        vector<char>().swap(cursor.reader->buffer);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Adds the bytes the readers of the thread read from the spill files to the statistics of a phase.
+ * @param tc - the context of the running thread.
+ * @param phase - the phase.
+ */
+void count_bytes_read(ThreadContext *tc, JobPhase phase){
+    for (auto &reader : tc->readers){
+        tc->stats.phases[phase].bytes += reader.bytes_read;
+        reader.bytes_read = 0;
+    }
+}
+
+
+/**
+ * The shuffle phase of a job that spilled - every thread chooses its key range like in shuffle_phase, and places a
+ * cursor at the beginning of the range in every run (in memory or on disk). The merge itself runs in the reduce stage.
+ * @param tc - the context of the running thread.
+ */
+void prepare_merge(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    const KeyValueCodec *codec = job_context->codec;
+    set_atomic(SHUFFLE_STAGE, tc, job_context->num_of_threads);
+    IntermediateVec splitters;
+    choose_splitters(job_context, splitters);
+    tc->range_begin = IntermediatePair(nullptr, nullptr);
+    tc->range_end = IntermediatePair(nullptr, nullptr);
+    tc->readers.clear();
+    tc->merge_cursors.clear();
+    if (tc->id > 0 && tc->id - 1 >= (int) splitters.size()){
+        // There are less splitters then threads, so this thread has no keys.
+        add_progress(tc, 1);
+        return;
+    }
+    if (tc->id > 0){
+        tc->range_begin = copy_pair(codec, splitters[tc->id - 1]);
+    }
+    if (tc->id < (int) splitters.size()){
+        tc->range_end = copy_pair(codec, splitters[tc->id]);
+    }
+    unsigned long num_of_runs = 0;
+    for (const auto &it : job_context->thread_context){
+        num_of_runs += it.spilled_runs.size();
+    }
+    // The cursors point into the readers.
+    tc->readers.reserve(num_of_runs);
+    for (const auto &it : job_context->thread_context){
+        const IntermediateVec &sorted = it.intermediate_vec;
+        StreamCursor cursor = {IntermediatePair(), {sorted.begin(), sorted.end()}, nullptr};
+        if (tc->range_begin.first != nullptr){
+            cursor.memory.current = std::lower_bound(sorted.begin(), sorted.end(), tc->range_begin.first,
+                                                     compare_pair_to_key);
+        }
+        if (tc->range_end.first != nullptr){
+            cursor.memory.end = std::lower_bound(cursor.memory.current, sorted.end(), tc->range_end.first,
+                                                 compare_pair_to_key);
+        }
+        if (advance_cursor(tc, cursor)){
+            tc->merge_cursors.push_back(cursor);
+        }
+        for (const auto &run : it.spilled_runs){
+            // Start from the last fence before the range, and skip the pairs up to the range.
+            auto fence = run.fences.begin();
+            if (tc->range_begin.first != nullptr){
+                fence = std::lower_bound(run.fences.begin(), run.fences.end(), tc->range_begin.first,
+                                         [](const SpillFence &a, const K2 *key){ return *a.pair.first < *key; });
+                if (fence != run.fences.begin()){
+                    --fence;
+                }
+            }
+            tc->readers.push_back({&run, fence->offset, run.size - fence->index, vector<char>(SPILL_READ_BUFFER),
+                                   0, 0, 0});
+            StreamCursor disk_cursor = {IntermediatePair(), MergeCursor(), &tc->readers.back()};
+            bool has_head = advance_cursor(tc, disk_cursor);
+            while (has_head && tc->range_begin.first != nullptr && *disk_cursor.head.first < *tc->range_begin.first){
+                codec->dispose(disk_cursor.head);
+                has_head = advance_cursor(tc, disk_cursor);
+            }
+            if (has_head){
+                tc->merge_cursors.push_back(disk_cursor);
+            }
+        }
+    }
+    count_bytes_read(tc, SHUFFLE_PHASE);
+    add_progress(tc, 1);
+}
+
+
+/**
+ * Passes the group in the group buffer of the thread to the client's reduce.
+ * @param tc - the context of the running thread.
+ */
+void reduce_group_buffer(ThreadContext *tc){
+    unsigned long output_size = tc->output.size();
+    tc->client->reduce(&tc->group_buffer, tc);
+    tc->reduced_groups.emplace_back(tc->reduced_groups.size(), tc->output.size() - output_size);
+    add_progress(tc, tc->group_buffer.size());
+    tc->stats.phases[REDUCE_PHASE].items += tc->group_buffer.size();
+    tc->stats.largest_group = max(tc->stats.largest_group, (unsigned long) tc->group_buffer.size());
+    tc->group_buffer.clear();
+}
+
+
+/**
+ * Closes the spill file of a thread and disposes the pairs the framework kept for it, and releases the in-memory run of
+ * the thread. Called after all the threads finished the reduce stage.
+ * @param job_context - the job context.
+ * @param tc - the context of the thread.
+ */
+void release_thread_runs(JobContext *job_context, ThreadContext &tc){
+    for (auto &run : tc.spilled_runs){
+        for (const auto &fence : run.fences){
+            job_context->codec->dispose(fence.pair);
+        }
+    }
+    tc.spilled_runs.clear();
+    if (tc.spill_file != nullptr){
+        fclose(tc.spill_file);
+        tc.spill_file = nullptr;
+    }
+    tc.spill_file_size = 0;
+    if (tc.range_begin.first != nullptr){
+        job_context->codec->dispose(tc.range_begin);
+        tc.range_begin = IntermediatePair(nullptr, nullptr);
+    }
+    if (tc.range_end.first != nullptr){
+        job_context->codec->dispose(tc.range_end);
+        tc.range_end = IntermediatePair(nullptr, nullptr);
+    }
+    IntermediateVec().swap(tc.intermediate_vec);
+}
+
+
+/**
+ * Releases the spilled and in-memory runs of all the threads. Called once, after all the threads finished the reduce
+ * stage.
+ * @param job_context - the job context.
+ */
+void release_spilled_runs(JobContext *job_context){
+    for (auto &tc : job_context->thread_context){
+        release_thread_runs(job_context, tc);
+    }
+}
+
+
+/**
+ * The reduce phase of a job that spilled - every thread merges its key range from all the runs, streaming the pairs
+ * from the disk, and reduces every group as soon as it is complete, so the shuffled pairs never have to fit in memory.
+ * @param tc - the context of the running thread.
+ */
+void merge_reduce_phase(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    unsigned long num_of_pairs = 0;
+    for (const auto &it : job_context->thread_context){
+        num_of_pairs += it.intermediate_vec.size();
+        for (const auto &run : it.spilled_runs){
+            num_of_pairs += run.size;
+        }
+    }
+    set_atomic(REDUCE_STAGE, tc, num_of_pairs);
+    priority_queue<StreamCursor, vector<StreamCursor>, stream_cursors_k2_grater> cursors(
+            stream_cursors_k2_grater(), std::move(tc->merge_cursors));
+    tc->output.clear();
+    tc->reduced_groups.clear();
+    tc->group_buffer.clear();
+    while (!cursors.empty()){
+        StreamCursor cursor = cursors.top();
+        cursors.pop();
+        if (!tc->group_buffer.empty() && *tc->group_buffer.back().first < *cursor.head.first){
+            reduce_group_buffer(tc);
+        }
+        tc->group_buffer.push_back(cursor.head);
+        if (advance_cursor(tc, cursor)){
+            cursors.push(cursor);
+        }
+    }
+    if (!tc->group_buffer.empty()){
+        reduce_group_buffer(tc);
+    }
+    count_bytes_read(tc, REDUCE_PHASE);
+    vector<SpillReader>().swap(tc->readers);
+    if (finish_reduce(tc)){
+        // The threads reduced consecutive key ranges, so the groups are numbered in the order of the threads.
+        unsigned long num_of_groups = 0;
+        for (auto &it : job_context->thread_context){
+            for (auto &group : it.reduced_groups){
+                group.first += num_of_groups;
+            }
+            num_of_groups += it.reduced_groups.size();
+        }
+        collect_output(job_context, num_of_groups);
+        release_spilled_runs(job_context);
+    }
+}
+
+
+/**
+ * Adds the time since the beginning of a phase to the statistics of the thread.
+ * @param tc - the context of the running thread.
+ * @param phase - the phase that ended.
+ * @param start - the time the phase began.
+ * @return the time the phase ended.
+ */
+std::chrono::steady_clock::time_point end_phase(ThreadContext *tc, JobPhase phase,
+                                                std::chrono::steady_clock::time_point start){
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    tc->stats.phases[phase].seconds += std::chrono::duration<double>(now - start).count();
+    return now;
+}
+
+
+/**
+ * Waits on a barrier, and adds the time to the statistics of the phase the barrier ends.
+ * @param tc - the context of the running thread.
+ * @param barrier - the barrier.
+ * @param phase - the phase the barrier ends.
+ * @return the time the wait ended.
+ */
+std::chrono::steady_clock::time_point wait_on_barrier(ThreadContext *tc, Barrier *barrier, JobPhase phase){
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    barrier->barrier();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    tc->stats.phases[phase].barrier_wait += std::chrono::duration<double>(now - start).count();
+    return now;
+}
+
+
+/**
+ * Waits until the map stage of the next job in the chain started, which means that all the threads finished reducing
+ * the current job.
+ * @param tc - the context of the running thread.
+ */
+void wait_for_next_job(ThreadContext *tc){
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (tc->job->chain_stage.load(std::memory_order_acquire) == tc->chain_stage){
+        sched_yield();
+    }
+    tc->stats.phases[REDUCE_PHASE].barrier_wait += seconds_since(start);
+}
+
+
+/**
+ * Runs a job (or one job of a chain) on the running thread.
+ * @param tc - the context of the running thread.
+ */
+void run_job(ThreadContext *tc){
+    bool last_job = tc->chain_stage + 1 == (int) tc->job->clients.size();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    running_map_phase(tc);
+    start = end_phase(tc, MAP_PHASE, start);
+    if (tc->job->hasher){
+        partition_phase(tc);
+    } else {
+        sort_phase(tc);
+    }
+    end_phase(tc, SORT_PHASE, start);
+    start = wait_on_barrier(tc, tc->job->barrier, SORT_PHASE);
+    if (tc->job->hasher){
+        hash_shuffle_phase(tc);
+        end_phase(tc, SHUFFLE_PHASE, start);
+        start = wait_on_barrier(tc, tc->job->barrier_reduce, SHUFFLE_PHASE);
+        reduce_phase(tc);
+    } else if (tc->job->spilled){
+        prepare_merge(tc);
+        end_phase(tc, SHUFFLE_PHASE, start);
+        start = wait_on_barrier(tc, tc->job->barrier_reduce, SHUFFLE_PHASE);
+        merge_reduce_phase(tc);
+        if (!last_job){
+            // The other threads merge from the runs of this thread until they all finished reducing.
+            wait_for_next_job(tc);
+            release_thread_runs(tc->job, *tc);
+        }
+    } else if (tc->job->pipeline){
+        prepare_pipeline(tc);
+        end_phase(tc, SHUFFLE_PHASE, start);
+        start = wait_on_barrier(tc, tc->job->barrier_reduce, SHUFFLE_PHASE);
+        pipeline_phase(tc);
+        if (!last_job){
+            wait_for_next_job(tc);
+            IntermediateVec().swap(tc->intermediate_vec);
+        }
+    } else {
+        shuffle_phase(tc);
+        end_phase(tc, SHUFFLE_PHASE, start);
+        start = wait_on_barrier(tc, tc->job->barrier_reduce, SHUFFLE_PHASE);
+        reduce_phase(tc);
+    }
+    end_phase(tc, REDUCE_PHASE, start);
+}
+
+
+/**
+ * The messages between the coordinator of a distributed job and its worker processes. Every message is its type (one
+ * byte), the size of its payload (8 bytes) and the payload. Pairs are sent as records: the size of the record (4 bytes)
+ * and the bytes the codec wrote.
+ */
+enum WireMessage : char {
+    WIRE_MAP_PROGRESS = 0, // Worker to coordinator: the number of input elements it mapped since the last report.
+    WIRE_SAMPLES = 1, // Worker to coordinator: the number of pairs it emitted (8 bytes), and a sample of them.
+    WIRE_SPLITTERS = 2, // Coordinator to workers: the keys between the key ranges of the workers.
+    WIRE_PAIRS = 3, // Worker to worker: the pairs of the sender in the range of the receiver, sorted.
+    WIRE_SHUFFLED = 4, // Worker to coordinator: the number of pairs in its range.
+    WIRE_REDUCE_PROGRESS = 5, // Worker to coordinator: the number of pairs it reduced since the last report.
+    WIRE_OUTPUT = 6 // Worker to coordinator: its output.
+};
+
+
+/**
+ * Writes a whole buffer to a socket.
+ * @param fd - the socket.
+ * @param data - the buffer.
+ * @param size - the size of the buffer.
+ * @return false if the socket failed (e.g. the other side exited).
+ */
+bool send_all(int fd, const char *data, size_t size){
+    while (size > 0){
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR){
+            continue;
+        }
+        if (sent < 0){
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+
+/**
+ * Reads a whole buffer from a socket.
+ * @param fd - the socket.
+ * @param data - the buffer.
+ * @param size - the number of bytes to read.
+ * @return false if the socket failed or was closed before the buffer was full.
+ */
+bool receive_all(int fd, char *data, size_t size){
+    while (size > 0){
+        ssize_t received = recv(fd, data, size, 0);
+        if (received < 0 && errno == EINTR){
+            continue;
+        }
+        if (received <= 0){
+            return false;
+        }
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+
+/**
+ * Appends the header of a message to out. The payload is appended after it, and end_message sets its size.
+ * @param out - the buffer of the message.
+ * @param type - the type of the message.
+ * @return the position of the header in out.
+ */
+size_t begin_message(string &out, WireMessage type){
+    size_t header = out.size();
+    out.push_back(type);
+    out.append(sizeof(uint64_t), '\0');
+    return header;
+}
+
+
+/**
+ * Sets the size of the payload of a message, which ends at the end of out.
+ * @param out - the buffer of the message.
+ * @param header - the position of the header in out.
+ */
+void end_message(string &out, size_t header){
+    uint64_t size = out.size() - header - WIRE_HEADER_SIZE;
+    memcpy(&out[header + 1], &size, sizeof(size));
+}
+
+
+/**
+ * Sends a message with a count as its payload.
+ * @param fd - the socket.
+ * @param type - the type of the message.
+ * @param count - the count.
+ * @return false if the socket failed.
+ */
+bool send_count(int fd, WireMessage type, uint64_t count){
+    string message;
+    size_t header = begin_message(message, type);
+    message.append((const char *) &count, sizeof(count));
+    end_message(message, header);
+    return send_all(fd, message.data(), message.size());
+}
+
+
+/**
+ * Reads a message from a socket.
+ * @param fd - the socket.
+ * @param type - gets the type of the message.
+ * @param payload - gets the payload of the message.
+ * @return false if the socket failed or was closed.
+ */
+bool receive_message(int fd, WireMessage &type, string &payload){
+    char header[WIRE_HEADER_SIZE];
+    if (!receive_all(fd, header, WIRE_HEADER_SIZE)){
+        return false;
+    }
+    uint64_t size;
+    memcpy(&size, header + 1, sizeof(size));
+    type = (WireMessage) header[0];
+    payload.resize(size);
+    return receive_all(fd, &payload[0], size);
+}
+
+
+/**
+ * Reads a count sent with send_count.
+ * @param payload - the payload of the message.
+ * @return the count.
+ */
+uint64_t read_count(const string &payload){
+    uint64_t count = 0;
+    memcpy(&count, payload.data(), min(payload.size(), sizeof(count)));
+    return count;
+}
+
+
+/**
+ * Appends a pair to out as a record.
+ * @param out - the buffer.
+ * @param codec - the codec of the pair (a KeyValueCodec or an OutputCodec).
+ * @param pair - the pair.
+ */
+template<class Codec, class Pair>
+void append_record(string &out, const Codec *codec, const Pair &pair){
+    size_t begin = out.size();
+    out.append(sizeof(uint32_t), '\0');
+    codec->encode(pair, out);
+    uint32_t length = out.size() - begin - sizeof(uint32_t);
+    memcpy(&out[begin], &length, sizeof(length));
+}
+
+
+/**
+ * Decodes the records in a buffer, from a given position to its end.
+ * @param data - the buffer.
+ * @param begin - the position of the first record.
+ * @param codec - the codec of the pairs (a KeyValueCodec or an OutputCodec).
+ * @param pairs - gets the pairs.
+ */
+template<class Codec, class Vec>
+void decode_records(const string &data, size_t begin, const Codec *codec, Vec &pairs){
+    while (begin + sizeof(uint32_t) <= data.size()){
+        uint32_t length;
+        memcpy(&length, data.data() + begin, sizeof(length));
+        begin += sizeof(length);
+        pairs.push_back(codec->decode(data.data() + begin, length));
+        begin += length;
+    }
+}
+
+
+/**
+ * Fails a worker process. The worker has a copy of the stdio buffers of the process it was forked from, so it exits
+ * without flushing them (or running anything else at exit).
+ * @param error - the error massage to be printed.
+ */
+void worker_failed(const string &error){
+    cerr << SYSTEM_ERROR << error << endl;
+    _exit(EXIT_FAILURE);
+}
+
+
+/**
+ * Sends every other worker the pairs of its key range, and receives the pairs of this worker's range from all of them,
+ * on all the sockets at once (a worker that only sent would block when the socket buffers are full, if its peer is
+ * sending too).
+ * @param peers - the socket to every other worker, -1 for this worker.
+ * @param outgoing - the message to every worker.
+ * @param incoming - gets the message of every worker, including its header.
+ */
+void exchange_ranges(const vector<int> &peers, const vector<string> &outgoing, vector<string> &incoming){
+    int num_of_workers = (int) peers.size();
+    vector<size_t> sent(num_of_workers, 0);
+    vector<size_t> expected(num_of_workers, WIRE_HEADER_SIZE);
+    incoming.assign(num_of_workers, string());
+    for (int fd : peers){
+        if (fd >= 0 && fcntl(fd, F_SETFL, O_NONBLOCK) == -1){
+            worker_failed(SOCKET_ERROR);
+        }
+    }
+    vector<pollfd> items;
+    vector<int> owners;
+    vector<char> buffer(SOCKET_BUFFER_SIZE);
+    while (true){
+        items.clear();
+        owners.clear();
+        for (int i = 0; i < num_of_workers; ++i){
+            short events = 0;
+            if (peers[i] >= 0 && sent[i] < outgoing[i].size()){
+                events |= POLLOUT;
+            }
+            if (peers[i] >= 0 && incoming[i].size() < expected[i]){
+                events |= POLLIN;
+            }
+            if (events){
+                items.push_back({peers[i], events, 0});
+                owners.push_back(i);
+            }
+        }
+        if (items.empty()){
+            break;
+        }
+        if (poll(items.data(), items.size(), -1) == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            worker_failed(SOCKET_ERROR);
+        }
+        for (size_t k = 0; k < items.size(); ++k){
+            int i = owners[k];
+            if (items[k].revents & POLLOUT){
+                ssize_t result = send(peers[i], outgoing[i].data() + sent[i], outgoing[i].size() - sent[i],
+                                      MSG_NOSIGNAL);
+                if (result == -1 && errno != EAGAIN && errno != EINTR){
+                    worker_failed(WORKER_PROCESS_ERROR);
+                }
+                sent[i] += max(result, (ssize_t) 0);
+            }
+            if ((items[k].revents & (POLLIN | POLLHUP | POLLERR)) && incoming[i].size() < expected[i]){
+                ssize_t result = recv(peers[i], buffer.data(), min(buffer.size(), expected[i] - incoming[i].size()), 0);
+                if (result == 0 || (result == -1 && errno != EAGAIN && errno != EINTR)){
+                    worker_failed(WORKER_PROCESS_ERROR);
+                }
+                if (result > 0){
+                    incoming[i].append(buffer.data(), result);
+                }
+                // Once the header arrived, the size of the whole message is known.
+                if (result > 0 && incoming[i].size() == WIRE_HEADER_SIZE){
+                    uint64_t size;
+                    memcpy(&size, incoming[i].data() + 1, sizeof(size));
+                    expected[i] += size;
+                    incoming[i].reserve(expected[i]);
+                }
+            }
+        }
+    }
+}
+
+
+/**
+ * The body of a worker process of a distributed job - maps its slice of the input, sorts (and combines) the pairs, sends
+ * a sample of them to the coordinator and gets the splitters, exchanges the key ranges with the other workers, merges
+ * and reduces its range, and sends the output to the coordinator. Never returns.
+ * @param job_context - the job context (the copy of the worker process).
+ * @param worker - the index of the worker.
+ * @param coordinator - the socket to the coordinator.
+ * @param peers - the socket to every other worker, -1 for this worker.
+ */
+void run_worker_process(JobContext *job_context, int worker, int coordinator, const vector<int> &peers){
+    int num_of_workers = job_context->worker_processes;
+    const KeyValueCodec *codec = job_context->exchange_codec;
+    ThreadContext tc(0, job_context);
+    tc.client = job_context->clients[0];
+    tc.combiner = job_context->combiners[0];
+    const InputVec &input = *job_context->inputVec;
+    unsigned long begin = input.size() * worker / num_of_workers;
+    unsigned long end = input.size() * (worker + 1) / num_of_workers;
+    for (unsigned long chunk = begin; chunk < end; chunk += PROGRESS_REPORT_INTERVAL){
+        unsigned long chunk_end = min(chunk + PROGRESS_REPORT_INTERVAL, end);
+        for (unsigned long index = chunk; index < chunk_end; ++index){
+            map_element(&tc, input[index].first, input[index].second);
+        }
+        if (!send_count(coordinator, WIRE_MAP_PROGRESS, chunk_end - chunk)){
+            worker_failed(WORKER_PROCESS_ERROR);
+        }
+    }
+    sort_phase(&tc);
+    string message;
+    size_t header = begin_message(message, WIRE_SAMPLES);
+    uint64_t num_of_pairs = tc.intermediate_vec.size();
+    message.append((const char *) &num_of_pairs, sizeof(num_of_pairs));
+    for (const auto &sample : tc.samples){
+        append_record(message, codec, sample);
+    }
+    end_message(message, header);
+    WireMessage type;
+    if (!send_all(coordinator, message.data(), message.size()) || !receive_message(coordinator, type, message) ||
+        type != WIRE_SPLITTERS){
+        worker_failed(WORKER_PROCESS_ERROR);
+    }
+    IntermediateVec splitters;
+    decode_records(message, 0, codec, splitters);
+    // Worker i gets the keys in [splitters[i - 1], splitters[i]), like the shuffle of a job in threads.
+    const IntermediateVec &sorted = tc.intermediate_vec;
+    vector<IntermediateVec::const_iterator> bounds(num_of_workers + 1, sorted.end());
+    bounds[0] = sorted.begin();
+    for (int i = 1; i < num_of_workers && i - 1 < (int) splitters.size(); ++i){
+        bounds[i] = std::lower_bound(bounds[i - 1], sorted.end(), splitters[i - 1].first, compare_pair_to_key);
+    }
+    for (const auto &splitter : splitters){
+        codec->dispose(splitter);
+    }
+    vector<string> outgoing(num_of_workers);
+    for (int i = 0; i < num_of_workers; ++i){
+        if (i == worker){
+            continue;
+        }
+        header = begin_message(outgoing[i], WIRE_PAIRS);
+        for (auto it = bounds[i]; it != bounds[i + 1]; ++it){
+            append_record(outgoing[i], codec, *it);
+            codec->dispose(*it);
+        }
+        end_message(outgoing[i], header);
+    }
+    vector<string> incoming;
+    exchange_ranges(peers, outgoing, incoming);
+    vector<string>().swap(outgoing);
+    vector<IntermediateVec> runs(num_of_workers);
+    unsigned long range_size = bounds[worker + 1] - bounds[worker];
+    tc.range_cursors.clear();
+    for (int i = 0; i < num_of_workers; ++i){
+        MergeCursor cursor = {bounds[worker], bounds[worker + 1]};
+        if (i != worker){
+            decode_records(incoming[i], WIRE_HEADER_SIZE, codec, runs[i]);
+            string().swap(incoming[i]);
+            range_size += runs[i].size();
+            cursor = {runs[i].begin(), runs[i].end()};
+        }
+        if (cursor.current != cursor.end){
+            tc.range_cursors.push_back(cursor);
+        }
+    }
+    tc.shuffled.reserve(range_size);
+    merge_range(&tc, save_group);
+    vector<IntermediateVec>().swap(runs);
+    if (!send_count(coordinator, WIRE_SHUFFLED, range_size)){
+        worker_failed(WORKER_PROCESS_ERROR);
+    }
+    unsigned long unreported = 0;
+    for (unsigned long i = 0; i < tc.groups.size(); ++i){
+        reduce_group(&tc, tc, tc.groups[i], i);
+        unreported += tc.groups[i].size;
+        if (unreported >= PROGRESS_REPORT_INTERVAL || i + 1 == tc.groups.size()){
+            if (!send_count(coordinator, WIRE_REDUCE_PROGRESS, unreported)){
+                worker_failed(WORKER_PROCESS_ERROR);
+            }
+            unreported = 0;
+        }
+    }
+    message.clear();
+    header = begin_message(message, WIRE_OUTPUT);
+    for (const auto &output : tc.output){
+        append_record(message, job_context->output_codec, output);
+    }
+    end_message(message, header);
+    if (!send_all(coordinator, message.data(), message.size())){
+        worker_failed(WORKER_PROCESS_ERROR);
+    }
+    // Only what the client printed in this process is in the stdio buffers (they were flushed before the fork).
+    fflush(nullptr);
+    _exit(EXIT_SUCCESS);
+}
+
+
+/**
+ * The state of the coordinator of a distributed job.
+ */
+struct Coordinator {
+    vector<int> sockets; // The socket to every worker.
+    vector<IntermediateVec> samples; // The samples every worker sent.
+    vector<double> sample_weights; // The number of pairs every sample of a worker represents.
+    vector<OutputVec> outputs; // The output of every worker.
+    vector<bool> finished; // True for the workers that sent their output.
+    int num_of_sampled = 0; // The number of workers that sent their samples.
+    int num_of_shuffled = 0; // The number of workers that have their key range.
+    int num_of_finished = 0; // The number of workers that sent their output.
+    unsigned long long num_of_pairs = 0; // The number of intermediate pairs in the job.
+    unsigned long long early_progress = 0; // Pairs reduced by workers before the reduce stage began.
+    std::chrono::steady_clock::time_point phase_start; // The time the current phase began.
+};
+
+
+/**
+ * Chooses the splitters from the samples of all the workers, and sends them to the workers. The shuffle stage begins.
+ * @param tc - the context of the coordinating thread.
+ * @param coordinator - the state of the coordinator.
+ */
+void send_splitters(ThreadContext *tc, Coordinator &coordinator){
+    JobContext *job_context = tc->job;
+    coordinator.phase_start = end_phase(tc, MAP_PHASE, coordinator.phase_start);
+    set_atomic(SHUFFLE_STAGE, tc, coordinator.num_of_pairs);
+    vector<pair<IntermediatePair, double>> weighted_samples;
+    double total_weight = 0;
+    for (int i = 0; i < job_context->worker_processes; ++i){
+        for (const auto &sample : coordinator.samples[i]){
+            weighted_samples.emplace_back(sample, coordinator.sample_weights[i]);
+        }
+        total_weight += coordinator.sample_weights[i] * (double) coordinator.samples[i].size();
+    }
+    IntermediateVec splitters;
+    choose_weighted_splitters(weighted_samples, total_weight, job_context->worker_processes, splitters);
+    string message;
+    size_t header = begin_message(message, WIRE_SPLITTERS);
+    for (const auto &splitter : splitters){
+        append_record(message, job_context->exchange_codec, splitter);
+    }
+    end_message(message, header);
+    for (int fd : coordinator.sockets){
+        if (!send_all(fd, message.data(), message.size())){
+            error_handler(WORKER_PROCESS_ERROR);
+        }
+    }
+    for (auto &samples : coordinator.samples){
+        for (const auto &sample : samples){
+            job_context->exchange_codec->dispose(sample);
+        }
+        IntermediateVec().swap(samples);
+    }
+}
+
+
+/**
+ * Handles a message of a worker.
+ * @param tc - the context of the coordinating thread.
+ * @param coordinator - the state of the coordinator.
+ * @param worker - the worker that sent the message.
+ * @param type - the type of the message.
+ * @param payload - the payload of the message.
+ */
+void handle_worker_message(ThreadContext *tc, Coordinator &coordinator, int worker, WireMessage type,
+                           const string &payload){
+    JobContext *job_context = tc->job;
+    switch (type){
+        case WIRE_MAP_PROGRESS:
+            add_progress(tc, read_count(payload));
+            tc->stats.phases[MAP_PHASE].items += read_count(payload);
+            break;
+        case WIRE_SAMPLES: {
+            uint64_t num_of_pairs = read_count(payload);
+            decode_records(payload, sizeof(uint64_t), job_context->exchange_codec, coordinator.samples[worker]);
+            size_t num_of_samples = coordinator.samples[worker].size();
+            coordinator.sample_weights[worker] = num_of_samples ? (double) num_of_pairs / (double) num_of_samples : 0;
+            coordinator.num_of_pairs += num_of_pairs;
+            if (++coordinator.num_of_sampled == job_context->worker_processes){
+                send_splitters(tc, coordinator);
+            }
+            break;
+        }
+        case WIRE_SHUFFLED:
+            add_progress(tc, read_count(payload));
+            tc->stats.phases[SHUFFLE_PHASE].items += read_count(payload);
+            if (++coordinator.num_of_shuffled == job_context->worker_processes){
+                coordinator.phase_start = end_phase(tc, SHUFFLE_PHASE, coordinator.phase_start);
+                set_atomic(REDUCE_STAGE, tc, coordinator.num_of_pairs);
+                add_progress(tc, coordinator.early_progress);
+            }
+            break;
+        case WIRE_REDUCE_PROGRESS:
+            // The other workers may still be exchanging their ranges.
+            if (coordinator.num_of_shuffled == job_context->worker_processes){
+                add_progress(tc, read_count(payload));
+            } else {
+                coordinator.early_progress += read_count(payload);
+            }
+            tc->stats.phases[REDUCE_PHASE].items += read_count(payload);
+            break;
+        case WIRE_OUTPUT:
+            decode_records(payload, 0, job_context->output_codec, coordinator.outputs[worker]);
+            coordinator.finished[worker] = true;
+            coordinator.num_of_finished++;
+            break;
+        default:
+            error_handler(WORKER_PROCESS_ERROR);
+    }
+}
+
+
+/**
+ * Held from the creation of the sockets of a distributed job until the parent closed the ends of its workers, so the
+ * workers of a concurrent distributed job don't inherit them: a worker of this job that dies would leave its sockets
+ * open in them, and this job would wait for it instead of failing.
+ */
+pthread_mutex_t distributed_fork_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Runs a distributed job on the thread of the job: forks the worker processes, connected to this thread and to each
+ * other with unix sockets, follows their progress, chooses the key ranges from their samples, and collects their output
+ * in the order of the ranges.
+ * @param tc - the context of the running thread.
+ */
+void run_distributed_job(ThreadContext *tc){
+    JobContext *job_context = tc->job;
+    int num_of_workers = job_context->worker_processes;
+    Coordinator coordinator;
+    coordinator.phase_start = std::chrono::steady_clock::now();
+    coordinator.samples.resize(num_of_workers);
+    coordinator.sample_weights.resize(num_of_workers, 0);
+    coordinator.outputs.resize(num_of_workers);
+    coordinator.finished.resize(num_of_workers, false);
+    // worker_sockets[i] is the end of the socket to the coordinator of worker i, peers[i][j] is the end of the socket
+    // between workers i and j of worker i.
+    vector<int> worker_sockets(num_of_workers);
+    vector<vector<int>> peers(num_of_workers, vector<int>(num_of_workers, -1));
+    int ends[2];
+    handling_mutex(distributed_fork_mutex, LOCK);
+    for (int i = 0; i < num_of_workers; ++i){
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == -1){
+            error_handler(SOCKET_ERROR);
+        }
+        coordinator.sockets.push_back(ends[0]);
+        worker_sockets[i] = ends[1];
+        for (int j = 0; j < i; ++j){
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == -1){
+                error_handler(SOCKET_ERROR);
+            }
+            peers[i][j] = ends[0];
+            peers[j][i] = ends[1];
+        }
+    }
+    set_atomic(MAP_STAGE, tc, job_context->inputVec->size());
+    // A worker that flushes its stdio buffers shouldn't print what this process buffered before the fork again.
+    fflush(nullptr);
+    vector<pid_t> workers;
+    for (int i = 0; i < num_of_workers; ++i){
+        pid_t pid = fork();
+        if (pid == -1){
+            error_handler(FORK_ERROR);
+        }
+        if (pid == 0){
+            for (int j = 0; j < num_of_workers; ++j){
+                close(coordinator.sockets[j]);
+                if (j != i){
+                    close(worker_sockets[j]);
+                    for (int fd : peers[j]){
+                        if (fd >= 0){
+                            close(fd);
+                        }
+                    }
+                }
+            }
+            run_worker_process(job_context, i, worker_sockets[i], peers[i]);
+        }
+        workers.push_back(pid);
+    }
+    for (int i = 0; i < num_of_workers; ++i){
+        close(worker_sockets[i]);
+        for (int fd : peers[i]){
+            if (fd >= 0){
+                close(fd);
+            }
+        }
+    }
+    handling_mutex(distributed_fork_mutex, UNLOCK);
+    vector<pollfd> items;
+    vector<int> owners;
+    string payload;
+    while (coordinator.num_of_finished < num_of_workers){
+        items.clear();
+        owners.clear();
+        for (int i = 0; i < num_of_workers; ++i){
+            if (!coordinator.finished[i]){
+                items.push_back({coordinator.sockets[i], POLLIN, 0});
+                owners.push_back(i);
+            }
+        }
+        if (poll(items.data(), items.size(), -1) == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            error_handler(SOCKET_ERROR);
+        }
+        for (size_t k = 0; k < items.size(); ++k){
+            if (items[k].revents == 0){
+                continue;
+            }
+            // The workers send whole messages, so a worker that has a part of one is about to send the rest.
+            WireMessage type;
+            if (!receive_message(items[k].fd, type, payload)){
+                error_handler(WORKER_PROCESS_ERROR);
+            }
+            handle_worker_message(tc, coordinator, owners[k], type, payload);
+        }
+    }
+    for (int i = 0; i < num_of_workers; ++i){
+        close(coordinator.sockets[i]);
+        int status;
+        if (waitpid(workers[i], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS){
+            error_handler(WORKER_PROCESS_ERROR);
+        }
+        job_context->outputVec->insert(job_context->outputVec->end(), coordinator.outputs[i].begin(),
+                                       coordinator.outputs[i].end());
+    }
+    end_phase(tc, REDUCE_PHASE, coordinator.phase_start);
+}
+
+
+/**
+ * The function (entry point) that all the threads running the job execute - runs the job, and then the jobs chained to
+ * it, one after the other (or coordinates the worker processes, if the job is distributed).
+ * @param thread_context - the ThreadContext object representing the context of the running thread.
+ */
+void *main_map_reduce_framework(void *thread_context){
+    auto* tc = (ThreadContext*) thread_context;
+    if (tc->job->worker_processes){
+        run_distributed_job(tc);
+        return nullptr;
+    }
+    for (int stage = 0; stage < (int) tc->job->clients.size(); ++stage){
+        tc->chain_stage = stage;
+        tc->client = tc->job->clients[stage];
+        tc->combiner = tc->job->combiners[stage];
+        run_job(tc);
+    }
+    return nullptr;
+}
+
+
+/**
+ * The worker threads that run the jobs, shared by all the jobs of the process. A job is dispatched as a whole (all its
+ * threads at once, since they meet at the barriers) when there are enough free workers, and the jobs are dispatched in
+ * the order they were started. The workers are created on demand and are kept until the process exits.
+ */
+class WorkerPool{
+public:
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the pool.
+    pthread_cond_t work_available = PTHREAD_COND_INITIALIZER; // Signaled when threads of a job are dispatched.
+    deque<JobContext *> waiting_jobs; // The jobs that wait for free workers.
+    deque<ThreadContext *> dispatched; // The threads of dispatched jobs that no worker took yet.
+    int num_of_workers = 0; // The number of worker threads.
+    int free_workers = 0; // The number of workers that aren't reserved for a dispatched job.
+};
+
+
+WorkerPool worker_pool;
+
+
+/**
+ * Dispatches the waiting jobs, in order, while there are enough free workers for the first one. Must be called with
+ * the pool mutex locked.
+ */
+void dispatch_jobs(){
+    while (!worker_pool.waiting_jobs.empty() &&
+           worker_pool.waiting_jobs.front()->num_of_threads <= worker_pool.free_workers){
+        JobContext *job_context = worker_pool.waiting_jobs.front();
+        worker_pool.waiting_jobs.pop_front();
+        worker_pool.free_workers -= job_context->num_of_threads;
+        for (auto &tc : job_context->thread_context){
+            worker_pool.dispatched.push_back(&tc);
+        }
+        handling_cond(worker_pool.work_available, BROADCAST);
+    }
+}
+
+
+/**
+ * Marks that a thread finished its part of the job. The job may be released as soon as this function returns.
+ * @param job_context - the job context.
+ */
+void finish_thread(JobContext *job_context){
+    handling_mutex(job_context->Mutex_finished, LOCK);
+    if (++job_context->finished_threads == job_context->num_of_threads){
+        job_context->seconds = seconds_since(job_context->start_time);
+        handling_cond(job_context->job_finished, BROADCAST);
+    }
+    handling_mutex(job_context->Mutex_finished, UNLOCK);
+}
+
+
+/**
+ * Pins the running worker to a core, or lets it run on the cores it was created with again. The placement only affects
+ * the speed of a job, so a worker that can't be pinned (e.g. the cores of the process changed) runs unpinned.
+ * @param cpu - the core, -1 for the cores the worker was created with.
+ * @param unpinned - the affinity mask the worker was created with.
+ */
+void set_worker_affinity(int cpu, const cpu_set_t &unpinned){
+    cpu_set_t mask = unpinned;
+    if (cpu >= 0){
+        CPU_ZERO(&mask);
+        CPU_SET(cpu, &mask);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+}
+
+
+/**
+ * The entry point of the worker threads - runs dispatched job threads one after the other, pinned to the core of the
+ * job thread if the job is pinned.
+ * @return never returns.
+ */
+void *pool_worker(void *){
+    cpu_set_t unpinned;
+    CPU_ZERO(&unpinned);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(unpinned), &unpinned)){
+        error_handler(AFFINITY_ERROR);
+    }
+    while (true){
+        handling_mutex(worker_pool.mutex, LOCK);
+        while (worker_pool.dispatched.empty()){
+            handling_cond(worker_pool.work_available, WAIT, &worker_pool.mutex);
+        }
+        ThreadContext *tc = worker_pool.dispatched.front();
+        worker_pool.dispatched.pop_front();
+        handling_mutex(worker_pool.mutex, UNLOCK);
+        bool pinned = tc->cpu >= 0;
+        if (pinned){
+            set_worker_affinity(tc->cpu, unpinned);
+        }
+        main_map_reduce_framework(tc);
+        finish_thread(tc->job);
+        if (pinned){
+            set_worker_affinity(-1, unpinned);
+        }
+        handling_mutex(worker_pool.mutex, LOCK);
+        worker_pool.free_workers++;
+        dispatch_jobs();
+        handling_mutex(worker_pool.mutex, UNLOCK);
+    }
+    return nullptr;
+}
+
+
+/**
+ * Adds a job to the pool, creating workers first if the pool has less then max(number of cores, threads of the job).
+ * @param job_context - the job context.
+ */
+void submit_job(JobContext *job_context){
+    handling_mutex(worker_pool.mutex, LOCK);
+    int wanted = max((int) sysconf(_SC_NPROCESSORS_ONLN), job_context->num_of_threads);
+    while (worker_pool.num_of_workers < wanted){
+        pthread_t worker;
+        if (pthread_create(&worker, nullptr, pool_worker, nullptr)) {
+            error_handler(INIT_THREAD_ERROR);
+        }
+        if (pthread_detach(worker)) {
+            error_handler(DETACH_THREAD_ERROR);
+        }
+        worker_pool.num_of_workers++;
+        worker_pool.free_workers++;
+    }
+    worker_pool.waiting_jobs.push_back(job_context);
+    dispatch_jobs();
+    handling_mutex(worker_pool.mutex, UNLOCK);
+}
+
+
+/**
+ * Produces Intermediate pair (K2*, V2*).
+ * @param key It's type K2.
+ * @param value It's type V2.
+ * @param context the tread context.
+ */
+void emit2(K2 *key, V2 *value, void *context){
+    IntermediatePair temp = IntermediatePair(key, value);
+    auto *tc = (IntermediateVec *) context;
+    tc->push_back(temp);
+}
+
+/**
+ * Produces Intermediate pair (K3*, V3*).
+ * @param key It's type K3.
+ * @param value It's type V3.
+ * @param context the tread context.
+ */
+void emit3(K3 *key, V3 *value, void *context)
+{
+    auto *tc = (ThreadContext *) context;
+    tc->output.emplace_back(key, value);
+}
+
+
+/**
+ *In this function we start the MapReduce algorithm.
+ * @param client - the job client.
+ * @param inputVec - the input vector of the algorithm.
+ * @param outputVec - the output vector where we'll keep the results.
+ * @param multiThreadLevel - the number of threads that will preform this job.
+ * @return - a JobHandle object representing the job to preform.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            const InputVec& inputVec, OutputVec& outputVec,
+                            int multiThreadLevel){
+    return startMapReduceJob(client, inputVec, outputVec, multiThreadLevel, JobOptions());
+}
+
+
+/**
+ * Starts the MapReduce algorithm with the given options.
+ * @param client - the job client.
+ * @param inputVec - the input vector of the algorithm.
+ * @param outputVec - the output vector where we'll keep the results.
+ * @param multiThreadLevel - the number of threads that will preform this job.
+ * @param options - the options of the job.
+ * @return - a JobHandle object representing the job to preform.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            const InputVec& inputVec, OutputVec& outputVec,
+                            int multiThreadLevel, const JobOptions& options){
+    auto *job = new JobContext(vector<const MapReduceClient *>(1, &client), &inputVec, nullptr, outputVec,
+                               multiThreadLevel, options);
+    if (job->num_of_threads > 0){
+        submit_job(job);
+    }
+    return job;
+}
+
+
+/**
+ * Starts the MapReduce algorithm on the records of an input source.
+ * @param client - the job client.
+ * @param input - the source of the input.
+ * @param outputVec - the output vector where we'll keep the results.
+ * @param multiThreadLevel - the number of threads that will preform this job.
+ * @param options - the options of the job.
+ * @return - a JobHandle object representing the job to preform.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            InputSource& input, OutputVec& outputVec,
+                            int multiThreadLevel, const JobOptions& options){
+    auto *job = new JobContext(vector<const MapReduceClient *>(1, &client), nullptr, &input, outputVec,
+                               multiThreadLevel, options);
+    if (job->num_of_threads > 0){
+        submit_job(job);
+    }
+    return job;
+}
+
+
+/**
+ * Starts a chain of jobs on the same input.
+ * @param client - the client of the first job.
+ * @param chained - the clients of the jobs that follow it, in order.
+ * @param inputVec - the input vector of the first job.
+ * @param outputVec - the output vector where we'll keep the results of the last job.
+ * @param multiThreadLevel - the number of threads that will preform the jobs.
+ * @param options - the options of all the jobs.
+ * @return - a JobHandle object representing the chain.
+ */
+JobHandle startMapReduceChain(const MapReduceClient& client,
+                              const std::vector<const ChainableMapReduceClient*>& chained,
+                              const InputVec& inputVec, OutputVec& outputVec,
+                              int multiThreadLevel, const JobOptions& options){
+    vector<const MapReduceClient *> clients(1, &client);
+    clients.insert(clients.end(), chained.begin(), chained.end());
+    auto *job = new JobContext(clients, &inputVec, nullptr, outputVec, multiThreadLevel, options);
+    if (job->num_of_threads > 0){
+        submit_job(job);
+    }
+    return job;
+}
+
+
+/**
+ * Cuts the bytes in [begin, end) into records, which end at the delimiters (the last one may end at end).
+ * @param split - the split that gets the records.
+ * @param begin - the first byte.
+ * @param end - the byte after the last one.
+ * @param delimiter - the delimiter of the records.
+ */
+void split_records(InputSplit &split, const char *begin, const char *end, char delimiter){
+    split.records.clear();
+    while (begin < end){
+        auto *record_end = (const char *) memchr(begin, delimiter, end - begin);
+        if (record_end == nullptr){
+            record_end = end;
+        }
+        split.records.emplace_back();
+        split.records.back().data = begin;
+        split.records.back().size = record_end - begin;
+        begin = record_end + 1;
+    }
+}
+
+
+/**
+ * A constructor for the MappedFileSource class.
+ * @param path - the path of the file.
+ * @param delimiter - the delimiter of the records.
+ */
+MappedFileSource::MappedFileSource(const char *path, char delimiter)
+        : data(nullptr), size(0), delimiter(delimiter), next_offset(0){
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat{};
+    if (fd == -1 || fstat(fd, &file_stat) == -1){
+        error_handler(INPUT_FILE_ERROR);
+    }
+    size = file_stat.st_size;
+    if (size > 0){
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED){
+            error_handler(INPUT_FILE_ERROR);
+        }
+        // The threads read their ranges from the beginning to the end.
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data = (const char *) mapping;
+    }
+    // The mapping keeps the file open.
+    close(fd);
+    split_size = min(max(size / FILE_SPLITS_PER_THREAD / max((long) sysconf(_SC_NPROCESSORS_ONLN), 1L),
+                         (size_t) MIN_FILE_SPLIT), (size_t) MAX_FILE_SPLIT);
+}
+
+
+MappedFileSource::~MappedFileSource(){
+    if (data != nullptr){
+        munmap((void *) data, size);
+    }
+}
+
+
+/**
+ * Claims the next range of bytes of the file, and cuts the records that begin in it. The record that crosses the end
+ * of the range is completed from the next range, and the partial record at the beginning belongs to the previous one.
+ * @param split - the split that gets the records.
+ * @return false if the whole file was claimed.
+ */
+bool MappedFileSource::next_split(InputSplit &split){
+    size_t begin = next_offset.fetch_add(split_size);
+    if (begin >= size){
+        return false;
+    }
+    size_t end = min(begin + split_size, size);
+    // A record begins after a delimiter, so look for the delimiters from the byte before each end.
+    const char *first = data;
+    if (begin > 0){
+        first = (const char *) memchr(data + begin - 1, delimiter, size - begin + 1);
+        first = first ? first + 1 : data + size;
+    }
+    const char *last = (const char *) memchr(data + end - 1, delimiter, size - end + 1);
+    last = last ? last + 1 : data + size;
+    split_records(split, first, max(first, last), delimiter);
+    split.weight = end - begin;
+    return true;
+}
+
+
+unsigned long long MappedFileSource::total() const {
+    return size;
+}
+
+
+/**
+ * A constructor for the StreamSource class.
+ * @param file - the stream.
+ * @param delimiter - the delimiter of the records.
+ */
+StreamSource::StreamSource(FILE *file, char delimiter) : file(file), delimiter(delimiter), finished(false){
+    handling_mutex(mutex, INITIALIZE);
+}
+
+
+StreamSource::~StreamSource(){
+    handling_mutex(mutex, DESTROY);
+}
+
+
+/**
+ * Reads the next block of the stream, up to the end of the last record in it (the rest is kept for the next block).
+ * Only the reading is done under the mutex, the records are cut by the thread afterwards.
+ * @param split - the split that gets the block and its records.
+ * @return false if the stream is over.
+ */
+bool StreamSource::next_split(InputSplit &split){
+    handling_mutex(mutex, LOCK);
+    if (finished && carry.empty()){
+        handling_mutex(mutex, UNLOCK);
+        return false;
+    }
+    split.buffer.swap(carry);
+    carry.clear();
+    while (!finished){
+        size_t old_size = split.buffer.size();
+        split.buffer.resize(old_size + STREAM_BLOCK_SIZE);
+        size_t bytes = fread(&split.buffer[old_size], 1, STREAM_BLOCK_SIZE, file);
+        split.buffer.resize(old_size + bytes);
+        if (bytes < STREAM_BLOCK_SIZE){
+            if (ferror(file)){
+                error_handler(INPUT_STREAM_ERROR);
+            }
+            finished = true;
+            break;
+        }
+        // The bytes before the new block are a part of one record, so a delimiter can only be in the new block.
+        size_t last = split.buffer.rfind(delimiter);
+        if (last != string::npos){
+            carry.assign(split.buffer, last + 1, string::npos);
+            split.buffer.resize(last + 1);
+            break;
+        }
+    }
+    handling_mutex(mutex, UNLOCK);
+    split_records(split, split.buffer.data(), split.buffer.data() + split.buffer.size(), delimiter);
+    split.weight = split.buffer.size();
+    return true;
+}
+
+
+unsigned long long StreamSource::total() const {
+    return UNKNOWN_INPUT_SIZE;
+}
+
+
+/**
+ * Waits until all the threads of the job finished their part of it.
+ * @param job - the JobHandle object representing the job that the algorithm is preforming.
+ */
+void waitForJob(JobHandle job){
+    auto *new_job = (JobContext *) job;
+    handling_mutex(new_job->Mutex_finished, LOCK);
+    while (new_job->finished_threads < new_job->num_of_threads) {
+        handling_cond(new_job->job_finished, WAIT, &new_job->Mutex_finished);
+    }
+    handling_mutex(new_job->Mutex_finished, UNLOCK);
+}
+
+
+/**
+ * Sets the jobState object. Doesn't lock anything: reads the stage and its total under the sequence lock (retrying if
+ * the stage changed meanwhile) and sums the counters of the threads.
+ * @param job - the JobHandle object representing the job that the algorithm is preforming.
+ * @param state - the state to load into the stage and percentage.
+ */
+void getJobState(JobHandle job, JobState *state){
+    auto *new_job = (JobContext *) job;
+    unsigned version;
+    int stage;
+    unsigned long long to_do;
+    unsigned long long done;
+    do {
+        version = new_job->progress_version.load(std::memory_order_acquire);
+        stage = new_job->stage.load(std::memory_order_relaxed);
+        to_do = new_job->stage_total.load(std::memory_order_relaxed);
+        done = 0;
+        for (int i = 0; i < new_job->num_of_threads; ++i){
+            done += new_job->progress[i].done.load(std::memory_order_relaxed) -
+                    new_job->progress[i].base.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((version & 1) || version != new_job->progress_version.load(std::memory_order_relaxed));
+    state->stage = stage_t(stage);
+    if (to_do == 0){
+        state->percentage = (stage == UNDEFINED_STAGE) ? 0 : HANDLE_PERCENTAGES;
+    } else {
+        state->percentage = (float) ((double) min(done, to_do) / (double) to_do * HANDLE_PERCENTAGES);
+    }
+}
+
+
+/**
+ * Waits until the job finished, and loads its statistics.
+ * @param job - the JobHandle object representing the job that the algorithm is preforming.
+ * @param stats - the object to load the statistics into.
+ */
+void getJobStats(JobHandle job, JobStats *stats){
+    waitForJob(job);
+    auto *new_job = (JobContext *) job;
+    stats->seconds = new_job->seconds;
+    stats->threads.clear();
+    stats->largest_group = 0;
+    for (const auto &tc : new_job->thread_context){
+        stats->threads.push_back(tc.stats);
+        stats->largest_group = max(stats->largest_group, tc.stats.largest_group);
+    }
+}
+
+
+/**
+ * Writes the statistics of a job to a file, as JSON.
+ * @param stats - the statistics.
+ * @param path - the path of the file.
+ */
+void write_stats_json(const JobStats &stats, const char *path){
+    static const char *phase_names[NUM_OF_PHASES] = {"map", "sort", "shuffle", "reduce"};
+    FILE *file = fopen(path, "w");
+    if (file == nullptr){
+        error_handler(STATS_FILE_ERROR);
+    }
+    fprintf(file, "{\"seconds\": %.6f, \"largest_group\": %lu, \"threads\": [", stats.seconds, stats.largest_group);
+    for (unsigned long i = 0; i < stats.threads.size(); ++i){
+        const ThreadStats &thread = stats.threads[i];
+        fprintf(file, "%s\n  {\"largest_group\": %lu, \"phases\": {", i ? "," : "", thread.largest_group);
+        for (int phase = 0; phase < NUM_OF_PHASES; ++phase){
+            const PhaseStats &it = thread.phases[phase];
+            fprintf(file, "%s\"%s\": {\"seconds\": %.6f, \"items\": %lu, \"bytes\": %lu, \"barrier_wait\": %.6f, "
+                          "\"lock_wait\": %.6f}", phase ? ", " : "", phase_names[phase], it.seconds, it.items, it.bytes,
+                    it.barrier_wait, it.lock_wait);
+        }
+        fprintf(file, "}}");
+    }
+    fprintf(file, "\n]}\n");
+    if (fclose(file) != 0){
+        error_handler(STATS_FILE_ERROR);
+    }
 }
 
 
@@ -522,14 +3452,19 @@ void getJobState(JobHandle job, JobState *state){
 void closeJobHandle(JobHandle job){
     waitForJob(job);
     auto *new_job = (JobContext *) job;
-    handling_semaphore(new_job->sem, DESTROY);
-    handling_mutex(new_job->Mutex_get_progress, DESTROY);
+    if (new_job->stats_path != nullptr){
+        JobStats stats;
+        getJobStats(job, &stats);
+        write_stats_json(stats, new_job->stats_path);
+    }
     handling_mutex(new_job->Mutex_set_atomic, DESTROY);
-    handling_mutex(new_job->Mutex_map, DESTROY);
-    handling_mutex(new_job->Mutex_sort, DESTROY);
-    handling_mutex(new_job->Mutex_reduce, DESTROY);
+    handling_mutex(new_job->Mutex_finished, DESTROY);
+    handling_cond(new_job->job_finished, DESTROY);
     delete (new_job->barrier);
     delete (new_job->barrier_reduce);
-    delete new_job->progress;
+    delete[] new_job->progress;
+    delete[] new_job->group_cursors;
+    delete[] new_job->map_ranges;
+    delete new_job->group_queue;
     delete new_job;
 }
@@ -0,0 +1,397 @@
+#include "SimdSort.h"
+#include <algorithm>
+#include <utility>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_SORT_X86 1
+#endif
+
+#define SIMD_WIDTH 4 // 64 bit lanes in an AVX2 register.
+#define SIMD_MERGE_WIDTH 8 // Keys merged at once (2 registers from every run).
+#define SIMD_BLOCK 16 // Keys sorted in registers at once (SIMD_WIDTH registers).
+#define SIMD_SORT_CHUNK 16384 // Keys sorted completely before the larger merges (128KB, half of the L2 cache).
+#define SIMD_SORT_THRESHOLD 64 // Fewer keys are sorted with scalar code, where the padding costs more then it saves.
+#define KEY_BIAS 0x8000000000000000ULL // Turns the unsigned order of the keys into the signed order of AVX2.
+#define PADDING_KEY INT64_MAX // Above every packed key (after the bias), for padding the runs to whole registers.
+
+using std::vector;
+
+
+bool simd_sort_supported(){
+#ifdef SIMD_SORT_X86
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+
+/**
+ * Sorts keys and payloads with std::sort.
+ */
+static void scalar_sort(vector<uint64_t> &keys, vector<uint64_t> &payloads){
+    vector<std::pair<uint64_t, uint64_t>> items(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i){
+        items[i] = {keys[i], payloads[i]};
+    }
+    std::sort(items.begin(), items.end(),
+              [](const std::pair<uint64_t, uint64_t> &a, const std::pair<uint64_t, uint64_t> &b){
+                  return a.first < b.first;
+              });
+    for (size_t i = 0; i < keys.size(); ++i){
+        keys[i] = items[i].first;
+        payloads[i] = items[i].second;
+    }
+}
+
+
+/**
+ * Merges the runs pairwise with std::merge, until one run is left.
+ */
+static void scalar_merge(vector<uint64_t> &keys, vector<uint64_t> &payloads, const vector<size_t> &run_ends){
+    vector<std::pair<uint64_t, uint64_t>> items(keys.size());
+    vector<std::pair<uint64_t, uint64_t>> merged(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i){
+        items[i] = {keys[i], payloads[i]};
+    }
+    auto less = [](const std::pair<uint64_t, uint64_t> &a, const std::pair<uint64_t, uint64_t> &b){
+        return a.first < b.first;
+    };
+    vector<size_t> ends = run_ends;
+    while (ends.size() > 1){
+        vector<size_t> merged_ends;
+        size_t begin = 0;
+        for (size_t i = 0; i < ends.size(); i += 2){
+            size_t middle = ends[i];
+            size_t end = i + 1 < ends.size() ? ends[i + 1] : middle;
+            std::merge(items.begin() + begin, items.begin() + middle, items.begin() + middle, items.begin() + end,
+                       merged.begin() + begin, less);
+            merged_ends.push_back(end);
+            begin = end;
+        }
+        items.swap(merged);
+        ends.swap(merged_ends);
+    }
+    for (size_t i = 0; i < keys.size(); ++i){
+        keys[i] = items[i].first;
+        payloads[i] = items[i].second;
+    }
+}
+
+
+#ifdef SIMD_SORT_X86
+
+
+/*
+ * The kernels sort packed keys only: every payload is packed under its key, in the low bits of one 64 bit word, and the
+ * words are biased so AVX2 compares them as signed integers. A packed key takes at most 63 bits, so the padding is
+ * larger than every real key and always ends up at the end.
+ */
+
+
+/**
+ * Puts the smaller key of every lane of a and b in a and the larger in b.
+ */
+__attribute__((target("avx2")))
+static inline void compare_exchange(__m256i &a, __m256i &b){
+    __m256i low = _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+    b = _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b));
+    a = low;
+}
+
+
+/**
+ * Sorts a bitonic sequence of 4 keys in a register: compares the lanes 2 apart, and then the lanes 1 apart.
+ */
+__attribute__((target("avx2")))
+static inline void bitonic_clean(__m256i &keys){
+    __m256i other = _mm256_permute4x64_epi64(keys, 0x4E);
+    __m256i low = _mm256_blendv_epi8(keys, other, _mm256_cmpgt_epi64(keys, other));
+    __m256i high = _mm256_blendv_epi8(other, keys, _mm256_cmpgt_epi64(keys, other));
+    keys = _mm256_blend_epi32(low, high, 0xF0);
+    other = _mm256_shuffle_epi32(keys, 0x4E);
+    low = _mm256_blendv_epi8(keys, other, _mm256_cmpgt_epi64(keys, other));
+    high = _mm256_blendv_epi8(other, keys, _mm256_cmpgt_epi64(keys, other));
+    keys = _mm256_blend_epi32(low, high, 0xCC);
+}
+
+
+/**
+ * Reverses the order of the lanes of a register.
+ */
+__attribute__((target("avx2")))
+static inline __m256i reverse(__m256i lanes){
+    return _mm256_permute4x64_epi64(lanes, 0x1B);
+}
+
+
+/**
+ * Merges two sorted registers: afterwards a has the 4 smallest keys and b the 4 largest, both sorted.
+ */
+__attribute__((target("avx2")))
+static inline void bitonic_merge(__m256i &a, __m256i &b){
+    b = reverse(b);
+    compare_exchange(a, b);
+    bitonic_clean(a);
+    bitonic_clean(b);
+}
+
+
+/**
+ * Merges two sorted runs of 8 keys, each in 2 registers: afterwards keys[0] and keys[1] have the 8 smallest keys and
+ * keys[2] and keys[3] the 8 largest, all sorted.
+ */
+__attribute__((target("avx2")))
+static inline void bitonic_merge_wide(__m256i keys[4]){
+    __m256i reversed = reverse(keys[3]);
+    keys[3] = reverse(keys[2]);
+    keys[2] = reversed;
+    compare_exchange(keys[0], keys[2]);
+    compare_exchange(keys[1], keys[3]);
+    compare_exchange(keys[0], keys[1]);
+    compare_exchange(keys[2], keys[3]);
+    for (int i = 0; i < 4; ++i){
+        bitonic_clean(keys[i]);
+    }
+}
+
+
+/**
+ * Transposes 4 registers of 4 lanes, as a 4x4 matrix.
+ */
+__attribute__((target("avx2")))
+static inline void transpose(__m256i &r0, __m256i &r1, __m256i &r2, __m256i &r3){
+    __m256i t0 = _mm256_unpacklo_epi64(r0, r1);
+    __m256i t1 = _mm256_unpackhi_epi64(r0, r1);
+    __m256i t2 = _mm256_unpacklo_epi64(r2, r3);
+    __m256i t3 = _mm256_unpackhi_epi64(r2, r3);
+    r0 = _mm256_permute2x128_si256(t0, t2, 0x20);
+    r1 = _mm256_permute2x128_si256(t1, t3, 0x20);
+    r2 = _mm256_permute2x128_si256(t0, t2, 0x31);
+    r3 = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+
+/**
+ * Sorts every block of 16 keys in registers: sorts the columns of the block (as 4 registers) with a sorting network,
+ * transposes it to get 4 sorted runs of 4, and merges them with bitonic merges - the runs in pairs, and then the two
+ * runs of 8.
+ * @param keys - the keys, a multiple of SIMD_BLOCK of them.
+ * @param size - the number of keys.
+ */
+__attribute__((target("avx2")))
+static void sort_blocks(int64_t *keys, size_t size){
+    for (size_t block = 0; block < size; block += SIMD_BLOCK){
+        __m256i *lanes = (__m256i *) (keys + block);
+        __m256i r[SIMD_WIDTH];
+        for (int i = 0; i < SIMD_WIDTH; ++i){
+            r[i] = _mm256_loadu_si256(lanes + i);
+        }
+        compare_exchange(r[0], r[1]);
+        compare_exchange(r[2], r[3]);
+        compare_exchange(r[0], r[2]);
+        compare_exchange(r[1], r[3]);
+        compare_exchange(r[1], r[2]);
+        transpose(r[0], r[1], r[2], r[3]);
+        bitonic_merge(r[0], r[1]);
+        bitonic_merge(r[2], r[3]);
+        bitonic_merge_wide(r);
+        for (int i = 0; i < SIMD_WIDTH; ++i){
+            _mm256_storeu_si256(lanes + i, r[i]);
+        }
+    }
+}
+
+
+/**
+ * Merges two sorted runs, 8 keys at a time: the two runs of 8 in the registers are merged, the smallest 8 are written
+ * out, and their registers are loaded again from the run whose next key is smaller.
+ * @param a - the first run, a multiple of SIMD_MERGE_WIDTH keys.
+ * @param a_size - the number of keys in the first run.
+ * @param b - the second run, a multiple of SIMD_MERGE_WIDTH keys.
+ * @param b_size - the number of keys in the second run.
+ * @param out - gets the merged keys.
+ */
+__attribute__((target("avx2")))
+static void merge_runs(const int64_t *a, size_t a_size, const int64_t *b, size_t b_size, int64_t *out){
+    if (a_size == 0 || b_size == 0){
+        const int64_t *run = a_size ? a : b;
+        std::copy(run, run + a_size + b_size, out);
+        return;
+    }
+    __m256i k[4];
+    k[0] = _mm256_loadu_si256((const __m256i *) a);
+    k[1] = _mm256_loadu_si256((const __m256i *) a + 1);
+    k[2] = _mm256_loadu_si256((const __m256i *) b);
+    k[3] = _mm256_loadu_si256((const __m256i *) b + 1);
+    size_t next_a = SIMD_MERGE_WIDTH;
+    size_t next_b = SIMD_MERGE_WIDTH;
+    int64_t *end = out + a_size + b_size - SIMD_MERGE_WIDTH;
+    while (true){
+        bitonic_merge_wide(k);
+        _mm256_storeu_si256((__m256i *) out, k[0]);
+        _mm256_storeu_si256((__m256i *) out + 1, k[1]);
+        out += SIMD_MERGE_WIDTH;
+        if (out == end){
+            break;
+        }
+        // Chosen without a branch, which the random order of the keys would mispredict half the time.
+        bool take_a = next_b == b_size || (next_a < a_size && a[next_a] <= b[next_b]);
+        const __m256i *next = (const __m256i *) (take_a ? a + next_a : b + next_b);
+        k[0] = _mm256_loadu_si256(next);
+        k[1] = _mm256_loadu_si256(next + 1);
+        next_a += take_a ? SIMD_MERGE_WIDTH : 0;
+        next_b += take_a ? 0 : SIMD_MERGE_WIDTH;
+    }
+    _mm256_storeu_si256((__m256i *) out, k[2]);
+    _mm256_storeu_si256((__m256i *) out + 1, k[3]);
+}
+
+
+/**
+ * Merges sorted runs pairwise with merge_runs until one run is left, moving the keys between the buffer and the
+ * scratch buffer on every pass. The merged run ends up in the buffer.
+ * @param keys - the runs, whose sizes are multiples of SIMD_MERGE_WIDTH.
+ * @param scratch - a buffer of the same size.
+ * @param ends - the index after the last key of every run.
+ */
+static void merge_all_runs(int64_t *keys, int64_t *scratch, vector<size_t> ends){
+    int64_t *from = keys;
+    int64_t *to = scratch;
+    while (ends.size() > 1){
+        vector<size_t> merged_ends;
+        size_t begin = 0;
+        for (size_t i = 0; i < ends.size(); i += 2){
+            size_t middle = ends[i];
+            size_t end = i + 1 < ends.size() ? ends[i + 1] : middle;
+            merge_runs(from + begin, middle - begin, from + middle, end - middle, to + begin);
+            merged_ends.push_back(end);
+            begin = end;
+        }
+        std::swap(from, to);
+        ends.swap(merged_ends);
+    }
+    if (from != keys && !ends.empty()){
+        std::copy(from, from + ends.back(), keys);
+    }
+}
+
+
+/**
+ * Decides if the payloads can be packed under the keys: a key and its payload may take 63 bits together.
+ * @return the number of low bits for the payloads, or -1 if they can't be packed.
+ */
+static int packed_payload_bits(const vector<uint64_t> &keys, const vector<uint64_t> &payloads){
+    uint64_t key_bits = 0;
+    uint64_t payload_bits = 0;
+    for (size_t i = 0; i < keys.size(); ++i){
+        key_bits |= keys[i];
+        payload_bits |= payloads[i];
+    }
+    int key_width = key_bits ? 64 - __builtin_clzll(key_bits) : 0;
+    int payload_width = payload_bits ? 64 - __builtin_clzll(payload_bits) : 0;
+    return key_width + payload_width < 64 ? payload_width : -1;
+}
+
+
+/**
+ * Packs a key and its payload into one biased word.
+ */
+static inline int64_t pack(uint64_t key, uint64_t payload, int payload_bits){
+    return (int64_t) (((payload_bits ? key << payload_bits : key) | payload) ^ KEY_BIAS);
+}
+
+
+/**
+ * Unpacks the sorted words back into the keys and the payloads. The padding is after the real keys, and is dropped.
+ */
+static void unpack(const vector<int64_t> &packed, int payload_bits, vector<uint64_t> &keys,
+                   vector<uint64_t> &payloads){
+    uint64_t payload_mask = payload_bits ? ~0ULL >> (64 - payload_bits) : 0;
+    for (size_t i = 0; i < keys.size(); ++i){
+        uint64_t value = (uint64_t) packed[i] ^ KEY_BIAS;
+        keys[i] = payload_bits ? value >> payload_bits : value;
+        payloads[i] = value & payload_mask;
+    }
+}
+
+
+#endif
+
+
+void sort_keys(vector<uint64_t> &keys, vector<uint64_t> &payloads){
+#ifdef SIMD_SORT_X86
+    int payload_bits = keys.size() >= SIMD_SORT_THRESHOLD && simd_sort_supported() ?
+                       packed_payload_bits(keys, payloads) : -1;
+    if (payload_bits >= 0){
+        // The blocks are sorted in registers, merged in chunks that fit in the cache, and then the chunks are merged.
+        size_t size = (keys.size() + SIMD_BLOCK - 1) / SIMD_BLOCK * SIMD_BLOCK;
+        vector<int64_t> packed(size, PADDING_KEY);
+        for (size_t i = 0; i < keys.size(); ++i){
+            packed[i] = pack(keys[i], payloads[i], payload_bits);
+        }
+        vector<int64_t> scratch(size);
+        sort_blocks(packed.data(), size);
+        vector<size_t> chunk_ends;
+        for (size_t chunk = 0; chunk < size; chunk += SIMD_SORT_CHUNK){
+            size_t chunk_size = std::min((size_t) SIMD_SORT_CHUNK, size - chunk);
+            vector<size_t> ends;
+            for (size_t end = SIMD_BLOCK; end <= chunk_size; end += SIMD_BLOCK){
+                ends.push_back(end);
+            }
+            merge_all_runs(packed.data() + chunk, scratch.data() + chunk, ends);
+            chunk_ends.push_back(chunk + chunk_size);
+        }
+        merge_all_runs(packed.data(), scratch.data(), chunk_ends);
+        unpack(packed, payload_bits, keys, payloads);
+        return;
+    }
+#endif
+    scalar_sort(keys, payloads);
+}
+
+
+void merge_key_runs(vector<uint64_t> &keys, vector<uint64_t> &payloads, const vector<size_t> &run_ends){
+    if (run_ends.size() < 2){
+        return;
+    }
+#ifdef SIMD_SORT_X86
+    int payload_bits = keys.size() >= SIMD_SORT_THRESHOLD && simd_sort_supported() ?
+                       packed_payload_bits(keys, payloads) : -1;
+    // The packed runs are sorted only if the payloads of equal keys are increasing in every run (as positions are).
+    size_t begin = 0;
+    for (size_t end : run_ends){
+        for (size_t i = begin + 1; payload_bits >= 0 && i < end; ++i){
+            if (keys[i] == keys[i - 1] && payloads[i] <= payloads[i - 1]){
+                payload_bits = -1;
+            }
+        }
+        begin = end;
+    }
+    if (payload_bits >= 0){
+        // Every run is padded to whole registers.
+        vector<size_t> ends;
+        begin = 0;
+        for (size_t end : run_ends){
+            size_t padded_begin = ends.empty() ? 0 : ends.back();
+            ends.push_back(padded_begin + (end - begin + SIMD_MERGE_WIDTH - 1) / SIMD_MERGE_WIDTH * SIMD_MERGE_WIDTH);
+            begin = end;
+        }
+        vector<int64_t> packed(ends.back(), PADDING_KEY);
+        begin = 0;
+        for (size_t run = 0; run < run_ends.size(); ++run){
+            int64_t *out = packed.data() + (run ? ends[run - 1] : 0);
+            for (size_t i = begin; i < run_ends[run]; ++i){
+                *out++ = pack(keys[i], payloads[i], payload_bits);
+            }
+            begin = run_ends[run];
+        }
+        vector<int64_t> scratch(packed.size());
+        merge_all_runs(packed.data(), scratch.data(), ends);
+        unpack(packed, payload_bits, keys, payloads);
+        return;
+    }
+#endif
+    scalar_merge(keys, payloads, run_ends);
+}
@@ -0,0 +1,44 @@
+#ifndef SIMDSORT_H
+#define SIMDSORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+/*
+ * Sorting and merging of 64 bit keys, each with a 64 bit payload (usually the index of the element the key belongs
+ * to), for jobs whose intermediate keys have a fixed width encoding. The keys and the payloads are kept in two parallel
+ * vectors, and the keys are compared as unsigned integers.
+ *
+ * On CPUs with AVX2, when every key and its payload fit in 63 bits together (e.g. 32 bit keys with their indices),
+ * the payloads are packed under the keys and the kernels sort blocks of 16 keys with a sorting network in registers
+ * and merge the sorted runs with bitonic merge networks, 8 keys at a time. Otherwise (on other CPUs, checked once at
+ * runtime, or with wider keys) the keys are sorted with scalar code. Equal keys may come out in any order.
+ */
+
+
+/**
+ * @return true if the kernels run with AVX2 on this CPU.
+ */
+bool simd_sort_supported();
+
+
+/**
+ * Sorts keys in increasing order, moving every payload with its key.
+ * @param keys - the keys.
+ * @param payloads - the payloads, as many as the keys.
+ */
+void sort_keys(std::vector<uint64_t> &keys, std::vector<uint64_t> &payloads);
+
+
+/**
+ * Merges consecutive sorted runs of keys into one sorted sequence, moving every payload with its key.
+ * @param keys - the keys of all the runs, one run after the other.
+ * @param payloads - the payloads, as many as the keys.
+ * @param run_ends - the index after the last key of every run, in increasing order (the last one is keys.size()).
+ */
+void merge_key_runs(std::vector<uint64_t> &keys, std::vector<uint64_t> &payloads, const std::vector<size_t> &run_ends);
+
+
+#endif //SIMDSORT_H
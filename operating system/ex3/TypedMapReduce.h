@@ -0,0 +1,483 @@
+#ifndef TYPEDMAPREDUCE_H
+#define TYPEDMAPREDUCE_H
+
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <pthread.h>
+
+
+/*
+ * A typed MapReduce, in addition to the K1/K2/K3 interface of MapReduceFramework.h.
+ *
+ * The keys and values are stored by value, in separate contiguous arrays (one for the keys and one for the values),
+ * and the map and reduce functions are template parameters, so they are called (and usually inlined) without virtual
+ * calls. Keys that have a RadixKey specialization (the integral and floating point types, and any fixed width key the
+ * client adds one for) are sorted with an LSD radix sort; other keys are sorted with their operator<.
+ *
+ * Example:
+ *     auto word_count = make_map_reduce<uint32_t, uint64_t>(
+ *             [](const Line &line, PairBuffer<uint32_t, uint64_t> &pairs){
+ *                 for (uint32_t word : line.words) pairs.emit(word, 1);
+ *             },
+ *             [](const uint32_t &word, const uint64_t *counts, size_t size, std::vector<Count> &output){
+ *                 output.push_back({word, std::accumulate(counts, counts + size, 0ULL)});
+ *             },
+ *             8);
+ *     word_count.run(lines, counts);
+ *
+ * The output of every reduce call is placed in the output vector in the order of the keys.
+ *
+ * The header has no dependencies on the rest of the framework: a program that includes it doesn't need to link
+ * libMapReduceFramework.a.
+ */
+
+
+#define TYPED_SYSTEM_ERROR "System error: "
+#define TYPED_INIT_THREAD_ERROR "failed to initialize a thread."
+#define TYPED_JOIN_THREAD_ERROR "failed to join between threads."
+#define TYPED_BARRIER_ERROR "failed to initialize a barrier."
+#define TYPED_MAP_CHUNK 256
+#define TYPED_SAMPLES_PER_THREAD 64
+#define RADIX_BITS 8
+#define RADIX_BUCKETS 256
+
+
+/**
+ * An order preserving conversion of a key to an unsigned integer, for the radix sort. Specialize it (with enabled =
+ * true, a Bits type and encode) for fixed width keys that should be radix sorted.
+ */
+template<typename K, typename Enable = void>
+struct RadixKey {
+    static const bool enabled = false;
+};
+
+
+template<typename K>
+struct RadixKey<K, typename std::enable_if<std::is_integral<K>::value && !std::is_same<K, bool>::value>::type> {
+    static const bool enabled = true;
+    typedef typename std::make_unsigned<K>::type Bits;
+
+    static Bits encode(K key){
+        // Flipping the sign bit puts the negative numbers before the positive ones.
+        return std::is_signed<K>::value ? (Bits) key ^ ((Bits) 1 << (sizeof(Bits) * 8 - 1)) : (Bits) key;
+    }
+};
+
+
+template<>
+struct RadixKey<float> {
+    static const bool enabled = true;
+    typedef uint32_t Bits;
+
+    static Bits encode(float key){
+        Bits bits;
+        memcpy(&bits, &key, sizeof(bits));
+        // Negative numbers are ordered backwards, so all their bits are flipped.
+        return (bits & 0x80000000U) ? ~bits : bits | 0x80000000U;
+    }
+};
+
+
+template<>
+struct RadixKey<double> {
+    static const bool enabled = true;
+    typedef uint64_t Bits;
+
+    static Bits encode(double key){
+        Bits bits;
+        memcpy(&bits, &key, sizeof(bits));
+        return (bits & 0x8000000000000000ULL) ? ~bits : bits | 0x8000000000000000ULL;
+    }
+};
+
+
+/**
+ * The pairs emitted by the map function of one thread, as a key array and a value array.
+ */
+template<typename K, typename V>
+class PairBuffer {
+public:
+    std::vector<K> keys;
+    std::vector<V> values;
+
+    void emit(const K &key, const V &value){
+        keys.push_back(key);
+        values.push_back(value);
+    }
+
+    size_t size() const {
+        return keys.size();
+    }
+
+    void clear(){
+        keys.clear();
+        values.clear();
+    }
+};
+
+
+/**
+ * Prints the relevant error and exits the program with 1 (EXIT_FAILURE).
+ * @param error - the error massage to be printed.
+ */
+inline void typed_error_handler(const std::string &error){
+    std::cerr << TYPED_SYSTEM_ERROR << error << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+
+/**
+ * A barrier for the threads of a typed job (a pthread barrier, so the header doesn't need Barrier.cpp). The threads of a
+ * job meet only twice, so the simple barrier is enough.
+ */
+class TypedBarrier {
+public:
+    explicit TypedBarrier(int num_of_threads){
+        if (pthread_barrier_init(&barrier_, nullptr, num_of_threads)){
+            typed_error_handler(TYPED_BARRIER_ERROR);
+        }
+    }
+
+    ~TypedBarrier(){
+        pthread_barrier_destroy(&barrier_);
+    }
+
+    TypedBarrier(const TypedBarrier &) = delete;
+    TypedBarrier &operator=(const TypedBarrier &) = delete;
+
+    void barrier(){
+        pthread_barrier_wait(&barrier_);
+    }
+
+private:
+    pthread_barrier_t barrier_;
+};
+
+
+/**
+ * Compares keys in the order of the sort - by RadixKey if the key has one, and by operator< otherwise.
+ */
+template<typename K, bool Radix = RadixKey<K>::enabled>
+struct KeyLess {
+    bool operator()(const K &first, const K &second) const {
+        return RadixKey<K>::encode(first) < RadixKey<K>::encode(second);
+    }
+};
+
+
+template<typename K>
+struct KeyLess<K, false> {
+    bool operator()(const K &first, const K &second) const {
+        return first < second;
+    }
+};
+
+
+/**
+ * Sorts the pairs of a buffer by key with an LSD radix sort, one byte per pass. Passes where all the keys have the
+ * same byte are skipped, so small keys cost only the passes of their low bytes.
+ * @param pairs - the pairs to sort.
+ * @param scratch - a buffer to use for the passes (its contents are lost).
+ */
+template<typename K, typename V>
+void sort_pairs(PairBuffer<K, V> &pairs, PairBuffer<K, V> &scratch, std::true_type){
+    typedef typename RadixKey<K>::Bits Bits;
+    size_t size = pairs.size();
+    scratch.keys.resize(size);
+    scratch.values.resize(size);
+    std::vector<Bits> encoded(size);
+    std::vector<Bits> encoded_scratch(size);
+    for (size_t i = 0; i < size; ++i){
+        encoded[i] = RadixKey<K>::encode(pairs.keys[i]);
+    }
+    for (unsigned shift = 0; shift < sizeof(Bits) * 8; shift += RADIX_BITS){
+        size_t count[RADIX_BUCKETS + 1] = {0};
+        for (size_t i = 0; i < size; ++i){
+            count[((encoded[i] >> shift) & (RADIX_BUCKETS - 1)) + 1]++;
+        }
+        bool single_bucket = false;
+        for (int bucket = 1; bucket <= RADIX_BUCKETS; ++bucket){
+            if (count[bucket] == size){
+                single_bucket = true;
+            }
+            count[bucket] += count[bucket - 1];
+        }
+        if (single_bucket){
+            continue;
+        }
+        for (size_t i = 0; i < size; ++i){
+            size_t position = count[(encoded[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+            encoded_scratch[position] = encoded[i];
+            scratch.keys[position] = pairs.keys[i];
+            scratch.values[position] = pairs.values[i];
+        }
+        encoded.swap(encoded_scratch);
+        pairs.keys.swap(scratch.keys);
+        pairs.values.swap(scratch.values);
+    }
+}
+
+
+/**
+ * Sorts the pairs of a buffer by key with operator< (keys without a RadixKey). The order of the pairs is sorted and
+ * then the keys and the values are moved to their places.
+ * @param pairs - the pairs to sort.
+ * @param scratch - a buffer to use for moving the pairs (its contents are lost).
+ */
+template<typename K, typename V>
+void sort_pairs(PairBuffer<K, V> &pairs, PairBuffer<K, V> &scratch, std::false_type){
+    size_t size = pairs.size();
+    std::vector<size_t> order(size);
+    for (size_t i = 0; i < size; ++i){
+        order[i] = i;
+    }
+    const std::vector<K> &keys = pairs.keys;
+    std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b){ return keys[a] < keys[b]; });
+    scratch.clear();
+    scratch.keys.reserve(size);
+    scratch.values.reserve(size);
+    for (size_t index : order){
+        scratch.emit(pairs.keys[index], pairs.values[index]);
+    }
+    pairs.keys.swap(scratch.keys);
+    pairs.values.swap(scratch.values);
+}
+
+
+/**
+ * A MapReduce job with keys of type K and values of type V.
+ * MapFn is called as map_fn(const Input &input, PairBuffer<K, V> &pairs) and emits with pairs.emit(key, value).
+ * ReduceFn is called once for every key, as reduce_fn(const K &key, const V *values, size_t size,
+ * std::vector<Output> &output), with all the values of the key, and appends its results to output.
+ */
+template<typename MapFn, typename ReduceFn, typename K, typename V>
+class MapReduce {
+public:
+    /**
+     * @param map_fn - the map function.
+     * @param reduce_fn - the reduce function.
+     * @param multiThreadLevel - the number of threads that will preform a job.
+     */
+    MapReduce(MapFn map_fn, ReduceFn reduce_fn, int multiThreadLevel)
+            : map_fn(map_fn), reduce_fn(reduce_fn), multiThreadLevel(multiThreadLevel) {}
+
+    /**
+     * Runs a job over inputVec and appends the results to outputVec. Returns when the job is done.
+     * @param inputVec - the input of the job.
+     * @param outputVec - the vector where we'll keep the results.
+     */
+    template<typename Input, typename Output>
+    void run(const std::vector<Input> &inputVec, std::vector<Output> &outputVec) const {
+        int num_of_threads = std::min(multiThreadLevel, (int) inputVec.size());
+        if (num_of_threads <= 0){
+            return;
+        }
+        Job<Input, Output> job(this, &inputVec, num_of_threads);
+        std::vector<pthread_t> threads(num_of_threads);
+        for (int i = 0; i < num_of_threads; ++i){
+            if (pthread_create(&threads[i], nullptr, thread_main<Input, Output>, &job.threads[i])){
+                typed_error_handler(TYPED_INIT_THREAD_ERROR);
+            }
+        }
+        for (int i = 0; i < num_of_threads; ++i){
+            if (pthread_join(threads[i], nullptr)){
+                typed_error_handler(TYPED_JOIN_THREAD_ERROR);
+            }
+        }
+        // The threads reduced consecutive key ranges, so their outputs are in the order of the threads.
+        for (const auto &tc : job.threads){
+            outputVec.insert(outputVec.end(), tc.output.begin(), tc.output.end());
+        }
+    }
+
+private:
+    typedef std::integral_constant<bool, RadixKey<K>::enabled> UseRadix;
+
+    template<typename Input, typename Output>
+    struct Job;
+
+    /**
+     * The state of one thread of a job.
+     */
+    template<typename Input, typename Output>
+    struct ThreadContext {
+        int id; // The thread's id number.
+        Job<Input, Output> *job; // The job the thread executes.
+        PairBuffer<K, V> pairs; // The output of the map stage, partitioned by the reducing thread of every pair.
+        PairBuffer<K, V> scratch; // Used for sorting and partitioning.
+        std::vector<K> samples; // Evenly spaced keys of the map output, used for choosing the splitters.
+        size_t map_size; // The number of pairs the thread emitted (set before the samples are shared, since the
+        // buffers are reordered while the other threads choose their splitters).
+        std::vector<size_t> buckets; // The pairs that go to reducing thread r are in [buckets[r], buckets[r + 1]).
+        std::vector<Output> output; // The results of the reduce calls of this thread.
+    };
+
+    /**
+     * The state of a job that is shared by its threads.
+     */
+    template<typename Input, typename Output>
+    struct Job {
+        const MapReduce *owner; // The map and reduce functions.
+        const std::vector<Input> *inputVec; // The input of the job.
+        int num_of_threads; // The number of threads running the job.
+        std::atomic<size_t> next_input; // The index of the first input element that wasn't claimed.
+        std::vector<ThreadContext<Input, Output>> threads; // The ThreadContext of each thread.
+        TypedBarrier barrier_sampled; // All the threads have their samples.
+        TypedBarrier barrier_partitioned; // All the threads partitioned their pairs.
+
+        Job(const MapReduce *owner, const std::vector<Input> *inputVec, int num_of_threads)
+                : owner(owner), inputVec(inputVec), num_of_threads(num_of_threads), next_input(0),
+                  threads(num_of_threads), barrier_sampled(num_of_threads), barrier_partitioned(num_of_threads){
+            for (int i = 0; i < num_of_threads; ++i){
+                threads[i].id = i;
+                threads[i].job = this;
+            }
+        }
+    };
+
+    /**
+     * Chooses num_of_threads - 1 splitters from the samples of all the threads, so the key ranges between them have
+     * roughly the same number of pairs (every sample is weighted by the number of pairs it represents).
+     */
+    template<typename Input, typename Output>
+    static void choose_splitters(Job<Input, Output> *job, std::vector<K> &splitters){
+        std::vector<std::pair<K, double>> weighted_samples;
+        double total_weight = 0;
+        for (const auto &tc : job->threads){
+            double weight = tc.samples.empty() ? 0 : (double) tc.map_size / (double) tc.samples.size();
+            for (const K &key : tc.samples){
+                weighted_samples.emplace_back(key, weight);
+            }
+            total_weight += (double) tc.map_size;
+        }
+        KeyLess<K> less;
+        std::sort(weighted_samples.begin(), weighted_samples.end(),
+                  [&less](const std::pair<K, double> &a, const std::pair<K, double> &b){
+                      return less(a.first, b.first);
+                  });
+        double accumulated = 0;
+        auto sample = weighted_samples.begin();
+        for (int i = 1; i < job->num_of_threads && sample != weighted_samples.end(); ++i){
+            double target = total_weight * i / job->num_of_threads;
+            while (sample != weighted_samples.end() && accumulated + sample->second < target){
+                accumulated += sample->second;
+                ++sample;
+            }
+            if (sample != weighted_samples.end()){
+                splitters.push_back(sample->first);
+            }
+        }
+    }
+
+    /**
+     * Reorders the map output of the thread by the reducing thread of every pair (the number of splitters that are
+     * not larger then its key), with a counting sort.
+     */
+    template<typename Input, typename Output>
+    static void partition(ThreadContext<Input, Output> *tc, const std::vector<K> &splitters){
+        int num_of_buckets = tc->job->num_of_threads;
+        size_t size = tc->pairs.size();
+        KeyLess<K> less;
+        std::vector<int> bucket_of(size);
+        tc->buckets.assign(num_of_buckets + 1, 0);
+        for (size_t i = 0; i < size; ++i){
+            bucket_of[i] = std::upper_bound(splitters.begin(), splitters.end(), tc->pairs.keys[i], less) -
+                           splitters.begin();
+            tc->buckets[bucket_of[i] + 1]++;
+        }
+        for (int r = 1; r <= num_of_buckets; ++r){
+            tc->buckets[r] += tc->buckets[r - 1];
+        }
+        std::vector<size_t> next(tc->buckets.begin(), tc->buckets.end() - 1);
+        tc->scratch.keys.resize(size);
+        tc->scratch.values.resize(size);
+        for (size_t i = 0; i < size; ++i){
+            size_t position = next[bucket_of[i]]++;
+            tc->scratch.keys[position] = tc->pairs.keys[i];
+            tc->scratch.values[position] = tc->pairs.values[i];
+        }
+        tc->pairs.keys.swap(tc->scratch.keys);
+        tc->pairs.values.swap(tc->scratch.values);
+    }
+
+    /**
+     * The function (entry point) that all the threads running a job execute: map, sample, partition by the
+     * splitters, and then sort and reduce the pairs of one key range, collected from all the threads.
+     */
+    template<typename Input, typename Output>
+    static void *thread_main(void *thread_context){
+        auto *tc = (ThreadContext<Input, Output> *) thread_context;
+        Job<Input, Output> *job = tc->job;
+        const MapReduce *owner = job->owner;
+        size_t input_size = job->inputVec->size();
+        while (true){
+            size_t begin = job->next_input.fetch_add(TYPED_MAP_CHUNK);
+            if (begin >= input_size){
+                break;
+            }
+            size_t end = std::min(begin + TYPED_MAP_CHUNK, input_size);
+            for (size_t index = begin; index < end; ++index){
+                owner->map_fn((*job->inputVec)[index], tc->pairs);
+            }
+        }
+        size_t size = tc->pairs.size();
+        tc->map_size = size;
+        size_t num_of_samples = std::min(size, (size_t) TYPED_SAMPLES_PER_THREAD);
+        for (size_t i = 0; i < num_of_samples; ++i){
+            tc->samples.push_back(tc->pairs.keys[(i * size) / num_of_samples]);
+        }
+        job->barrier_sampled.barrier();
+        std::vector<K> splitters;
+        choose_splitters(job, splitters);
+        partition(tc, splitters);
+        job->barrier_partitioned.barrier();
+        PairBuffer<K, V> range;
+        size_t range_size = 0;
+        for (const auto &it : job->threads){
+            range_size += it.buckets[tc->id + 1] - it.buckets[tc->id];
+        }
+        range.keys.reserve(range_size);
+        range.values.reserve(range_size);
+        for (const auto &it : job->threads){
+            range.keys.insert(range.keys.end(), it.pairs.keys.begin() + it.buckets[tc->id],
+                              it.pairs.keys.begin() + it.buckets[tc->id + 1]);
+            range.values.insert(range.values.end(), it.pairs.values.begin() + it.buckets[tc->id],
+                                it.pairs.values.begin() + it.buckets[tc->id + 1]);
+        }
+        sort_pairs(range, tc->scratch, UseRadix());
+        KeyLess<K> less;
+        size_t group_begin = 0;
+        while (group_begin < range_size){
+            size_t group_end = group_begin + 1;
+            while (group_end < range_size && !less(range.keys[group_begin], range.keys[group_end])){
+                ++group_end;
+            }
+            owner->reduce_fn(range.keys[group_begin], range.values.data() + group_begin, group_end - group_begin,
+                             tc->output);
+            group_begin = group_end;
+        }
+        return nullptr;
+    }
+
+    MapFn map_fn; // The map function.
+    ReduceFn reduce_fn; // The reduce function.
+    int multiThreadLevel; // The number of threads that will preform a job.
+};
+
+
+/**
+ * Creates a MapReduce, deducing the types of the map and reduce functions (for lambdas).
+ */
+template<typename K, typename V, typename MapFn, typename ReduceFn>
+MapReduce<MapFn, ReduceFn, K, V> make_map_reduce(MapFn map_fn, ReduceFn reduce_fn, int multiThreadLevel){
+    return MapReduce<MapFn, ReduceFn, K, V>(map_fn, reduce_fn, multiThreadLevel);
+}
+
+
+#endif //TYPEDMAPREDUCE_H
@@ -0,0 +1,145 @@
+#include "Datasets.h"
+#include <algorithm>
+#include <cmath>
+
+#define MIN_WORD_LENGTH 2 // The random prefix of a word is 2 to 7 letters, before its unique suffix.
+#define MAX_WORD_LENGTH 7
+#define MAX_ORDER_AMOUNT 1000
+#define MAX_VALUE 100
+#define NUM_OF_REGIONS 16
+
+using std::string;
+using std::vector;
+
+
+ZipfSampler::ZipfSampler(uint64_t num_of_keys, double skew) : cdf(std::max(num_of_keys, (uint64_t) 1)){
+    double total = 0;
+    for (uint64_t k = 0; k < cdf.size(); ++k){
+        total += 1.0 / std::pow((double) (k + 1), skew);
+        cdf[k] = total;
+    }
+    for (auto &it : cdf){
+        it /= total;
+    }
+}
+
+
+uint64_t ZipfSampler::operator()(std::mt19937_64 &random) const{
+    double point = std::uniform_real_distribution<double>(0, 1)(random);
+    auto key = std::lower_bound(cdf.begin(), cdf.end(), point);
+    return key == cdf.end() ? cdf.size() - 1 : key - cdf.begin();
+}
+
+
+Dataset::~Dataset(){
+    for (V1 *value : values){
+        delete value;
+    }
+}
+
+
+/**
+ * Creates the vocabulary: random lowercase words, made unique by a suffix with the index of the word in base 26.
+ * @param size - the number of words.
+ * @param random - the random generator of the dataset.
+ * @return the words.
+ */
+static vector<string> generate_vocabulary(uint64_t size, std::mt19937_64 &random){
+    vector<string> words(size);
+    std::uniform_int_distribution<int> length(MIN_WORD_LENGTH, MAX_WORD_LENGTH);
+    std::uniform_int_distribution<int> letter('a', 'z');
+    for (uint64_t i = 0; i < size; ++i){
+        string &word = words[i];
+        for (int j = length(random); j > 0; --j){
+            word.push_back((char) letter(random));
+        }
+        uint64_t index = i;
+        do {
+            word.push_back((char) ('a' + index % 26));
+            index /= 26;
+        } while (index);
+    }
+    return words;
+}
+
+
+/**
+ * Fills a dataset with text records of spec.words words each.
+ * @param spec - the parameters of the dataset.
+ * @param dataset - the dataset to fill.
+ * @param distinct_total - if true, expected_total counts the distinct words of every record, otherwise all of them.
+ */
+static void generate_text(const DatasetSpec &spec, Dataset &dataset, bool distinct_total){
+    std::mt19937_64 random(spec.seed);
+    vector<string> vocabulary = generate_vocabulary(spec.keys, random);
+    ZipfSampler sampler(spec.keys, spec.skew);
+    vector<uint64_t> words(spec.words);
+    for (uint64_t i = 0; i < spec.records; ++i){
+        auto *record = new TextRecord();
+        record->id = i;
+        for (unsigned j = 0; j < spec.words; ++j){
+            words[j] = sampler(random);
+            if (j){
+                record->text.push_back(' ');
+            }
+            record->text += vocabulary[words[j]];
+        }
+        if (distinct_total){
+            std::sort(words.begin(), words.end());
+            dataset.expected_total += std::unique(words.begin(), words.end()) - words.begin();
+        } else {
+            dataset.expected_total += spec.words;
+        }
+        dataset.values.push_back(record);
+        dataset.input.push_back({nullptr, record});
+    }
+}
+
+
+void generate_lines(const DatasetSpec &spec, Dataset &dataset){
+    generate_text(spec, dataset, false);
+}
+
+
+void generate_documents(const DatasetSpec &spec, Dataset &dataset){
+    generate_text(spec, dataset, true);
+}
+
+
+void generate_join_tables(const DatasetSpec &spec, Dataset &dataset){
+    std::mt19937_64 random(spec.seed);
+    ZipfSampler sampler(spec.keys, spec.skew);
+    for (uint64_t key = 0; key < spec.keys; ++key){
+        auto *customer = new JoinRecord();
+        customer->customer = true;
+        customer->key = key;
+        customer->payload = random() % NUM_OF_REGIONS;
+        dataset.values.push_back(customer);
+    }
+    for (uint64_t i = 0; i < spec.records; ++i){
+        auto *order = new JoinRecord();
+        order->key = sampler(random);
+        order->payload = 1 + random() % MAX_ORDER_AMOUNT;
+        dataset.values.push_back(order);
+    }
+    // The tables are mixed, so every map thread gets rows of both.
+    std::shuffle(dataset.values.begin(), dataset.values.end(), random);
+    for (V1 *value : dataset.values){
+        dataset.input.push_back({nullptr, value});
+    }
+    dataset.expected_total = spec.records;
+}
+
+
+void generate_key_values(const DatasetSpec &spec, Dataset &dataset){
+    std::mt19937_64 random(spec.seed);
+    ZipfSampler sampler(spec.keys, spec.skew);
+    for (uint64_t i = 0; i < spec.records; ++i){
+        auto *record = new KeyValueRecord();
+        record->key = sampler(random);
+        record->value = 1 + random() % MAX_VALUE;
+        dataset.expected_total += record->value;
+        dataset.values.push_back(record);
+        dataset.input.push_back({nullptr, record});
+    }
+}
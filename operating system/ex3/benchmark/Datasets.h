@@ -0,0 +1,117 @@
+#ifndef DATASETS_H
+#define DATASETS_H
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include "MapReduceClient.h"
+
+
+/*
+ * Synthetic inputs for the MapReduce benchmark. Every generator is deterministic for a given seed, and records what
+ * the output of its workload must add up to, so a run can be checked without a reference implementation.
+ */
+
+
+/**
+ * Draws keys in [0, num_of_keys) with a Zipf distribution: key k has a weight of 1 / (k + 1)^skew, so with skew 0 the
+ * keys are uniform, and the larger the skew the more of the draws fall on the first keys.
+ */
+class ZipfSampler {
+public:
+    ZipfSampler(uint64_t num_of_keys, double skew);
+
+    uint64_t operator()(std::mt19937_64 &random) const;
+
+private:
+    std::vector<double> cdf; // cdf[k] - the probability of drawing a key <= k.
+};
+
+
+/**
+ * A line of text (word count) or a document (inverted index): words separated by single spaces.
+ */
+class TextRecord : public V1 {
+public:
+    uint64_t id = 0; // The index of the record in the dataset.
+    std::string text;
+};
+
+
+/**
+ * A row of the customers table or of the orders table of the join.
+ */
+class JoinRecord : public V1 {
+public:
+    bool customer = false; // True for a customer, false for an order.
+    uint64_t key = 0; // The id of the customer (the join key).
+    uint64_t payload = 0; // The region of a customer, the amount of an order.
+};
+
+
+/**
+ * A (key, value) record of the skewed aggregation.
+ */
+class KeyValueRecord : public V1 {
+public:
+    uint64_t key = 0;
+    uint64_t value = 0;
+};
+
+
+/**
+ * The parameters of a dataset.
+ */
+struct DatasetSpec {
+    uint64_t records = 200000; // The number of input records (lines, documents, orders, key-value records).
+    uint64_t keys = 50000; // The key cardinality (the size of the vocabulary, the number of customers / keys).
+    double skew = 1.0; // The Zipf skew of the keys.
+    unsigned words = 16; // The number of words in every line or document.
+    uint64_t seed = 1;
+};
+
+
+/**
+ * A generated input, with what its output must add up to.
+ */
+struct Dataset {
+    std::vector<V1 *> values; // The records, owned by the dataset.
+    InputVec input; // The records as the input of a job (with nullptr keys).
+    uint64_t expected_total = 0; // The sum of the counts (word count, aggregation), the number of postings
+    // (inverted index), or the number of joined rows (join).
+
+    Dataset() = default;
+    Dataset(const Dataset &) = delete;
+    Dataset &operator=(const Dataset &) = delete;
+    ~Dataset();
+};
+
+
+/**
+ * Lines of words from a Zipf distributed vocabulary, for word count. expected_total is the number of words.
+ */
+void generate_lines(const DatasetSpec &spec, Dataset &dataset);
+
+
+/**
+ * Documents of words from a Zipf distributed vocabulary, for the inverted index. expected_total is the number of
+ * distinct (word, document) pairs.
+ */
+void generate_documents(const DatasetSpec &spec, Dataset &dataset);
+
+
+/**
+ * A customers table (one row per key) and an orders table (one row per record, whose customers are Zipf distributed),
+ * shuffled together. expected_total is the number of orders, since every order joins exactly one customer.
+ */
+void generate_join_tables(const DatasetSpec &spec, Dataset &dataset);
+
+
+/**
+ * Key-value records with Zipf distributed keys, for the skewed aggregation. expected_total is the sum of the values.
+ */
+void generate_key_values(const DatasetSpec &spec, Dataset &dataset);
+
+
+#endif //DATASETS_H
@@ -0,0 +1,793 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MapReduceFramework.h"
+#include "MapReduceExtensions.h"
+#include "Datasets.h"
+
+#define NUM_OF_WORKLOADS 4
+#define BYTES_PER_KB 1024.0
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+
+/*
+ * The MapReduce benchmark: runs word count, an inverted index, a join and a skewed aggregation on synthetic datasets,
+ * for every thread count of a sweep, and reports the throughput, the time of every phase and the peak RSS of every run.
+ * Every run is checked against the totals the generators recorded, so a framework change that breaks a workload fails
+ * the benchmark instead of speeding it up. With --workers the jobs run in worker processes (JobOptions::
+ * worker_processes) instead of threads, and the sweep is over the number of workers. The pairs and the peak RSS of the
+ * workers aren't measured then: pairs/s is 0, and the peak RSS is the one of the coordinating process.
+ *
+ * Usage: mapreduce_benchmark [--workloads wordcount,index,join,zipf] [--threads 1,2,4] [--workers 1,2,4]
+ *        [--records N] [--keys N] [--skew S] [--words N] [--repeat N] [--seed N] [--combine] [--hash] [--balanced]
+ *        [--pipeline] [--encode] [--csv]
+ */
+
+
+/**
+ * An intermediate and output key of the benchmark, which can hash itself for jobs that group by hash.
+ */
+class BenchKey : public K2, public K3 {
+public:
+    virtual size_t hash() const = 0;
+};
+
+
+/**
+ * A word (word count, inverted index).
+ */
+class WordKey : public BenchKey {
+public:
+    explicit WordKey(string word) : word(std::move(word)) {}
+
+    bool operator<(const K2 &other) const override { return word < static_cast<const WordKey &>(other).word; }
+    bool operator<(const K3 &other) const override { return word < static_cast<const WordKey &>(other).word; }
+    size_t hash() const override { return std::hash<string>()(word); }
+
+    string word;
+};
+
+
+/**
+ * An integer id (join, aggregation).
+ */
+class IdKey : public BenchKey {
+public:
+    explicit IdKey(uint64_t id) : id(id) {}
+
+    bool operator<(const K2 &other) const override { return id < static_cast<const IdKey &>(other).id; }
+    bool operator<(const K3 &other) const override { return id < static_cast<const IdKey &>(other).id; }
+    size_t hash() const override { return id * 0x9E3779B97F4A7C15ULL; }
+
+    uint64_t id;
+};
+
+
+/**
+ * A count or a sum (word count, aggregation).
+ */
+class Count : public V2, public V3 {
+public:
+    explicit Count(uint64_t count) : count(count) {}
+
+    uint64_t count;
+};
+
+
+/**
+ * The id of a document that has a word (inverted index).
+ */
+class DocumentId : public V2 {
+public:
+    explicit DocumentId(uint64_t id) : id(id) {}
+
+    uint64_t id;
+};
+
+
+/**
+ * The sorted ids of the documents that have a word (inverted index).
+ */
+class PostingList : public V3 {
+public:
+    vector<uint64_t> documents;
+};
+
+
+/**
+ * A row of one of the tables of the join, as a value.
+ */
+class JoinValue : public V2 {
+public:
+    JoinValue(bool customer, uint64_t payload) : customer(customer), payload(payload) {}
+
+    bool customer;
+    uint64_t payload;
+};
+
+
+/**
+ * The rows that one customer joined to (join).
+ */
+class JoinResult : public V3 {
+public:
+    uint64_t rows = 0; // The number of joined rows.
+    uint64_t amount = 0; // The total amount of the joined orders.
+};
+
+
+/**
+ * Sums the counts of a group of pairs, reusing the first pair for the sum.
+ * @param pairs - the group.
+ * @return the first pair, with the sum of the group.
+ */
+static IntermediatePair sum_counts(const IntermediateVec *pairs){
+    IntermediatePair first = pairs->at(0);
+    auto *total = static_cast<Count *>(first.second);
+    for (size_t i = 1; i < pairs->size(); ++i){
+        total->count += static_cast<const Count *>((*pairs)[i].second)->count;
+        delete (*pairs)[i].first;
+        delete (*pairs)[i].second;
+    }
+    return first;
+}
+
+
+/**
+ * Sums the counts of every key (word count, aggregation).
+ */
+class CountClient : public virtual MapReduceClient {
+public:
+    void reduce(const IntermediateVec *pairs, void *context) const override {
+        IntermediatePair total = sum_counts(pairs);
+        emit3(static_cast<BenchKey *>(total.first), static_cast<Count *>(total.second), context);
+    }
+};
+
+
+/**
+ * Counts the words of the lines.
+ */
+class WordCountClient : public CountClient {
+public:
+    void map(const K1 *key, const V1 *value, void *context) const override {
+        (void) key;
+        const string &text = static_cast<const TextRecord *>(value)->text;
+        size_t begin = 0;
+        while (begin < text.size()){
+            size_t end = text.find(' ', begin);
+            end = end == string::npos ? text.size() : end;
+            emit2(new WordKey(text.substr(begin, end - begin)), new Count(1), context);
+            begin = end + 1;
+        }
+    }
+};
+
+
+/**
+ * Sums the values of every key of the skewed records.
+ */
+class AggregationClient : public CountClient {
+public:
+    void map(const K1 *key, const V1 *value, void *context) const override {
+        (void) key;
+        auto *record = static_cast<const KeyValueRecord *>(value);
+        emit2(new IdKey(record->key), new Count(record->value), context);
+    }
+};
+
+
+/**
+ * A counting client with a map-side combiner, which sums the counts of every key before the shuffle.
+ */
+template<typename Client>
+class CombiningClient : public Client, public CombinerClient {
+public:
+    void combine(const IntermediateVec *pairs, void *context) const override {
+        IntermediatePair total = sum_counts(pairs);
+        emit2(total.first, total.second, context);
+    }
+};
+
+
+/**
+ * Builds the list of the documents of every word.
+ */
+class InvertedIndexClient : public MapReduceClient {
+public:
+    void map(const K1 *key, const V1 *value, void *context) const override {
+        (void) key;
+        auto *document = static_cast<const TextRecord *>(value);
+        vector<string> words;
+        size_t begin = 0;
+        while (begin < document->text.size()){
+            size_t end = document->text.find(' ', begin);
+            end = end == string::npos ? document->text.size() : end;
+            words.push_back(document->text.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        std::sort(words.begin(), words.end());
+        words.erase(std::unique(words.begin(), words.end()), words.end());
+        for (auto &word : words){
+            emit2(new WordKey(std::move(word)), new DocumentId(document->id), context);
+        }
+    }
+
+    void reduce(const IntermediateVec *pairs, void *context) const override {
+        auto *postings = new PostingList();
+        postings->documents.reserve(pairs->size());
+        for (const auto &it : *pairs){
+            postings->documents.push_back(static_cast<const DocumentId *>(it.second)->id);
+            delete it.second;
+        }
+        std::sort(postings->documents.begin(), postings->documents.end());
+        for (size_t i = 1; i < pairs->size(); ++i){
+            delete (*pairs)[i].first;
+        }
+        emit3(static_cast<BenchKey *>(pairs->at(0).first), postings, context);
+    }
+};
+
+
+/**
+ * Joins the orders to their customers, and sums the joined rows of every customer.
+ */
+class JoinClient : public MapReduceClient {
+public:
+    void map(const K1 *key, const V1 *value, void *context) const override {
+        (void) key;
+        auto *row = static_cast<const JoinRecord *>(value);
+        emit2(new IdKey(row->key), new JoinValue(row->customer, row->payload), context);
+    }
+
+    void reduce(const IntermediateVec *pairs, void *context) const override {
+        uint64_t customers = 0;
+        uint64_t orders = 0;
+        uint64_t amount = 0;
+        for (const auto &it : *pairs){
+            auto *row = static_cast<const JoinValue *>(it.second);
+            if (row->customer){
+                customers++;
+            } else {
+                orders++;
+                amount += row->payload;
+            }
+            delete it.second;
+        }
+        for (size_t i = 1; i < pairs->size(); ++i){
+            delete (*pairs)[i].first;
+        }
+        auto *result = new JoinResult();
+        result->rows = customers * orders;
+        result->amount = customers * amount;
+        emit3(static_cast<BenchKey *>(pairs->at(0).first), result, context);
+    }
+};
+
+
+/**
+ * Groups the benchmark keys by their own hash, for --hash.
+ */
+class BenchKeyHasher : public KeyHasher {
+public:
+    size_t hash(const K2 *key) const override { return static_cast<const BenchKey *>(key)->hash(); }
+
+    bool equal(const K2 *first, const K2 *second) const override { return !(*first < *second || *second < *first); }
+};
+
+
+/**
+ * Encodes the integer keys by their value, for --encode.
+ */
+class IdKeyEncoder : public KeyEncoder {
+public:
+    uint64_t encode(const K2 *key) const override { return static_cast<const IdKey *>(key)->id; }
+};
+
+
+/*
+ * The serialized forms of the keys and the values, for --workers: every object is appended to the record of its pair,
+ * and read back from the bytes after the previous object of the record.
+ */
+
+
+static void write_number(uint64_t number, string &out){
+    out.append((const char *) &number, sizeof(number));
+}
+
+
+static uint64_t read_number(const char *&data){
+    uint64_t number;
+    memcpy(&number, data, sizeof(number));
+    data += sizeof(number);
+    return number;
+}
+
+
+static void write_object(const WordKey &key, string &out){
+    write_number(key.word.size(), out);
+    out += key.word;
+}
+
+
+static void read_object(const char *&data, WordKey *&key){
+    uint64_t size = read_number(data);
+    key = new WordKey(string(data, size));
+    data += size;
+}
+
+
+static void write_object(const IdKey &key, string &out){
+    write_number(key.id, out);
+}
+
+
+static void read_object(const char *&data, IdKey *&key){
+    key = new IdKey(read_number(data));
+}
+
+
+static void write_object(const Count &count, string &out){
+    write_number(count.count, out);
+}
+
+
+static void read_object(const char *&data, Count *&count){
+    count = new Count(read_number(data));
+}
+
+
+static void write_object(const DocumentId &document, string &out){
+    write_number(document.id, out);
+}
+
+
+static void read_object(const char *&data, DocumentId *&document){
+    document = new DocumentId(read_number(data));
+}
+
+
+static void write_object(const PostingList &postings, string &out){
+    write_number(postings.documents.size(), out);
+    for (uint64_t document : postings.documents){
+        write_number(document, out);
+    }
+}
+
+
+static void read_object(const char *&data, PostingList *&postings){
+    postings = new PostingList();
+    postings->documents.resize(read_number(data));
+    for (auto &document : postings->documents){
+        document = read_number(data);
+    }
+}
+
+
+static void write_object(const JoinValue &row, string &out){
+    out.push_back((char) row.customer);
+    write_number(row.payload, out);
+}
+
+
+static void read_object(const char *&data, JoinValue *&row){
+    bool customer = *data++;
+    row = new JoinValue(customer, read_number(data));
+}
+
+
+static void write_object(const JoinResult &result, string &out){
+    write_number(result.rows, out);
+    write_number(result.amount, out);
+}
+
+
+static void read_object(const char *&data, JoinResult *&result){
+    result = new JoinResult();
+    result->rows = read_number(data);
+    result->amount = read_number(data);
+}
+
+
+/**
+ * Serializes the intermediate pairs of a workload, whose keys are Keys and values are Values.
+ */
+template<typename Key, typename Value>
+class BenchPairCodec : public KeyValueCodec {
+public:
+    void encode(const IntermediatePair &pair, string &out) const override {
+        write_object(*static_cast<const Key *>(pair.first), out);
+        write_object(*static_cast<const Value *>(pair.second), out);
+    }
+
+    IntermediatePair decode(const char *data, size_t size) const override {
+        (void) size;
+        Key *key;
+        Value *value;
+        read_object(data, key);
+        read_object(data, value);
+        return {key, value};
+    }
+
+    size_t footprint(const IntermediatePair &pair) const override {
+        (void) pair;
+        return sizeof(Key) + sizeof(Value);
+    }
+
+    void dispose(const IntermediatePair &pair) const override {
+        delete pair.first;
+        delete pair.second;
+    }
+};
+
+
+/**
+ * Serializes the output pairs of a workload, whose keys are Keys and values are Values.
+ */
+template<typename Key, typename Value>
+class BenchOutputCodec : public OutputCodec {
+public:
+    void encode(const OutputPair &pair, string &out) const override {
+        write_object(*static_cast<const Key *>(pair.first), out);
+        write_object(*static_cast<const Value *>(pair.second), out);
+    }
+
+    OutputPair decode(const char *data, size_t size) const override {
+        (void) size;
+        Key *key;
+        Value *value;
+        read_object(data, key);
+        read_object(data, value);
+        return {key, value};
+    }
+};
+
+
+/**
+ * A workload: its dataset, its clients, and how to add up its output.
+ */
+struct Workload {
+    const char *name;
+    void (*generate)(const DatasetSpec &, Dataset &);
+    const MapReduceClient *client; // The client without a combiner.
+    const MapReduceClient *combining_client; // The client with a combiner, nullptr if the workload has none.
+    bool integer_keys; // True if the keys are IdKeys (so the job can use the key encoder).
+    uint64_t (*output_total)(const OutputPair &); // What one output pair adds to expected_total.
+    const KeyValueCodec *codec; // Serializes the intermediate pairs, for --workers.
+    const OutputCodec *output_codec; // Serializes the output pairs, for --workers.
+};
+
+
+static uint64_t count_total(const OutputPair &pair){
+    return static_cast<const Count *>(pair.second)->count;
+}
+
+
+static uint64_t postings_total(const OutputPair &pair){
+    return static_cast<const PostingList *>(pair.second)->documents.size();
+}
+
+
+static uint64_t join_total(const OutputPair &pair){
+    return static_cast<const JoinResult *>(pair.second)->rows;
+}
+
+
+/**
+ * The settings of the benchmark, from the command line.
+ */
+struct BenchmarkOptions {
+    vector<string> workloads = {"wordcount", "index", "join", "zipf"};
+    vector<int> threads; // The thread counts of the sweep.
+    vector<int> workers; // The worker process counts of the sweep, empty if the jobs run in threads.
+    DatasetSpec spec;
+    int repeat = 1; // Every configuration is run this many times, and the fastest run is reported.
+    bool combine = false;
+    bool hash = false;
+    bool balanced = false;
+    bool pipeline = false;
+    bool encode = false;
+    bool csv = false;
+};
+
+
+/**
+ * The measurements of one run.
+ */
+struct RunResult {
+    double seconds = 0;
+    double phase_seconds[NUM_OF_PHASES] = {}; // The longest time a thread spent in every phase.
+    unsigned long pairs = 0; // The intermediate pairs the map threads emitted.
+    unsigned long outputs = 0;
+    double peak_rss_mb = 0;
+};
+
+
+/**
+ * Prints the usage of the benchmark and exits.
+ */
+static void usage_error(const char *message){
+    cerr << "mapreduce_benchmark: " << message << endl;
+    cerr << "usage: mapreduce_benchmark [--workloads wordcount,index,join,zipf] [--threads 1,2,4] "
+            "[--workers 1,2,4] [--records N] [--keys N] [--skew S] [--words N] [--repeat N] [--seed N] [--combine] "
+            "[--hash] [--balanced] [--pipeline] [--encode] [--csv]" << endl;
+    exit(1);
+}
+
+
+/**
+ * Splits a comma separated list.
+ */
+static vector<string> split_list(const string &list){
+    vector<string> items;
+    size_t begin = 0;
+    while (begin <= list.size()){
+        size_t end = list.find(',', begin);
+        end = end == string::npos ? list.size() : end;
+        if (end > begin){
+            items.push_back(list.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return items;
+}
+
+
+/**
+ * The default sweep: the powers of two up to the number of cores, and the number of cores.
+ */
+static vector<int> default_threads(){
+    int cores = std::max((int) std::thread::hardware_concurrency(), 1);
+    vector<int> threads;
+    for (int count = 1; count < cores; count *= 2){
+        threads.push_back(count);
+    }
+    threads.push_back(cores);
+    return threads;
+}
+
+
+/**
+ * Parses a comma separated list of positive counts.
+ */
+static vector<int> parse_counts(const string &list, const char *error){
+    vector<int> counts;
+    for (const auto &it : split_list(list)){
+        counts.push_back(atoi(it.c_str()));
+        if (counts.back() <= 0){
+            usage_error(error);
+        }
+    }
+    return counts;
+}
+
+
+/**
+ * Parses the command line.
+ */
+static BenchmarkOptions parse_options(int argc, char **argv){
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; ++i){
+        string flag = argv[i];
+        bool has_value = i + 1 < argc;
+        if (flag == "--combine"){
+            options.combine = true;
+        } else if (flag == "--hash"){
+            options.hash = true;
+        } else if (flag == "--balanced"){
+            options.balanced = true;
+        } else if (flag == "--pipeline"){
+            options.pipeline = true;
+        } else if (flag == "--encode"){
+            options.encode = true;
+        } else if (flag == "--csv"){
+            options.csv = true;
+        } else if (!has_value){
+            usage_error(("unknown flag or missing value: " + flag).c_str());
+        } else if (flag == "--workloads"){
+            options.workloads = split_list(argv[++i]);
+        } else if (flag == "--threads"){
+            options.threads = parse_counts(argv[++i], "thread counts must be positive.");
+        } else if (flag == "--workers"){
+            options.workers = parse_counts(argv[++i], "worker counts must be positive.");
+        } else if (flag == "--records"){
+            options.spec.records = strtoull(argv[++i], nullptr, 10);
+        } else if (flag == "--keys"){
+            options.spec.keys = std::max(strtoull(argv[++i], nullptr, 10), 1ULL);
+        } else if (flag == "--skew"){
+            options.spec.skew = atof(argv[++i]);
+        } else if (flag == "--words"){
+            options.spec.words = std::max(atoi(argv[++i]), 1);
+        } else if (flag == "--repeat"){
+            options.repeat = std::max(atoi(argv[++i]), 1);
+        } else if (flag == "--seed"){
+            options.spec.seed = strtoull(argv[++i], nullptr, 10);
+        } else {
+            usage_error(("unknown flag: " + flag).c_str());
+        }
+    }
+    if (options.threads.empty()){
+        options.threads = default_threads();
+    }
+    return options;
+}
+
+
+/**
+ * Resets the peak RSS of the process to its current RSS (Linux 4.0 and later), so the peak of every run is measured on
+ * its own. On older kernels the peak covers the whole process so far. The current RSS includes the dataset, and the
+ * memory that malloc kept from the previous runs.
+ */
+static void reset_peak_rss(){
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+}
+
+
+/**
+ * @return the peak RSS of the process in MB, from /proc/self/status (0 if it can't be read).
+ */
+static double peak_rss_mb(){
+    std::ifstream status("/proc/self/status");
+    string line;
+    while (std::getline(status, line)){
+        if (line.compare(0, 6, "VmHWM:") == 0){
+            return strtod(line.c_str() + 6, nullptr) / BYTES_PER_KB;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Runs a workload once, checks its output, and frees it.
+ * @param workload - the workload.
+ * @param dataset - its input.
+ * @param options - the settings of the benchmark.
+ * @param threads - the number of threads of the job, or of worker processes if options.workers isn't empty.
+ * @return the measurements of the run.
+ */
+static RunResult run_once(const Workload &workload, const Dataset &dataset, const BenchmarkOptions &options,
+                          int threads){
+    static BenchKeyHasher hasher;
+    static IdKeyEncoder encoder;
+    JobOptions job_options;
+    job_options.hasher = options.hash ? &hasher : nullptr;
+    job_options.balanced_reduce = options.balanced;
+    job_options.pipeline_reduce = options.pipeline;
+    job_options.key_encoder = options.encode && workload.integer_keys ? &encoder : nullptr;
+    if (!options.workers.empty()){
+        job_options.worker_processes = threads;
+        job_options.codec = workload.codec;
+        job_options.output_codec = workload.output_codec;
+    }
+    const MapReduceClient *client = options.combine && workload.combining_client ? workload.combining_client :
+                                    workload.client;
+    OutputVec output;
+    reset_peak_rss();
+    JobHandle job = startMapReduceJob(*client, dataset.input, output, threads, job_options);
+    JobStats stats;
+    getJobStats(job, &stats);
+    closeJobHandle(job);
+    RunResult result;
+    result.peak_rss_mb = peak_rss_mb();
+    result.seconds = stats.seconds;
+    for (const auto &thread : stats.threads){
+        for (int phase = 0; phase < NUM_OF_PHASES; ++phase){
+            result.phase_seconds[phase] = std::max(result.phase_seconds[phase], thread.phases[phase].seconds);
+        }
+        result.pairs += thread.phases[MAP_PHASE].bytes / sizeof(IntermediatePair);
+    }
+    result.outputs = output.size();
+    uint64_t total = 0;
+    for (const auto &pair : output){
+        total += workload.output_total(pair);
+        delete pair.first;
+        delete pair.second;
+    }
+    if (total != dataset.expected_total){
+        cerr << "mapreduce_benchmark: " << workload.name << " with " << threads
+             << (options.workers.empty() ? " threads" : " workers") << " added up to " << total << " instead of "
+             << dataset.expected_total << "." << endl;
+        exit(1);
+    }
+    return result;
+}
+
+
+/**
+ * Prints the header of the report.
+ * @param csv - true for a CSV report.
+ * @param sweep - the name of the swept count ("threads" or "workers").
+ */
+static void print_header(bool csv, const char *sweep){
+    if (csv){
+        printf("workload,%s,seconds,records_per_second,pairs_per_second,map,sort,shuffle,reduce,outputs,"
+               "peak_rss_mb\n", sweep);
+    } else {
+        printf("%-10s %7s %9s %12s %12s %8s %8s %8s %8s %9s %10s\n", "workload", sweep, "seconds", "records/s",
+               "pairs/s", "map", "sort", "shuffle", "reduce", "outputs", "peak MB");
+    }
+}
+
+
+/**
+ * Prints the measurements of a run.
+ */
+static void print_result(bool csv, const char *name, int threads, const Dataset &dataset, const RunResult &result){
+    double records_per_second = result.seconds > 0 ? dataset.input.size() / result.seconds : 0;
+    double pairs_per_second = result.seconds > 0 ? result.pairs / result.seconds : 0;
+    const double *phase = result.phase_seconds;
+    const char *format = csv ? "%s,%d,%.4f,%.0f,%.0f,%.4f,%.4f,%.4f,%.4f,%lu,%.1f\n" :
+                         "%-10s %7d %9.4f %12.0f %12.0f %8.4f %8.4f %8.4f %8.4f %9lu %10.1f\n";
+    printf(format, name, threads, result.seconds, records_per_second, pairs_per_second, phase[MAP_PHASE],
+           phase[SORT_PHASE], phase[SHUFFLE_PHASE], phase[REDUCE_PHASE], result.outputs, result.peak_rss_mb);
+    fflush(stdout);
+}
+
+
+int main(int argc, char **argv){
+    BenchmarkOptions options = parse_options(argc, argv);
+    WordCountClient word_count;
+    CombiningClient<WordCountClient> combining_word_count;
+    InvertedIndexClient inverted_index;
+    JoinClient join;
+    AggregationClient aggregation;
+    CombiningClient<AggregationClient> combining_aggregation;
+    BenchPairCodec<WordKey, Count> word_count_codec;
+    BenchOutputCodec<WordKey, Count> word_count_output_codec;
+    BenchPairCodec<WordKey, DocumentId> index_codec;
+    BenchOutputCodec<WordKey, PostingList> index_output_codec;
+    BenchPairCodec<IdKey, JoinValue> join_codec;
+    BenchOutputCodec<IdKey, JoinResult> join_output_codec;
+    BenchPairCodec<IdKey, Count> aggregation_codec;
+    BenchOutputCodec<IdKey, Count> aggregation_output_codec;
+    const Workload workloads[NUM_OF_WORKLOADS] = {
+            {"wordcount", generate_lines, &word_count, &combining_word_count, false, count_total, &word_count_codec,
+             &word_count_output_codec},
+            {"index", generate_documents, &inverted_index, nullptr, false, postings_total, &index_codec,
+             &index_output_codec},
+            {"join", generate_join_tables, &join, nullptr, true, join_total, &join_codec, &join_output_codec},
+            {"zipf", generate_key_values, &aggregation, &combining_aggregation, true, count_total, &aggregation_codec,
+             &aggregation_output_codec}
+    };
+    vector<const Workload *> selected;
+    for (const auto &name : options.workloads){
+        const Workload *workload = nullptr;
+        for (const auto &it : workloads){
+            workload = name == it.name ? &it : workload;
+        }
+        if (workload == nullptr){
+            usage_error(("unknown workload: " + name).c_str());
+        }
+        selected.push_back(workload);
+    }
+    const vector<int> &sweep = options.workers.empty() ? options.threads : options.workers;
+    print_header(options.csv, options.workers.empty() ? "threads" : "workers");
+    for (const Workload *workload : selected){
+        Dataset dataset;
+        workload->generate(options.spec, dataset);
+        for (int threads : sweep){
+            RunResult best;
+            for (int i = 0; i < options.repeat; ++i){
+                RunResult result = run_once(*workload, dataset, options, threads);
+                if (i == 0 || result.seconds < best.seconds){
+                    best = result;
+                }
+            }
+            print_result(options.csv, workload->name, threads, dataset, best);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "MapReduceFramework.h"
+#include "MapReduceExtensions.h"
+
+
+/*
+ * Checks JobOptions::worker_processes: a job that runs in worker processes has the same output as the job in threads,
+ * and a worker process that dies fails the job instead of hanging it.
+ */
+
+
+#define NUM_OF_RECORDS 20000
+#define NUM_OF_KEYS 3000
+#define NUM_OF_THREADS 3
+#define FAILED_RECORD 12345 // The record whose map kills its worker process, in the failure case.
+#define FAILURE_TIMEOUT 30 // The seconds the failed job may take before it counts as hung.
+
+using std::string;
+
+
+class Record : public V1 {
+public:
+    explicit Record(int value) : value(value) {}
+
+    int value;
+};
+
+
+class Key : public K2, public K3 {
+public:
+    explicit Key(int key) : key(key) {}
+
+    bool operator<(const K2 &other) const override { return key < static_cast<const Key &>(other).key; }
+    bool operator<(const K3 &other) const override { return key < static_cast<const Key &>(other).key; }
+
+    int key;
+};
+
+
+class Sum : public V2, public V3 {
+public:
+    explicit Sum(long sum) : sum(sum) {}
+
+    long sum;
+};
+
+
+/**
+ * Sums a few keys of every record, with a hot key that every record has.
+ */
+class SumClient : public MapReduceClient {
+public:
+    bool fail = false; // If true, mapping FAILED_RECORD kills the process.
+
+    void map(const K1 *key, const V1 *value, void *context) const override {
+        (void) key;
+        int record = static_cast<const Record *>(value)->value;
+        if (fail && record == FAILED_RECORD){
+            _exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < 3; ++i){
+            emit2(new Key((record * 7 + i * 13) % NUM_OF_KEYS), new Sum(record % 10), context);
+        }
+        emit2(new Key(0), new Sum(1), context);
+    }
+
+    void reduce(const IntermediateVec *pairs, void *context) const override {
+        long sum = 0;
+        for (const auto &pair : *pairs){
+            sum += static_cast<const Sum *>(pair.second)->sum;
+            delete pair.second;
+        }
+        for (size_t i = 1; i < pairs->size(); ++i){
+            delete (*pairs)[i].first;
+        }
+        emit3(static_cast<Key *>(pairs->at(0).first), new Sum(sum), context);
+    }
+};
+
+
+class PairCodec : public KeyValueCodec {
+public:
+    void encode(const IntermediatePair &pair, string &out) const override {
+        int key = static_cast<const Key *>(pair.first)->key;
+        long sum = static_cast<const Sum *>(pair.second)->sum;
+        out.append((const char *) &key, sizeof(key));
+        out.append((const char *) &sum, sizeof(sum));
+    }
+
+    IntermediatePair decode(const char *data, size_t size) const override {
+        (void) size;
+        int key;
+        long sum;
+        memcpy(&key, data, sizeof(key));
+        memcpy(&sum, data + sizeof(key), sizeof(sum));
+        return {new Key(key), new Sum(sum)};
+    }
+
+    size_t footprint(const IntermediatePair &pair) const override {
+        (void) pair;
+        return sizeof(Key) + sizeof(Sum);
+    }
+
+    void dispose(const IntermediatePair &pair) const override {
+        delete pair.first;
+        delete pair.second;
+    }
+};
+
+
+class OutputPairCodec : public OutputCodec {
+public:
+    void encode(const OutputPair &pair, string &out) const override {
+        int key = static_cast<const Key *>(pair.first)->key;
+        long sum = static_cast<const Sum *>(pair.second)->sum;
+        out.append((const char *) &key, sizeof(key));
+        out.append((const char *) &sum, sizeof(sum));
+    }
+
+    OutputPair decode(const char *data, size_t size) const override {
+        (void) size;
+        int key;
+        long sum;
+        memcpy(&key, data, sizeof(key));
+        memcpy(&sum, data + sizeof(key), sizeof(sum));
+        return {new Key(key), new Sum(sum)};
+    }
+};
+
+
+PairCodec pair_codec;
+OutputPairCodec output_codec;
+
+
+/**
+ * Runs a job and returns its output as a string of "key:sum" items, in the order of the output vector.
+ * @param client - the client.
+ * @param input - the input.
+ * @param workers - the number of worker processes, 0 to run the job in threads.
+ */
+string run_job(const SumClient &client, const InputVec &input, int workers){
+    JobOptions options;
+    options.worker_processes = workers;
+    options.codec = &pair_codec;
+    options.output_codec = &output_codec;
+    OutputVec output;
+    JobHandle job = startMapReduceJob(client, input, output, NUM_OF_THREADS, options);
+    closeJobHandle(job);
+    string result;
+    for (const auto &pair : output){
+        result += std::to_string(static_cast<const Key *>(pair.first)->key) + ":" +
+                  std::to_string(static_cast<const Sum *>(pair.second)->sum) + " ";
+        delete pair.first;
+        delete pair.second;
+    }
+    return result;
+}
+
+
+int main(){
+    InputVec input;
+    for (int i = 0; i < NUM_OF_RECORDS; ++i){
+        input.push_back({nullptr, new Record(i)});
+    }
+    int fails = 0;
+    SumClient client;
+
+    // A worker that dies: the process of the job has to exit with a failure, in a child so the test goes on. The child
+    // is forked before this process runs a job, since a fork has only the calling thread, and not the threads that
+    // run the jobs.
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0){
+        alarm(FAILURE_TIMEOUT);
+        client.fail = true;
+        run_job(client, input, 4);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_FAILURE){
+        printf("a job whose worker process died didn't fail\n");
+        fails++;
+    }
+
+    string expected = run_job(client, input, 0);
+    for (int workers : {1, 2, 4}){
+        if (run_job(client, input, workers) != expected){
+            printf("the output with %d worker processes differs from the output in threads\n", workers);
+            fails++;
+        }
+    }
+
+    for (const auto &pair : input){
+        delete pair.second;
+    }
+    printf("%s\n", fails ? "FAIL" : "PASS");
+    return fails ? 1 : 0;
+}
@@ -1,27 +1,23 @@
 #include "VirtualMemory.h"
+#include "VirtualMemoryExtensions.h"
 #include "PhysicalMemory.h"
 
 
 #define INIT 0
-#define ROOT_LEVEL 0
 #define CLEAR_VAL 0
 #define ROOT_ADDRESS 0
 #define FIRST_INDEX 0
 #define ONE_LONG_LONG 1LL
 #define FAIL 0
 #define SUCCESS 1
-#define SAVING 4
-#define FRAME_INDEX 3
-#define ROW_NUMBER 2
-#define PARENT 1
-#define PAGE_INDEX 0
-
-/**
- * Gets the number of bits that represent how many of bits of the virtual address are in the preset for determining
- * which child of the root table to traverse down to.
- */
-#define ROOT_WIDTH ((VIRTUAL_ADDRESS_WIDTH % OFFSET_WIDTH == 0) ? OFFSET_WIDTH : (VIRTUAL_ADDRESS_WIDTH % OFFSET_WIDTH))
-
+#define NO_PAGE NUM_PAGES // frame_page of a frame that stores a table.
+#define NOT_EMPTY NUM_FRAMES // empty_position of a table that is not in empty_tables.
+#ifndef TLB_SETS
+#define TLB_SETS 16 // The number of sets of the translation cache (a power of 2).
+#endif
+#ifndef TLB_WAYS
+#define TLB_WAYS 4 // The number of translations in every set.
+#endif
 
 /**
  * Gets offset of the virtual address (address).
@@ -54,82 +50,152 @@
 
 
 /**
- * Gets the number of children they have.
+ * Gets the max tree level (TABLES_DEPTH - 1)
  */
-#define CHILDREN(frame_index) (frame_index == ROOT_ADDRESS) ? ONE_LONG_LONG << ROOT_WIDTH : PAGE_SIZE
+#define MAX_TREE_LEVEL (TABLES_DEPTH - 1)
 
 
 /**
- * Gets max frame there is we can have.
+ * Shifts address by OFFSET_WIDTH to the right.
  */
-#define MAX_FRAME(max_frame_index, frame_index) (max_frame_index < frame_index + 1) ? frame_index + 1 : max_frame_index
+#define SHIFT_BY_OFFSET_RIGHT(address) (address >> OFFSET_WIDTH)
 
 
 /**
- * Gets the max tree level (TABLES_DEPTH - 1)
+ * A cached translation of a page to the frame that stores it.
  */
-#define MAX_TREE_LEVEL (TABLES_DEPTH - 1)
+struct TlbEntry {
+    bool valid; // True if the entry holds a translation.
+    uint64_t page_index; // The page.
+    uint64_t frame_index; // The frame that stores the page.
+    uint64_t last_use; // The value of tlb_clock when the entry was last used, for LRU replacement in its set.
+};
 
 
 /**
- * Adds one to a.
+ * The translation cache, indexed by the low bits of the page index, and its counters.
  */
-#define ADD_ONE(a) (a + 1)
+TlbEntry tlb[TLB_SETS][TLB_WAYS];
+uint64_t tlb_clock = INIT;
+uint64_t tlb_hits = INIT;
+uint64_t tlb_misses = INIT;
 
 
 /**
- * Shifts address by OFFSET_WIDTH to the right.
+ * Looks a page up in the translation cache.
+ * @param page_index - the page.
+ * @param frame_index - will store the frame of the page, on a hit.
+ * @return true on a hit and false otherwise.
  */
-#define SHIFT_BY_OFFSET_RIGHT(address) (address >> OFFSET_WIDTH)
+bool tlb_lookup(uint64_t page_index, uint64_t &frame_index){
+    TlbEntry *set = tlb[page_index & (TLB_SETS - 1)];
+    for (int i = 0; i < TLB_WAYS; ++i) {
+        if (set[i].valid && set[i].page_index == page_index) {
+            set[i].last_use = ++tlb_clock;
+            frame_index = set[i].frame_index;
+            tlb_hits++;
+            return true;
+        }
+    }
+    tlb_misses++;
+    return false;
+}
+
+
+/**
+ * Caches the translation of a page, replacing an invalid entry of its set or else the least recently used one.
+ * @param page_index - the page.
+ * @param frame_index - the frame that stores it.
+ */
+void tlb_insert(uint64_t page_index, uint64_t frame_index){
+    TlbEntry *set = tlb[page_index & (TLB_SETS - 1)];
+    TlbEntry *victim = set;
+    for (int i = 0; i < TLB_WAYS; ++i) {
+        if (!set[i].valid) {
+            victim = set + i;
+            break;
+        }
+        if (set[i].last_use < victim->last_use) {
+            victim = set + i;
+        }
+    }
+    victim->valid = true;
+    victim->page_index = page_index;
+    victim->frame_index = frame_index;
+    victim->last_use = ++tlb_clock;
+}
 
 
 /**
- * Shifts address by OFFSET_WIDTH to the left.
+ * Drops the cached translation of a page that was evicted.
+ * @param page_index - the page.
  */
-#define SHIFT_BY_OFFSET_LEFT(address) (address << OFFSET_WIDTH)
+void tlb_invalidate_page(uint64_t page_index){
+    TlbEntry *set = tlb[page_index & (TLB_SETS - 1)];
+    for (int i = 0; i < TLB_WAYS; ++i) {
+        if (set[i].page_index == page_index) {
+            set[i].valid = false;
+        }
+    }
+}
 
 
 /**
- * Checks if this frame is empty.
- * @param frame_index - the frame index.
- * @return true if frame is empty and false otherwise.
+ * Drops every cached translation to a frame that is taken for another use.
+ * @param frame_index - the frame.
  */
-bool check_frame_empty(uint64_t frame_index){
-    int check = ROOT_ADDRESS;
-    for (uint64_t i = 0; i < PAGE_SIZE; ++i)
-    {
-        PMread(frame_index * PAGE_SIZE + i, &check);
-        if (check != ROOT_ADDRESS)
-        {
-            return false;
+void tlb_invalidate_frame(uint64_t frame_index){
+    for (auto &set : tlb) {
+        for (TlbEntry &entry : set) {
+            if (entry.frame_index == frame_index) {
+                entry.valid = false;
+            }
         }
     }
-    return true;
 }
 
 
 /**
- * Clears the frame in frame index.
- * @param frame_index - the frame index.
+ * Drops all the cached translations and resets the counters.
  */
-void clear_table(uint64_t frame_index){
-    for (uint64_t i  = 0; i < PAGE_SIZE ; ++i) {
-        PMwrite(frame_index * PAGE_SIZE + i,CLEAR_VAL);
+void tlb_flush(){
+    for (auto &set : tlb) {
+        for (TlbEntry &entry : set) {
+            entry.valid = false;
+        }
     }
+    tlb_clock = INIT;
+    tlb_hits = INIT;
+    tlb_misses = INIT;
 }
 
 
 /**
- * Converts a tree route stored in an array to its decimal representation.
- * @param array_depth - the route stored in array.
- * @return the number in decimal representation.
+ * Incremental bookkeeping of the frames, so a fault never has to walk the whole tree of tables:
+ * next_unused_frame - the frames from it on were never used since VMinitialize.
+ * live_entries[frame] - the number of non zero entries in a table.
+ * frame_entry[frame] - the physical address of the entry that references the frame (in its parent table).
+ * frame_page[frame] - the page that the frame stores, or NO_PAGE if the frame is a table.
+ * empty_tables - the tables (other than the root) whose entries are all zero, that can be unlinked and reused;
+ * empty_position[frame] is the index of the frame in it, or NOT_EMPTY.
+ */
+uint64_t next_unused_frame = ONE_LONG_LONG;
+uint64_t live_entries[NUM_FRAMES];
+uint64_t frame_entry[NUM_FRAMES];
+uint64_t frame_page[NUM_FRAMES];
+uint64_t empty_tables[NUM_FRAMES];
+uint64_t empty_position[NUM_FRAMES];
+uint64_t num_of_empty_tables = INIT;
+
+
+/**
+ * Clears the frame in frame index.
+ * @param frame_index - the frame index.
  */
-uint64_t convert_tree_route_to_decimal(const uint64_t *array_depth){
-    uint64_t temp = ROOT_ADDRESS;
-    for (int i = 0; i < TABLES_DEPTH; ++i) {
-        temp = SHIFT_BY_OFFSET_LEFT(temp) | array_depth[i];
+void clear_table(uint64_t frame_index){
+    for (uint64_t i  = 0; i < PAGE_SIZE ; ++i) {
+        PMwrite(frame_index * PAGE_SIZE + i,CLEAR_VAL);
     }
-    return temp;
 }
 
 
@@ -149,135 +215,117 @@ void get_bites_array(uint64_t page_index, uint64_t *array_depth){
 
 
 /**
- * Finds the max value of the circular distance between the current page and the page that needs to be swapped in
- * (recursion base case).
- * @param saving - an array representing all the elements will need for calling PMevict.
- * @param page_route - an array representing the route in the table tree that leads to the page to evict.
- * @param max_value - the current max value of.
- * @param page_swapped - the page index of the page to be restored.
- * @param frame_index - the current root frame (table) for the algorithm.
- * @param row_number - the current row number.
- * @param parent - the parent frame of page_to_evict.
+ * Adds a table to empty_tables.
+ * @param frame_index - the table.
  */
-void finding_max_value(uint64_t *saving, uint64_t *page_route, uint64_t &max_value, uint64_t page_swapped,
-                       word_t frame_index, uint64_t row_number, uint64_t parent){
-    uint64_t this_value;
-    uint64_t page_index = convert_tree_route_to_decimal(page_route);
-    uint64_t distance = DISTANCE(page_swapped, page_index);
-    this_value = CIRCULAR_DISTANCE(distance);
-    if (this_value > max_value) {
-        saving[PAGE_INDEX] =  page_index;
-        saving[PARENT] =  parent;
-        saving[ROW_NUMBER] =  row_number;
-        saving[FRAME_INDEX] =  frame_index;
-        max_value = this_value;
-    }
+void push_empty_table(uint64_t frame_index){
+    empty_position[frame_index] = num_of_empty_tables;
+    empty_tables[num_of_empty_tables++] = frame_index;
 }
 
 
 /**
- * DFS implementation for finding the frame index of page to evict. maximum value of
- * min{NUM_PAGES - |page_swapped - page_to_evict_index|, |page_swapped - page_to_evict_index|} is achieved with the page
- * stored in the frame page_to_evict - the page to evict.
- * @param frame_index - the current root frame (table) for the algorithm.
- * @param page_swapped - the page index of the page to be restored.
- * @param tree_level - the current tree level.
- * @param max_value - the current max value of.
- * min{NUM_PAGES - |page_swapped - page_to_evict_index|, |page_swapped - page_to_evict_index|}.
- * @param tree_level - the current tree level.
- * @param saving - an array representing all the elements will need for calling PMevict.
- * @param page_route - an array representing the route in the table tree that leads to the page to evict.
- * @param row_number - the current row number.
- * @param parent - the parent frame of page_to_evict.
+ * Removes a table from empty_tables (if it is there), by moving the last table of the array to its place.
+ * @param frame_index - the table.
  */
-void dfs_max_frame(word_t frame_index, uint64_t page_swapped, int tree_level,uint64_t &max_value, uint64_t *saving,
-                   uint64_t *page_route, uint64_t row_number, uint64_t parent){
-    if (tree_level == TABLES_DEPTH) {
-        finding_max_value(saving, page_route, max_value, page_swapped, frame_index, row_number, parent);
+void remove_empty_table(uint64_t frame_index){
+    uint64_t position = empty_position[frame_index];
+    if (position == NOT_EMPTY) {
         return;
     }
-    uint64_t num_of_children = CHILDREN(frame_index);
-    for (uint64_t i=0; i < num_of_children; i++){
-        word_t this_frame_index = FIRST_INDEX;
-        PMread(frame_index * PAGE_SIZE + i, &this_frame_index);
-        if (this_frame_index != FIRST_INDEX) {
-            page_route[tree_level] = i;
-            dfs_max_frame(this_frame_index, page_swapped, ADD_ONE(tree_level),
-                          max_value, saving, page_route, i, frame_index); // recursive call
-        }
-    }
-    if (frame_index == INIT){
-        PMevict(saving[FRAME_INDEX], saving[PAGE_INDEX]);
-        PMwrite(saving[PARENT] * PAGE_SIZE + saving[ROW_NUMBER], CLEAR_VAL);
+    uint64_t last = empty_tables[--num_of_empty_tables];
+    empty_tables[position] = last;
+    empty_position[last] = position;
+    empty_position[frame_index] = NOT_EMPTY;
+}
+
+
+/**
+ * Writes a reference to a frame in the entry of its parent table, and updates the bookkeeping of both.
+ * @param frame_index - the frame.
+ * @param entry - the physical address of the entry.
+ * @param page_index - the page that the frame stores, or NO_PAGE if it is a table.
+ */
+void link_frame(uint64_t frame_index, uint64_t entry, uint64_t page_index){
+    uint64_t parent = entry / PAGE_SIZE;
+    PMwrite(entry, (word_t) frame_index);
+    if (live_entries[parent]++ == INIT) {
+        remove_empty_table(parent);
     }
+    frame_entry[frame_index] = entry;
+    frame_page[frame_index] = page_index;
+    live_entries[frame_index] = INIT;
+    empty_position[frame_index] = NOT_EMPTY;
 }
 
 
 /**
- * DFS implementation for finding the max frame index in use or a frame index of an empty frame.
- * @param frame_index - the current root frame (table) for the algorithm.
- * @param max_frame_index - the current max frame index.
- * @param parent - parent of current frame.
- * @param row_in_parent - the row in the parent page where the reference to frame_index is stored.
- * @param finished_empty - will store the index of an empty frame if exist and 0 otherwise.
- * @param tree_level - the current tree level.
- * @param currently_working_on - a frame index of the frame we are currently working on (it will point to the output of
- * the algorithm) - won't count as an empty frame.
- * @return the max used frame index + 1.
+ * Clears the entry that references a frame, and adds its parent to empty_tables if this was its last entry.
+ * @param frame_index - the frame.
  */
-uint64_t find_free_frame(uint64_t frame_index, uint64_t max_frame_index, uint64_t parent, uint64_t row_in_parent,
-                         uint64_t& finished_empty, int tree_level, uint64_t currently_working_on){
-    if (tree_level == TABLES_DEPTH){
-        // Base of recursion:
-        return MAX_FRAME(max_frame_index, frame_index);
+void unlink_frame(uint64_t frame_index){
+    uint64_t entry = frame_entry[frame_index];
+    uint64_t parent = entry / PAGE_SIZE;
+    PMwrite(entry, CLEAR_VAL);
+    if (--live_entries[parent] == INIT && parent != ROOT_ADDRESS) {
+        push_empty_table(parent);
     }
-    uint64_t num_of_children = CHILDREN(frame_index);
-    for (uint64_t i = 0; i < num_of_children; i++){
-        word_t this_frame_index = FIRST_INDEX;
-        PMread(frame_index * PAGE_SIZE + i, &this_frame_index);
-        if (this_frame_index != FIRST_INDEX) {
-            max_frame_index = find_free_frame(this_frame_index, max_frame_index, frame_index, i, finished_empty,
-                                              ADD_ONE(tree_level), currently_working_on); // recursive call
+    frame_page[frame_index] = NO_PAGE;
+}
+
+
+/**
+ * Finds the frame of the page to evict: the page that maximizes
+ * min{NUM_PAGES - |page_swapped - page_to_evict_index|, |page_swapped - page_to_evict_index|}, and the one with the
+ * smallest index among those.
+ * @param page_swapped - the page index of the page to be restored.
+ * @return the frame that stores the page to evict.
+ */
+uint64_t find_frame_to_evict(uint64_t page_swapped){
+    uint64_t max_value = INIT;
+    uint64_t max_frame = ROOT_ADDRESS;
+    for (uint64_t frame_index = 1; frame_index < next_unused_frame; ++frame_index) {
+        uint64_t page_index = frame_page[frame_index];
+        if (page_index == NO_PAGE) {
+            continue;
+        }
+        uint64_t distance = DISTANCE(page_swapped, page_index);
+        uint64_t this_value = CIRCULAR_DISTANCE(distance);
+        if (this_value > max_value || (this_value == max_value && page_index < frame_page[max_frame])) {
+            max_value = this_value;
+            max_frame = frame_index;
         }
-        max_frame_index = MAX_FRAME(max_frame_index, frame_index);
-    }
-    // in this case we check if there is an empty frame
-    if (frame_index != FIRST_INDEX && check_frame_empty(frame_index)
-    && frame_index != currently_working_on && !finished_empty){
-        PMwrite(parent * PAGE_SIZE + row_in_parent, CLEAR_VAL);
-        finished_empty = frame_index;
     }
-    return max_frame_index;
+    return max_frame;
 }
 
 
 /**
- * Gets an empty frame or evicts a frame and writes a reference to it in the parent table.
- * @param current_frame - the frame that we are currently at
- * @param curr_parent - the frame index of the frame that will store the reference to 'current_frame'.
+ * Gets a frame for a new table or page: an empty table (unlinked from its parent), else a frame that was never used,
+ * else the frame of an evicted page.
+ * @param current_frame - the page index of the page to be restored.
+ * @param curr_parent - the frame index of the frame that will store the reference to the returned frame (it won't
+ * be taken even if it is an empty table).
  * @return an available frame.
  */
 uint64_t get_frame(uint64_t current_frame, uint64_t curr_parent){
-    uint64_t empty_frame = ROOT_ADDRESS; // will hold an empty frame index if exists.
-    uint64_t check = find_free_frame(FIRST_INDEX, FIRST_INDEX, ROOT_ADDRESS, FIRST_INDEX, empty_frame, ROOT_LEVEL,
-                                     curr_parent);
-    // if there is an empty frame
-    if (empty_frame != FIRST_INDEX){
-        check = empty_frame;
-    }
-    // if the frame index we got is bigger then the maximum number of frames, then evict a frame:
-    if(check >= NUM_FRAMES){
-        // creating all of these parameters in order to pass them to 'dfs_max_frame'.
-        uint64_t page_route[TABLES_DEPTH];
-        for (uint64_t & j : page_route) {
-            j = FIRST_INDEX;
+    for (uint64_t i = num_of_empty_tables; i > 0; --i) {
+        uint64_t empty_frame = empty_tables[i - 1];
+        if (empty_frame != curr_parent) {
+            remove_empty_table(empty_frame);
+            unlink_frame(empty_frame);
+            tlb_invalidate_frame(empty_frame);
+            return empty_frame;
         }
-        uint64_t saving_data[SAVING];
-        uint64_t max_value = INIT;
-        dfs_max_frame(INIT, current_frame, ROOT_LEVEL, max_value, saving_data, page_route, INIT, INIT);
-        check = saving_data[FRAME_INDEX];
     }
-    return check;
+    if (next_unused_frame < NUM_FRAMES) {
+        return next_unused_frame++;
+    }
+    uint64_t evict_frame = find_frame_to_evict(current_frame);
+    tlb_invalidate_page(frame_page[evict_frame]);
+    PMevict(evict_frame, frame_page[evict_frame]);
+    unlink_frame(evict_frame);
+    return evict_frame;
 }
 
 
@@ -305,7 +353,8 @@ uint64_t get_physical_address(uint64_t page_index){
             if (i != MAX_TREE_LEVEL){
                 clear_table(curr_child);
             }
-            PMwrite(curr_parent * PAGE_SIZE + get_page_depth[i], curr_child);
+            link_frame(curr_child, curr_parent * PAGE_SIZE + get_page_depth[i],
+                       restored ? page_index : NO_PAGE);
         }
         curr_parent = curr_child;
     }
@@ -321,6 +370,34 @@ uint64_t get_physical_address(uint64_t page_index){
  */
 void VMinitialize() {
     clear_table(FIRST_INDEX);
+    next_unused_frame = ONE_LONG_LONG;
+    num_of_empty_tables = INIT;
+    live_entries[ROOT_ADDRESS] = INIT;
+    frame_page[ROOT_ADDRESS] = NO_PAGE;
+    empty_position[ROOT_ADDRESS] = NOT_EMPTY;
+    tlb_flush();
+}
+
+
+/**
+ * Gets the frame that stores a page, from the translation cache or else by walking the tables (and caching the
+ * result).
+ * @param page_index - the page index of the page.
+ * @return frame index that stores the page.
+ */
+uint64_t translate(uint64_t page_index){
+    uint64_t frame_index = ROOT_ADDRESS;
+    if (!tlb_lookup(page_index, frame_index)) {
+        frame_index = get_physical_address(page_index);
+        tlb_insert(page_index, frame_index);
+    }
+    return frame_index;
+}
+
+
+void VMgetTlbStats(TlbStats *stats) {
+    stats->hits = tlb_hits;
+    stats->misses = tlb_misses;
 }
 
 
@@ -335,7 +412,7 @@ int VMread(uint64_t virtualAddress, word_t *value) {
     if (virtualAddress >= VIRTUAL_MEMORY_SIZE){
         return FAIL;
     }
-    uint64_t address = get_physical_address(NUM_OF_PAGES(virtualAddress));
+    uint64_t address = translate(NUM_OF_PAGES(virtualAddress));
     PMread(address * PAGE_SIZE + OFFSET(virtualAddress), value);
     return SUCCESS;
 }
@@ -351,7 +428,7 @@ int VMwrite(uint64_t virtualAddress, word_t value) {
     if (virtualAddress >= VIRTUAL_MEMORY_SIZE){
         return FAIL;
     }
-    uint64_t address = get_physical_address(NUM_OF_PAGES(virtualAddress));
+    uint64_t address = translate(NUM_OF_PAGES(virtualAddress));
     PMwrite(address * PAGE_SIZE + OFFSET(virtualAddress), value);
     return SUCCESS;
 }
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+
+/**
+ * The counters of the translation cache: a hit is a VMread / VMwrite whose page was translated without walking the
+ * tables. VMinitialize resets them.
+ */
+struct TlbStats {
+    uint64_t hits;
+    uint64_t misses;
+};
+
+
+/**
+ * Fills stats with the counters of the translation cache.
+ */
+void VMgetTlbStats(TlbStats *stats);